@@ -0,0 +1,80 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "bench.hpp"
+
+
+
+// Every allocation of the program goes through these, including ones made by the standard library.
+static std::atomic<size_t> allocations = 0;
+
+size_t bench::allocation_count() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+
+static void* counted_alloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+static void* counted_aligned_alloc(size_t size, std::align_val_t align) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = (size_t)align;
+    size = (size + alignment - 1) / alignment * alignment;
+    #ifdef _WIN32
+    return _aligned_malloc(size ? size : alignment, alignment);
+    #else
+    return std::aligned_alloc(alignment, size ? size : alignment);
+    #endif
+}
+
+static void aligned_free(void *ptr) {
+    #ifdef _WIN32
+    _aligned_free(ptr);
+    #else
+    std::free(ptr);
+    #endif
+}
+
+
+void* operator new(size_t size) {
+    if (void *ptr = counted_alloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    if (void *ptr = counted_aligned_alloc(size, align)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { aligned_free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { aligned_free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { aligned_free(ptr); }
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept { aligned_free(ptr); }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <benchmark/benchmark.h>
+
+#include "project.hpp"
+
+
+
+namespace bench {
+    // Number of operator new calls made by any thread since start of the program, malloc() calls of C libraries are not counted.
+    size_t allocation_count();
+
+
+    // Html similar to what maddy makes from a wiki page, dense with page links, external links, anchors and images.
+    // Fixture is generated once for every size and is about `size` bytes long.
+    const std::string& html_fixture(size_t size);
+
+    // Project with pages that links in html_fixture() point to.
+    chm::ProjectConfig& config_fixture();
+    chm::ProjectData& project_fixture();
+
+
+    // Fixture sizes from 256 B to 4 MiB.
+    void html_sizes(benchmark::internal::Benchmark *b);
+
+
+    // Measures one kernel run for one fixture size.
+    // Reports time per byte, allocations per call and complexity N, so `->Complexity()` shows how the kernel scales.
+    //
+    // If one call of the same kernel with a smaller fixture took longer than time_budget, bigger sizes are skipped.
+    // Otherwise a quadratic kernel would stall the whole run on multi MB pages, and the skip itself shows up in the report.
+    class Kernel {
+    public:
+        static constexpr std::chrono::milliseconds time_budget{2000};
+
+        Kernel(benchmark::State &state, std::string_view name, size_t input_size);
+        ~Kernel();
+
+        // False if this size should be skipped, check before the benchmark loop.
+        bool should_run() const { return !skipped; }
+
+        // Scope of a single kernel call, anything outside of it is not counted as allocations of the kernel.
+        class Call {
+        public:
+            explicit Call(Kernel &kernel) : kernel(kernel), allocations(allocation_count()), start(std::chrono::steady_clock::now()) {}
+            ~Call() {
+                kernel.allocations += allocation_count() - allocations;
+                kernel.elapsed += std::chrono::steady_clock::now() - start;
+                kernel.calls++;
+            }
+
+        private:
+            Kernel &kernel;
+            size_t allocations;
+            std::chrono::steady_clock::time_point start;
+        };
+
+        Call call() { return Call(*this); }
+
+    private:
+        benchmark::State &state;
+        std::string name;
+        size_t input_size;
+        bool skipped = false;
+
+        size_t allocations = 0;
+        size_t calls = 0;
+        std::chrono::steady_clock::duration elapsed = {};
+    };
+}
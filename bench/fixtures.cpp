@@ -0,0 +1,104 @@
+#include <map>
+#include <unordered_map>
+
+#include "bench.hpp"
+
+
+
+// Repeated until the fixture is big enough, every block has slightly different numbers so nothing is cached by accident.
+static void append_html_block(std::string &html, size_t n) {
+    std::string page = "Page-" + std::to_string(n % 64);
+    std::string num = std::to_string(n);
+
+    html += "<h2>Section " + num + " of " + page + "</h2>\n";
+    html += "<p>Some text about <a href=\"" + page + "\">" + page + "</a>, see <a href=\"https://example.com/docs/" + num + "\">docs</a>";
+    html += " and <a href=\"#section-" + num + "\">this section</a>. Markdown style links <a href=\"./" + page + ".md#install\">work too</a>.</p>\n";
+    html += "<p><img src=\"https://images.example.com/wiki/" + num + ".png\" alt=\"screenshot " + num + "\"/>";
+    html += " <img src=\"images/local-" + num + ".png\" alt=\"local\"/></p>\n";
+    html += "<ul>\n<li>Item with <code>code " + num + "</code></li>\n<li><a href=\"mailto:someone@example.com\">mail</a></li>\n</ul>\n";
+}
+
+
+const std::string& bench::html_fixture(size_t size) {
+    static std::map<size_t, std::string> fixtures;
+
+    auto [it, inserted] = fixtures.try_emplace(size);
+    if (inserted) {
+        it->second.reserve(size + 1024);
+        for (size_t n = 0; it->second.size() < size; n++) {
+            append_html_block(it->second, n);
+        }
+    }
+
+    return it->second;
+}
+
+
+chm::ProjectConfig& bench::config_fixture() {
+    static chm::ProjectConfig config = [] {
+        chm::ProjectConfig config;
+        config.root = "bench-wiki";
+        config.temp = "bench-wiki/.temp";
+        return config;
+    }();
+    return config;
+}
+
+
+chm::ProjectData& bench::project_fixture() {
+    static chm::ProjectData data = [] {
+        chm::ProjectData data;
+
+        for (size_t i = 0; i < 64; i++) {
+            std::string name = "Page-" + std::to_string(i);
+            data.files.add(name + ".md", name + ".html", chm::ConversionType::from_markdown);
+        }
+
+        chm::build_page_lookup(config_fixture(), data);
+        return data;
+    }();
+
+    return data;
+}
+
+
+void bench::html_sizes(benchmark::internal::Benchmark *b) {
+    b->RangeMultiplier(4)->Range(256, 4 << 20);
+}
+
+
+
+// Average call time of the last run of every kernel, and with what fixture size.
+struct LastRun {
+    size_t input_size = 0;
+    std::chrono::steady_clock::duration call_time = {};
+};
+
+static std::unordered_map<std::string, LastRun> last_runs;
+
+
+bench::Kernel::Kernel(benchmark::State &state, std::string_view name, size_t input_size) : state(state), name(name), input_size(input_size) {
+    if (auto it = last_runs.find(this->name); it != last_runs.end()) {
+        if (it->second.input_size < input_size && it->second.call_time > time_budget) {
+            skipped = true;
+            state.SkipWithError("Skipped, a smaller input already went over the time budget.");
+        }
+    }
+}
+
+
+bench::Kernel::~Kernel() {
+    if (skipped || calls == 0) {
+        return;
+    }
+
+    state.SetComplexityN(input_size);
+    state.SetBytesProcessed(state.iterations() * input_size);
+    // Inverted rate is seconds per byte, printed with SI prefix like 2.5ns.
+    state.counters["time/byte"] = benchmark::Counter(input_size, benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+    state.counters["allocs/call"] = benchmark::Counter((double)allocations / calls);
+
+    auto &last_run = last_runs[name];
+    last_run.input_size = input_size;
+    last_run.call_time = elapsed / calls;
+}
@@ -0,0 +1,169 @@
+#include "bench.hpp"
+#include "helpers.hpp"
+
+
+
+// Kernels that modify html in place get a fresh copy before every call, copying is not measured.
+
+static void update_html_headings_to_include_id(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    bench::Kernel kernel(state, "update_html_headings_to_include_id", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string page = html;
+        state.ResumeTiming();
+
+        auto call = kernel.call();
+        chm::update_html_headings_to_include_id(page);
+        benchmark::DoNotOptimize(page.data());
+    }
+}
+BENCHMARK(update_html_headings_to_include_id)->Apply(bench::html_sizes)->Complexity();
+
+
+static void update_html_links_to_pages(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    auto &config = bench::config_fixture();
+    auto &data = bench::project_fixture();
+    bench::Kernel kernel(state, "update_html_links_to_pages", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string page = html;
+        state.ResumeTiming();
+
+        auto call = kernel.call();
+        chm::update_html_links_to_pages(config, data, page);
+        benchmark::DoNotOptimize(page.data());
+    }
+}
+BENCHMARK(update_html_links_to_pages)->Apply(bench::html_sizes)->Complexity();
+
+
+static void update_html_remote_links_to_open_in_new_broser_window(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    auto &data = bench::project_fixture();
+    bench::Kernel kernel(state, "update_html_remote_links_to_open_in_new_broser_window", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string page = html;
+        state.ResumeTiming();
+
+        auto call = kernel.call();
+        chm::update_html_remote_links_to_open_in_new_broser_window(data, page);
+        benchmark::DoNotOptimize(page.data());
+    }
+}
+BENCHMARK(update_html_remote_links_to_open_in_new_broser_window)->Apply(bench::html_sizes)->Complexity();
+
+
+static void scan_html_for_remote_dependencies(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    auto &config = bench::config_fixture();
+    bench::Kernel kernel(state, "scan_html_for_remote_dependencies", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    chm::ProjectData data;
+    chm::FileId file = data.files.add("Page.md", "Page.html", chm::ConversionType::from_markdown);
+
+    for (auto _ : state) {
+        // Found dependencies are kept between pages, start every call with none.
+        state.PauseTiming();
+        std::string page = html;
+        data.remote_dependencies.clear();
+        state.ResumeTiming();
+
+        auto call = kernel.call();
+        chm::scan_html_for_remote_dependencies(config, data, file, page);
+        benchmark::DoNotOptimize(page.data());
+    }
+}
+BENCHMARK(scan_html_for_remote_dependencies)->Apply(bench::html_sizes)->Complexity();
+
+
+static void remove_html_tags(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    bench::Kernel kernel(state, "remove_html_tags", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+        benchmark::DoNotOptimize(remove_html_tags(html));
+    }
+}
+BENCHMARK(remove_html_tags)->Apply(bench::html_sizes)->Complexity();
+
+
+static void remove_hashes(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    bench::Kernel kernel(state, "remove_hashes", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+        benchmark::DoNotOptimize(remove_hashes(html));
+    }
+}
+BENCHMARK(remove_hashes)->Apply(bench::html_sizes)->Complexity();
+
+
+// Worst case for trimming, text is a single character surrounded by whitespace.
+static void trim_whitespace(benchmark::State &state) {
+    std::string text(state.range(0), ' ');
+    text[text.size() / 2] = 'x';
+    bench::Kernel kernel(state, "trim_whitespace", text.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+        benchmark::DoNotOptimize(trim_whitespace(text));
+    }
+}
+BENCHMARK(trim_whitespace)->Apply(bench::html_sizes)->Complexity();
+
+
+static void minify_html(benchmark::State &state) {
+    const std::string &html = bench::html_fixture(state.range(0));
+    bench::Kernel kernel(state, "minify_html", html.size());
+
+    if (!kernel.should_run()) {
+        return;
+    }
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string page = html;
+        state.ResumeTiming();
+
+        auto call = kernel.call();
+        chm::minify_html(page);
+        benchmark::DoNotOptimize(page.data());
+    }
+}
+BENCHMARK(minify_html)->Apply(bench::html_sizes)->Complexity();
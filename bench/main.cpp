@@ -0,0 +1,5 @@
+#include "bench.hpp"
+
+
+
+BENCHMARK_MAIN();
@@ -0,0 +1,108 @@
+#include <deque>
+
+#include "bench.hpp"
+#include "project_file.hpp"
+
+
+
+// Layout of project files before ProjectFiles, one struct with full paths per file.
+namespace reference {
+    struct ProjectFile {
+        std::filesystem::path original;
+        std::filesystem::path target;
+        std::string link;
+        chm::ConversionType converter = chm::ConversionType::none;
+    };
+
+    // Heap memory of a string, short strings are stored inline.
+    static size_t heap_size(const std::string &string) {
+        return string.capacity() > std::string().capacity() ? string.capacity() + 1 : 0;
+    }
+}
+
+
+// Wiki pages spread over a few directories, relative to root like discovery finds them.
+static const std::vector<std::string>& page_names(size_t count) {
+    static std::vector<std::string> names;
+    names.clear();
+    for (size_t i = 0; i < count; i++) {
+        names.push_back("section-" + std::to_string(i % 32) + "/Some-Longer-Page-Name-" + std::to_string(i) + ".md");
+    }
+    return names;
+}
+
+static size_t names_size(const std::vector<std::string> &names) {
+    size_t size = 0;
+    for (auto &name : names) {
+        size += name.size();
+    }
+    return size;
+}
+
+
+// Builds the model like discovery does and reads every link once, like [FILES] section of the project file.
+static void path_deque_model(benchmark::State &state) {
+    auto &config = bench::config_fixture();
+    auto &names = page_names(state.range(0));
+    bench::Kernel kernel(state, "path_deque_model", names_size(names));
+
+    size_t memory = 0;
+    for (auto _ : state) {
+        auto call = kernel.call();
+
+        std::deque<reference::ProjectFile> files;
+        for (auto &name : names) {
+            auto relative = std::filesystem::path(name);
+            files.push_back({
+                .original = config.root / relative,
+                .target = config.temp / std::filesystem::path(relative).replace_extension(".html"),
+                .link = std::filesystem::path(relative).replace_extension(".html").string(),
+                .converter = chm::ConversionType::from_markdown,
+            });
+        }
+
+        size_t links = 0;
+        for (auto &file : files) {
+            links += file.link.size();
+        }
+        benchmark::DoNotOptimize(links);
+
+        memory = files.size() * sizeof(reference::ProjectFile);
+        for (auto &file : files) {
+            memory += reference::heap_size(file.original.native()) + reference::heap_size(file.target.native()) + reference::heap_size(file.link);
+        }
+    }
+
+    state.counters["bytes/page"] = benchmark::Counter((double)memory / names.size());
+}
+BENCHMARK(path_deque_model)->RangeMultiplier(10)->Range(1000, 100000)->Complexity();
+
+
+static void project_files_model(benchmark::State &state) {
+    auto &names = page_names(state.range(0));
+    bench::Kernel kernel(state, "project_files_model", names_size(names));
+
+    size_t memory = 0;
+    for (auto _ : state) {
+        auto call = kernel.call();
+
+        chm::ProjectFiles files;
+        std::string link;
+        for (auto &name : names) {
+            link.assign(name, 0, name.size() - 3);
+            link += ".html";
+            files.add(name, link, chm::ConversionType::from_markdown);
+        }
+
+        size_t links = 0;
+        for (chm::FileId file : files.ids()) {
+            links += files.link(file).size();
+        }
+        benchmark::DoNotOptimize(links);
+
+        memory = files.memory_usage();
+    }
+
+    state.counters["bytes/page"] = benchmark::Counter((double)memory / names.size());
+}
+BENCHMARK(project_files_model)->RangeMultiplier(10)->Range(1000, 100000)->Complexity();
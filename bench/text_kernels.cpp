@@ -0,0 +1,28 @@
+#include "bench.hpp"
+#include "helpers.hpp"
+#include "text_kernels.hpp"
+
+
+
+// Helpers on 64 KiB of html with every kernel level, second argument is chm::text::Level.
+static void text_kernel_levels(benchmark::State &state, std::string_view name, std::string (*kernel_fn)(std::string_view)) {
+    if (state.range(1) > (int64_t)chm::text::supported_level()) {
+        state.SkipWithError("Not supported by this cpu.");
+        return;
+    }
+
+    const std::string &html = bench::html_fixture(state.range(0));
+    auto previous_level = chm::text::set_level((chm::text::Level)state.range(1));
+    bench::Kernel kernel(state, std::string(name) + "/" + std::to_string(state.range(1)), html.size());
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+        benchmark::DoNotOptimize(kernel_fn(html));
+    }
+
+    chm::text::set_level(previous_level);
+}
+
+BENCHMARK_CAPTURE(text_kernel_levels, remove_html_tags, "remove_html_tags", remove_html_tags)->ArgsProduct({{64 << 10}, {0, 1, 2}});
+BENCHMARK_CAPTURE(text_kernel_levels, remove_hashes, "remove_hashes", remove_hashes)->ArgsProduct({{64 << 10}, {0, 1, 2}});
+BENCHMARK_CAPTURE(text_kernel_levels, normalize_page_link, "normalize_page_link", normalize_page_link)->ArgsProduct({{64 << 10}, {0, 1, 2}});
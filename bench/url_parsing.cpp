@@ -0,0 +1,73 @@
+#define NOMINMAX
+#include "curl/curl.h"
+
+#include "bench.hpp"
+#include "url.hpp"
+
+
+
+// Mix of links found on a typical wiki page.
+static constexpr std::string_view links[] = {
+    "Home",
+    "Some-Page",
+    "./Some-Page.md#install",
+    "dir/Other-Page",
+    "#section-12",
+    "images/logo.png",
+    "https://example.com/docs/12",
+    "https://user@images.example.com:8080/wiki/12.png?raw=true",
+    "http://[::1]/local",
+    "mailto:someone@example.com",
+};
+
+static constexpr size_t links_size = [] {
+    size_t size = 0;
+    for (auto link : links) {
+        size += link.size();
+    }
+    return size;
+}();
+
+
+// Parsing that update_html_remote_links_to_open_in_new_broser_window() and find_local_file_pointed_by_url() used before url::split().
+static void curl_url_parse(benchmark::State &state) {
+    std::vector<std::string> link_strings(std::begin(links), std::end(links));
+    bench::Kernel kernel(state, "curl_url_parse", links_size);
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+
+        for (auto &link : link_strings) {
+            CURLU *url_handle = curl_url();
+            if (curl_url_set(url_handle, CURLUPART_URL, link.c_str(), CURLU_DEFAULT_SCHEME | CURLU_NO_AUTHORITY | CURLU_ALLOW_SPACE) == CURLUE_OK) {
+                char *host = nullptr, *path = nullptr;
+                curl_url_get(url_handle, CURLUPART_HOST, &host, 0);
+                curl_url_get(url_handle, CURLUPART_PATH, &path, 0);
+                benchmark::DoNotOptimize(host);
+                benchmark::DoNotOptimize(path);
+                curl_free(host);
+                curl_free(path);
+            }
+            curl_url_cleanup(url_handle);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * link_strings.size());
+}
+BENCHMARK(curl_url_parse);
+
+
+static void url_split(benchmark::State &state) {
+    bench::Kernel kernel(state, "url_split", links_size);
+
+    for (auto _ : state) {
+        auto call = kernel.call();
+
+        for (auto link : links) {
+            benchmark::DoNotOptimize(chm::url::split(link));
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * std::size(links));
+}
+BENCHMARK(url_split);
@@ -0,0 +1,121 @@
+#include <cstdlib>
+#include <new>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+#include "alloc_profile.hpp"
+
+
+
+// Replaces global operator new and delete of the executable, only built with `-Dalloc_profiling=true`.
+// Usable size of a block is reported both ways, so live bytes match even for deletes without a size.
+using chm::alloc_profile::allocated;
+using chm::alloc_profile::freed;
+
+
+static size_t usable_size(void *ptr) {
+    #if defined(_WIN32)
+    return _msize(ptr);
+    #elif defined(__APPLE__)
+    return malloc_size(ptr);
+    #else
+    return malloc_usable_size(ptr);
+    #endif
+}
+
+static size_t aligned_usable_size(void *ptr, std::align_val_t align) {
+    #ifdef _WIN32
+    return _aligned_msize(ptr, (size_t)align, 0);
+    #else
+    (void)align;
+    return usable_size(ptr);
+    #endif
+}
+
+
+static void* profiled_alloc(size_t size) {
+    void *ptr = std::malloc(size ? size : 1);
+    if (ptr) {
+        allocated(usable_size(ptr));
+    }
+    return ptr;
+}
+
+static void* profiled_aligned_alloc(size_t size, std::align_val_t align) {
+    size_t alignment = (size_t)align;
+    size = (size + alignment - 1) / alignment * alignment;
+    #ifdef _WIN32
+    void *ptr = _aligned_malloc(size ? size : alignment, alignment);
+    #else
+    void *ptr = std::aligned_alloc(alignment, size ? size : alignment);
+    #endif
+    if (ptr) {
+        allocated(aligned_usable_size(ptr, align));
+    }
+    return ptr;
+}
+
+static void profiled_free(void *ptr) {
+    if (ptr) {
+        freed(usable_size(ptr));
+        std::free(ptr);
+    }
+}
+
+static void profiled_aligned_free(void *ptr, std::align_val_t align) {
+    if (ptr) {
+        freed(aligned_usable_size(ptr, align));
+        #ifdef _WIN32
+        _aligned_free(ptr);
+        #else
+        std::free(ptr);
+        #endif
+    }
+}
+
+
+void* operator new(size_t size) {
+    if (void *ptr = profiled_alloc(size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return profiled_alloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return profiled_alloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    if (void *ptr = profiled_aligned_alloc(size, align)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+
+void operator delete(void *ptr) noexcept { profiled_free(ptr); }
+void operator delete[](void *ptr) noexcept { profiled_free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { profiled_free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { profiled_free(ptr); }
+void operator delete(void *ptr, std::align_val_t align) noexcept { profiled_aligned_free(ptr, align); }
+void operator delete[](void *ptr, std::align_val_t align) noexcept { profiled_aligned_free(ptr, align); }
+void operator delete(void *ptr, size_t, std::align_val_t align) noexcept { profiled_aligned_free(ptr, align); }
+void operator delete[](void *ptr, size_t, std::align_val_t align) noexcept { profiled_aligned_free(ptr, align); }
@@ -0,0 +1,334 @@
+#include "alloc_profile.hpp"
+
+#ifdef GHWIKI2CHM_ALLOC_PROFILING
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <format>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "project.hpp"
+#include "log.hpp"
+
+using namespace chm::alloc_profile;
+
+
+
+constexpr size_t stage_slots = (size_t)chm::metrics::Stage::count + 1;     // Last one is outside of any stage
+constexpr const char* stage_names[stage_slots] = {"discover", "convert", "stage", "download", "optimize", "generate", "compile", "other"};
+constexpr size_t top_pages = 10;
+constexpr size_t top_page_sites = 3;
+
+
+// Only the owning thread writes, report only reads, like counters of metrics.
+struct Counts {
+    std::atomic<std::uint64_t> allocations = 0;
+    std::atomic<std::uint64_t> bytes = 0;
+
+    void add(std::uint64_t new_allocations, std::uint64_t new_bytes) {
+        allocations.store(allocations.load(std::memory_order_relaxed) + new_allocations, std::memory_order_relaxed);
+        bytes.store(bytes.load(std::memory_order_relaxed) + new_bytes, std::memory_order_relaxed);
+    }
+};
+
+struct Totals {
+    Counts stages[stage_slots];
+    Counts sites[max_sites];
+};
+
+// Registered when a thread first allocates, added to exited_threads when the thread exits.
+// Linked into a list instead of a vector, so registering a thread doesn't allocate.
+struct ThreadCounts : Totals {
+    ThreadCounts();
+    ~ThreadCounts();
+
+    ThreadCounts *next = nullptr;
+    // Allocated minus freed by this thread, blocks may be freed by another thread than the one that allocated them,
+    // so only the sum of all threads is meaningful. Only the owning thread writes.
+    std::atomic<std::int64_t> live_bytes = 0;
+    // Change of live_bytes not added to published_live_bytes yet.
+    std::int64_t unpublished_bytes = 0;
+};
+
+struct PageRecord {
+    chm::FileId page;
+    std::uint64_t allocations = 0, bytes = 0;
+    size_t sites[top_page_sites] = {};
+    std::uint64_t site_allocations[top_page_sites] = {};
+};
+
+
+// Everything here is constant initialized, so allocations made before main() can be counted already.
+static std::mutex threads_mutex;
+static ThreadCounts* threads = nullptr;
+static Totals exited_threads;               // Counts of threads that already exited, and everything they do after that
+static std::int64_t exited_live_bytes = 0;
+
+static std::atomic<std::uint8_t> current_stage = (std::uint8_t)chm::metrics::Stage::count;
+
+// Threads add their live bytes here only after they changed by publish_bytes, so allocations don't all update the
+// same shared counter. Peaks are taken from it and are off by at most publish_bytes for every thread.
+constexpr std::int64_t publish_bytes = 256 * 1024;
+static std::atomic<std::int64_t> published_live_bytes = 0;
+static std::atomic<std::int64_t> peak_live_bytes[stage_slots] = {};
+
+// Site 0 is everything outside of a named site.
+static std::mutex sites_mutex;
+static const char* site_names[max_sites] = {"other"};
+static std::atomic<size_t> site_count = 1;
+
+static std::mutex pages_mutex;
+static std::vector<PageRecord> page_records;
+
+// Nothing in a thread is counted in its own counts after they are gone, it goes to exited_threads instead.
+static thread_local bool thread_exited = false;
+static thread_local size_t current_site = 0;
+
+
+
+static void raise_peak(size_t stage, std::int64_t live) {
+    std::int64_t peak = peak_live_bytes[stage].load(std::memory_order_relaxed);
+    while (live > peak && !peak_live_bytes[stage].compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+}
+
+static void publish(ThreadCounts &counts) {
+    std::int64_t live = published_live_bytes.fetch_add(counts.unpublished_bytes, std::memory_order_relaxed) + counts.unpublished_bytes;
+    counts.unpublished_bytes = 0;
+    raise_peak(current_stage.load(std::memory_order_relaxed), live);
+}
+
+
+ThreadCounts::ThreadCounts() {
+    std::lock_guard lock(threads_mutex);
+    next = threads;
+    threads = this;
+}
+
+ThreadCounts::~ThreadCounts() {
+    std::lock_guard lock(threads_mutex);
+    for (size_t i = 0; i < stage_slots; i++) {
+        exited_threads.stages[i].add(stages[i].allocations.load(std::memory_order_relaxed), stages[i].bytes.load(std::memory_order_relaxed));
+    }
+    for (size_t i = 0; i < max_sites; i++) {
+        exited_threads.sites[i].add(sites[i].allocations.load(std::memory_order_relaxed), sites[i].bytes.load(std::memory_order_relaxed));
+    }
+    exited_live_bytes += live_bytes.load(std::memory_order_relaxed);
+    publish(*this);
+
+    for (ThreadCounts **it = &threads; *it; it = &(*it)->next) {
+        if (*it == this) {
+            *it = next;
+            break;
+        }
+    }
+    thread_exited = true;
+}
+
+// Counts of this thread, nullptr after the thread exited.
+static ThreadCounts* thread_counts() {
+    if (thread_exited) {
+        return nullptr;
+    }
+    thread_local ThreadCounts counts;
+    return &counts;
+}
+
+// Sum of live bytes of all threads, exact unlike published_live_bytes.
+static std::int64_t sum_live_bytes() {
+    std::lock_guard lock(threads_mutex);
+    std::int64_t live = exited_live_bytes;
+    for (auto *counts = threads; counts; counts = counts->next) {
+        live += counts->live_bytes.load(std::memory_order_relaxed);
+    }
+    return live;
+}
+
+
+
+// Every block is counted when it's allocated and when it's freed, otherwise live bytes would drift.
+void chm::alloc_profile::allocated(size_t size) {
+    size_t stage = current_stage.load(std::memory_order_relaxed);
+
+    auto *counts = thread_counts();
+    if (!counts) {
+        // Only destructors of other thread locals run here.
+        std::lock_guard lock(threads_mutex);
+        exited_threads.stages[stage].add(1, size);
+        exited_threads.sites[current_site].add(1, size);
+        exited_live_bytes += size;
+        raise_peak(stage, published_live_bytes.fetch_add(size, std::memory_order_relaxed) + size);
+        return;
+    }
+
+    counts->stages[stage].add(1, size);
+    counts->sites[current_site].add(1, size);
+    counts->live_bytes.store(counts->live_bytes.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+
+    counts->unpublished_bytes += size;
+    if (counts->unpublished_bytes >= publish_bytes) {
+        publish(*counts);
+    }
+}
+
+void chm::alloc_profile::freed(size_t size) {
+    auto *counts = thread_counts();
+    if (!counts) {
+        std::lock_guard lock(threads_mutex);
+        exited_live_bytes -= size;
+        published_live_bytes.fetch_sub(size, std::memory_order_relaxed);
+        return;
+    }
+
+    counts->live_bytes.store(counts->live_bytes.load(std::memory_order_relaxed) - size, std::memory_order_relaxed);
+
+    counts->unpublished_bytes -= size;
+    if (counts->unpublished_bytes <= -publish_bytes) {
+        publish(*counts);
+    }
+}
+
+
+chm::metrics::Stage chm::alloc_profile::enter_stage(metrics::Stage stage) {
+    auto outer = (metrics::Stage)current_stage.exchange((std::uint8_t)stage);
+    // Peak of a stage starts from memory that is live when it begins.
+    raise_peak((size_t)stage, sum_live_bytes());
+    return outer;
+}
+
+
+
+chm::alloc_profile::Site::Site(const char *name) : outer(current_site) {
+    size_t count = site_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        if (site_names[i] == name || std::strcmp(site_names[i], name) == 0) {
+            current_site = i;
+            return;
+        }
+    }
+
+    std::lock_guard lock(sites_mutex);
+    count = site_count.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        if (std::strcmp(site_names[i], name) == 0) {
+            current_site = i;
+            return;
+        }
+    }
+    if (count == max_sites) {
+        current_site = 0;
+        return;
+    }
+    site_names[count] = name;
+    site_count.store(count + 1, std::memory_order_release);
+    current_site = count;
+}
+
+chm::alloc_profile::Site::~Site() {
+    current_site = outer;
+}
+
+
+chm::alloc_profile::Page::Page(FileId page) : page(page) {
+    auto *counts = thread_counts();
+    for (size_t i = 0; i < max_sites; i++) {
+        start_allocations[i] = counts ? counts->sites[i].allocations.load(std::memory_order_relaxed) : 0;
+        start_bytes[i] = counts ? counts->sites[i].bytes.load(std::memory_order_relaxed) : 0;
+    }
+}
+
+chm::alloc_profile::Page::~Page() {
+    auto *counts = thread_counts();
+    if (!counts) {
+        return;
+    }
+
+    PageRecord record = {page};
+    for (size_t i = 0; i < max_sites; i++) {
+        std::uint64_t allocations = counts->sites[i].allocations.load(std::memory_order_relaxed) - start_allocations[i];
+        record.allocations += allocations;
+        record.bytes += counts->sites[i].bytes.load(std::memory_order_relaxed) - start_bytes[i];
+
+        // Insert into top sites, which are sorted by allocations.
+        for (size_t top = 0; top < top_page_sites; top++) {
+            if (allocations > record.site_allocations[top]) {
+                std::move_backward(record.sites + top, record.sites + top_page_sites - 1, record.sites + top_page_sites);
+                std::move_backward(record.site_allocations + top, record.site_allocations + top_page_sites - 1, record.site_allocations + top_page_sites);
+                record.sites[top] = i;
+                record.site_allocations[top] = allocations;
+                break;
+            }
+        }
+    }
+
+    Site site("alloc profile");
+    std::lock_guard lock(pages_mutex);
+    page_records.push_back(record);
+}
+
+
+
+void chm::alloc_profile::print_report(const ProjectData &data) {
+    // Report allocates too, it is usually outside of every stage.
+    Site site("alloc profile");
+
+    std::uint64_t stage_allocations[stage_slots] = {}, stage_bytes[stage_slots] = {};
+    std::uint64_t site_allocations[max_sites] = {}, site_bytes[max_sites] = {};
+    {
+        std::lock_guard lock(threads_mutex);
+        auto add = [&](const Totals &counts) {
+            for (size_t i = 0; i < stage_slots; i++) {
+                stage_allocations[i] += counts.stages[i].allocations.load(std::memory_order_relaxed);
+                stage_bytes[i] += counts.stages[i].bytes.load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < max_sites; i++) {
+                site_allocations[i] += counts.sites[i].allocations.load(std::memory_order_relaxed);
+                site_bytes[i] += counts.sites[i].bytes.load(std::memory_order_relaxed);
+            }
+        };
+        add(exited_threads);
+        for (auto *counts = threads; counts; counts = counts->next) {
+            add(*counts);
+        }
+    }
+
+    log::info("alloc_profile", "Allocations by stage:");
+    log::info("alloc_profile", "  %-10s %12s %12s %12s", "stage", "allocations", "KiB", "peak KiB");
+    for (size_t i = 0; i < stage_slots; i++) {
+        log::info("alloc_profile", "  %-10s %12llu %12.1f %12.1f", stage_names[i], (unsigned long long)stage_allocations[i],
+            stage_bytes[i] / 1024.0, peak_live_bytes[i].load() / 1024.0);
+    }
+
+    std::vector<size_t> sites;
+    for (size_t i = 0; i < site_count.load(); i++) {
+        sites.push_back(i);
+    }
+    std::sort(sites.begin(), sites.end(), [&](size_t a, size_t b) { return site_allocations[a] > site_allocations[b]; });
+
+    log::info("alloc_profile", "Allocations by site:");
+    for (size_t i : sites) {
+        log::info("alloc_profile", "  %-20s %12llu %12.1f KiB", site_names[i], (unsigned long long)site_allocations[i], site_bytes[i] / 1024.0);
+    }
+
+    std::vector<PageRecord> pages;
+    {
+        std::lock_guard lock(pages_mutex);
+        pages = page_records;
+    }
+    size_t shown = std::min(pages.size(), top_pages);
+    std::partial_sort(pages.begin(), pages.begin() + shown, pages.end(), [](const PageRecord &a, const PageRecord &b) { return a.allocations > b.allocations; });
+
+    log::info("alloc_profile", "Pages with most allocations:");
+    for (size_t i = 0; i < shown; i++) {
+        auto &record = pages[i];
+        std::string top_sites;
+        for (size_t top = 0; top < top_page_sites && record.site_allocations[top]; top++) {
+            top_sites += std::format("{}{} {}", top ? ", " : "", site_names[record.sites[top]], record.site_allocations[top]);
+        }
+        auto name = data.files.original(record.page);
+        log::info("alloc_profile", "  %.*s: %llu allocations, %.1f KiB (%s)", (int)name.size(), name.data(),
+            (unsigned long long)record.allocations, record.bytes / 1024.0, top_sites.c_str());
+    }
+}
+#endif
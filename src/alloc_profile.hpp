@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "metrics.hpp"
+#include "project_file.hpp"
+
+
+
+namespace chm {
+    struct ProjectData;
+}
+
+// Allocation counts by pipeline stage, call site and page, only built with `-Dalloc_profiling=true`.
+// alloc_hooks.cpp replaces global operator new and delete of the executable and reports every allocation here.
+// Without the option all of this is empty and costs nothing.
+namespace chm::alloc_profile {
+    #ifdef GHWIKI2CHM_ALLOC_PROFILING
+    constexpr size_t max_sites = 64;        // Sites after this many are counted as "other"
+
+    // Called by the hooks, size is usable size of the block.
+    void allocated(size_t size);
+    void freed(size_t size);
+
+    // Sets stage of the whole program, returns previous one. metrics::StageTimer calls it, count is outside of any stage.
+    metrics::Stage enter_stage(metrics::Stage stage);
+
+    // Allocations of this thread are attributed to the site until the scope ends, name must be a string literal.
+    class Site {
+    public:
+        explicit Site(const char *name);
+        ~Site();
+        Site(const Site&) = delete;
+        Site& operator=(const Site&) = delete;
+
+    private:
+        size_t outer;
+    };
+
+    // Allocations of this thread are attributed to the page until the scope ends, report lists top sites of every page.
+    class Page {
+    public:
+        explicit Page(FileId page);
+        ~Page();
+        Page(const Page&) = delete;
+        Page& operator=(const Page&) = delete;
+
+    private:
+        FileId page;
+        // Counts of this thread's sites when the scope started.
+        std::uint64_t start_allocations[max_sites];
+        std::uint64_t start_bytes[max_sites];
+    };
+
+    // Prints allocations, bytes and peak live bytes of every stage, and pages that allocated the most.
+    void print_report(const ProjectData &data);
+    #else
+    inline metrics::Stage enter_stage(metrics::Stage stage) { return stage; }
+
+    class Site {
+    public:
+        explicit Site(const char*) {}
+    };
+
+    class Page {
+    public:
+        explicit Page(FileId) {}
+    };
+
+    inline void print_report(const ProjectData&) {}
+    #endif
+}
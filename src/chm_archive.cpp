@@ -0,0 +1,406 @@
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+
+#include "chm_archive.hpp"
+#include "log.hpp"
+
+
+
+static std::uint32_t read_u32_le(std::string_view data, size_t pos) {
+    return (std::uint32_t)(std::uint8_t)data[pos] | (std::uint32_t)(std::uint8_t)data[pos + 1] << 8
+         | (std::uint32_t)(std::uint8_t)data[pos + 2] << 16 | (std::uint32_t)(std::uint8_t)data[pos + 3] << 24;
+}
+
+static std::uint64_t read_u64_le(std::string_view data, size_t pos) {
+    return read_u32_le(data, pos) | (std::uint64_t)read_u32_le(data, pos + 4) << 32;
+}
+
+static void write_u16_le(std::string &data, size_t pos, std::uint16_t value) {
+    data[pos] = (char)value;
+    data[pos + 1] = (char)(value >> 8);
+}
+
+static void write_u32_le(std::string &data, size_t pos, std::uint32_t value) {
+    for (size_t i = 0; i < 4; i++) {
+        data[pos + i] = (char)(value >> (i * 8));
+    }
+}
+
+static void write_u64_le(std::string &data, size_t pos, std::uint64_t value) {
+    for (size_t i = 0; i < 8; i++) {
+        data[pos + i] = (char)(value >> (i * 8));
+    }
+}
+
+// Variable length big endian integer used in chm directory, 7 bits per byte, high bit set on all bytes except last.
+static std::uint64_t read_encint(std::string_view data, size_t &pos) {
+    std::uint64_t value = 0;
+    while (pos < data.size()) {
+        std::uint8_t byte = data[pos++];
+        value = value << 7 | (byte & 0x7f);
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    return value;
+}
+
+static void append_encint(std::string &out, std::uint64_t value) {
+    char bytes[10];
+    size_t size = 0;
+    do {
+        bytes[size++] = (char)(value & 0x7f);
+        value >>= 7;
+    } while (value);
+
+    while (size > 1) {
+        out += (char)(bytes[--size] | 0x80);
+    }
+    out += bytes[0];
+}
+
+
+std::optional<chm::ChmDirectory> chm::read_chm_directory(std::string_view chm) {
+    if (chm.size() < 0x58 || !chm.starts_with("ITSF")) {
+        return std::nullopt;
+    }
+
+    ChmDirectory directory;
+    std::uint32_t version = read_u32_le(chm, 0x04);
+    std::uint32_t header_size = read_u32_le(chm, 0x08);
+    directory.directory_offset = read_u64_le(chm, 0x48);
+    directory.directory_size = read_u64_le(chm, 0x50);
+    directory.content_offset = version >= 3 && header_size >= 0x60 && chm.size() >= 0x60 ? read_u64_le(chm, 0x58) : directory.directory_offset + directory.directory_size;
+
+    if (directory.directory_offset > chm.size() || directory.directory_size > chm.size() - directory.directory_offset
+     || directory.directory_size < 0x54 || chm.substr(directory.directory_offset, 4) != "ITSP") {
+        return std::nullopt;
+    }
+
+    std::string_view itsp = chm.substr(directory.directory_offset, directory.directory_size);
+    std::uint32_t directory_header_size = read_u32_le(itsp, 0x08);
+    std::uint32_t chunk_size = read_u32_le(itsp, 0x10);
+    std::uint32_t chunk_count = read_u32_le(itsp, 0x2c);
+
+    for (std::uint32_t i = 0; i < chunk_count; i++) {
+        size_t chunk_offset = directory_header_size + (size_t)i * chunk_size;
+        if (chunk_size < 0x14 || chunk_offset + chunk_size > itsp.size()) {
+            return std::nullopt;
+        }
+
+        std::string_view chunk = itsp.substr(chunk_offset, chunk_size);
+        // Only listing chunks have entries, index chunks just point to them.
+        if (!chunk.starts_with("PMGL")) {
+            continue;
+        }
+
+        size_t end = chunk_size - std::min(read_u32_le(chunk, 0x04), chunk_size);
+        for (size_t pos = 0x14; pos < end;) {
+            size_t name_size = read_encint(chunk, pos);
+            if (name_size > end - std::min(pos, end)) {
+                return std::nullopt;
+            }
+
+            ChmEntry entry;
+            entry.name = chunk.substr(pos, name_size);
+            pos += name_size;
+            entry.section = read_encint(chunk, pos);
+            entry.offset = read_encint(chunk, pos);
+            entry.length = read_encint(chunk, pos);
+            directory.entries.push_back(std::move(entry));
+        }
+    }
+
+    return directory;
+}
+
+
+
+// Appends directory chunks with entries, each chunk starts with a copy of header. Entries are followed by free space
+// and a quickref area at the end: number of entries in the last 2 bytes, before that offsets of every interval'th entry
+// written backwards. Returns index of the first entry of every chunk or nothing if an entry doesn't fit into a chunk.
+static std::optional<std::vector<size_t>> append_chunks(std::string &out, const std::vector<std::string> &entries, std::string_view header, size_t chunk_size, size_t interval) {
+    std::vector<size_t> first_entries;
+
+    for (size_t i = 0; i < entries.size();) {
+        size_t chunk_start = out.size();
+        size_t used = header.size();
+        size_t count = 0;
+        std::vector<std::uint16_t> quickref;
+
+        out += header;
+        first_entries.push_back(i);
+
+        for (; i < entries.size(); i++, count++) {
+            size_t quickref_size = 2 + 2 * (count / interval);
+            if (used + entries[i].size() + quickref_size > chunk_size) {
+                break;
+            }
+            if (count && count % interval == 0) {
+                quickref.push_back((std::uint16_t)(used - header.size()));
+            }
+            out += entries[i];
+            used += entries[i].size();
+        }
+        if (!count) {
+            return std::nullopt;
+        }
+
+        out.resize(chunk_start + chunk_size, '\0');
+        write_u32_le(out, chunk_start + 4, (std::uint32_t)(chunk_size - used));
+        write_u16_le(out, chunk_start + chunk_size - 2, (std::uint16_t)count);
+        for (size_t q = 0; q < quickref.size(); q++) {
+            write_u16_le(out, chunk_start + chunk_size - 4 - q * 2, quickref[q]);
+        }
+    }
+
+    return first_entries;
+}
+
+// ITSP header followed by listing chunks with entries and index chunks above them, or nothing if entries don't fit.
+// itsp is the header of the previous directory, its chunk size, language and GUID are kept.
+static std::optional<std::string> write_directory(std::string itsp, const std::vector<chm::ChmEntry> &entries) {
+    std::uint32_t chunk_size = read_u32_le(itsp, 0x10);
+    std::uint32_t density = read_u32_le(itsp, 0x14);
+    if (read_u32_le(itsp, 0x08) != itsp.size() || chunk_size < 0x100 || chunk_size > 0x10000 || density > 8) {
+        return std::nullopt;
+    }
+    size_t interval = 1 + ((size_t)1 << density);
+
+    std::vector<std::string> encoded;
+    for (auto &entry : entries) {
+        std::string &out = encoded.emplace_back();
+        append_encint(out, entry.name.size());
+        out += entry.name;
+        append_encint(out, entry.section);
+        append_encint(out, entry.offset);
+        append_encint(out, entry.length);
+    }
+
+    // PMGL, free space, 0, previous and next listing chunk.
+    std::string chunks;
+    auto listing = append_chunks(chunks, encoded, std::string_view("PMGL\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 0x14), chunk_size, interval);
+    if (!listing) {
+        return std::nullopt;
+    }
+    std::uint32_t listing_count = (std::uint32_t)listing->size();
+    for (std::uint32_t i = 0; i < listing_count; i++) {
+        write_u32_le(chunks, (size_t)i * chunk_size + 0x0c, i ? i - 1 : 0xffffffff);
+        write_u32_le(chunks, (size_t)i * chunk_size + 0x10, i + 1 < listing_count ? i + 1 : 0xffffffff);
+    }
+
+    // Every index chunk has the first name in each chunk of the level below, until a single chunk covers all of them.
+    std::vector<std::pair<std::string_view, std::uint32_t>> level;
+    for (std::uint32_t i = 0; i < listing_count; i++) {
+        level.emplace_back(entries[(*listing)[i]].name, i);
+    }
+
+    std::uint32_t depth = 1;
+    while (level.size() > 1) {
+        encoded.clear();
+        for (auto &[name, chunk] : level) {
+            std::string &out = encoded.emplace_back();
+            append_encint(out, name.size());
+            out += name;
+            append_encint(out, chunk);
+        }
+
+        std::uint32_t first_chunk = (std::uint32_t)(chunks.size() / chunk_size);
+        auto index = append_chunks(chunks, encoded, std::string_view("PMGI\0\0\0\0", 0x08), chunk_size, interval);
+        if (!index) {
+            return std::nullopt;
+        }
+
+        std::vector<std::pair<std::string_view, std::uint32_t>> above;
+        for (size_t i = 0; i < index->size(); i++) {
+            above.emplace_back(level[(*index)[i]].first, first_chunk + (std::uint32_t)i);
+        }
+        level = std::move(above);
+        depth++;
+    }
+
+    write_u32_le(itsp, 0x18, depth);
+    write_u32_le(itsp, 0x1c, depth > 1 ? level.front().second : 0xffffffff);
+    write_u32_le(itsp, 0x20, 0);
+    write_u32_le(itsp, 0x24, listing_count - 1);
+    write_u32_le(itsp, 0x2c, (std::uint32_t)(chunks.size() / chunk_size));
+
+    return itsp + chunks;
+}
+
+
+// Directory names are compared without case by viewers.
+static std::string lowercase(std::string_view text) {
+    std::string lower(text);
+    for (auto &c : lower) {
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+    }
+    return lower;
+}
+
+// Files from temp path, others are internal files of the compiler like #SYSTEM, $FIftiMain or ::DataSpace/NameList.
+static bool is_content_file(std::string_view name) {
+    return name.starts_with('/') && !name.starts_with("/#") && !name.starts_with("/$");
+}
+
+
+bool chm::patch_chm(const ProjectConfig &config, const CompileManifest &previous, const CompileManifest &current) {
+    auto chm_name = config.out_file.filename().string();
+    auto skip = [&](const char *reason) {
+        log::info("chm_patch_skipped", "Can't patch %s, it is compiled again: %s.", chm_name.c_str(), reason);
+        return false;
+    };
+
+    // Project files are compiled into binary TOC, index and other internal files, only contents of other files can change.
+    auto chm_key = std::filesystem::relative(config.out_file, config.temp).generic_string();
+    if (!current.contains(chm_key)) {
+        return skip("there is no previous chm");
+    }
+    std::vector<std::string> changed;
+    for (auto &[path, stamp] : current) {
+        auto it = previous.find(path);
+        if (it == previous.end()) {
+            return skip("files were added");
+        }
+        if (it->second.hash == stamp.hash) {
+            continue;
+        }
+        if (path == chm_key) {
+            return skip("it was modified since it was compiled");
+        }
+        if (path.ends_with(".hhp") || path.ends_with(".hhc") || path.ends_with(".hhk")) {
+            return skip("project files changed");
+        }
+        changed.push_back(path);
+    }
+    if (previous.size() != current.size()) {
+        return skip("files were removed");
+    }
+
+    std::ifstream in(config.out_file, std::ios::binary);
+    std::string head(0x60, '\0');
+    in.read(head.data(), head.size());
+    head.resize(in.gcount());
+
+    std::error_code ec;
+    std::uint64_t chm_size = std::filesystem::file_size(config.out_file, ec);
+    if (ec || head.size() < 0x58 || !head.starts_with("ITSF")) {
+        return skip("it isn't a chm file");
+    }
+
+    // Header, header section 0 with the file size after 2 DWORDs, directory and section 0 that continues to the end of file.
+    std::uint64_t directory_end = read_u64_le(head, 0x48) + read_u64_le(head, 0x50);
+    if (directory_end > chm_size) {
+        return skip("its directory is damaged");
+    }
+    head.resize(directory_end);
+    in.seekg(0);
+    in.read(head.data(), head.size());
+
+    auto directory = in ? read_chm_directory(head) : std::nullopt;
+    std::uint64_t size_section_offset = read_u64_le(head, 0x38);
+    if (!directory || directory->content_offset < directory_end || directory->content_offset > chm_size
+     || read_u64_le(head, 0x40) < 0x18 || size_section_offset + 0x18 > directory->directory_offset || read_u32_le(head, size_section_offset) != 0x1fe) {
+        return skip("its directory is damaged");
+    }
+
+    std::unordered_map<std::string, size_t> entry_index;
+    for (size_t i = 0; i < directory->entries.size(); i++) {
+        entry_index[lowercase(directory->entries[i].name)] = i;
+    }
+
+    // Changed files are appended to section 0, previous contents stay where they were but nothing points to them.
+    std::uint64_t section_size = chm_size - directory->content_offset;
+    std::uint64_t appended = 0;
+    std::vector<ChmEntry*> patched;
+    for (auto &path : changed) {
+        auto it = entry_index.find(lowercase("/" + path));
+        if (it == entry_index.end()) {
+            return skip("changed files aren't in it");
+        }
+        auto &entry = directory->entries[it->second];
+        entry.section = 0;
+        entry.offset = section_size + appended;
+        entry.length = std::filesystem::file_size(config.temp / path, ec);
+        if (ec) {
+            return skip("changed files can't be read");
+        }
+        appended += entry.length;
+        patched.push_back(&entry);
+    }
+
+    // Uncompressed files and unused space are only reclaimed by the compiler, don't let them take over the chm.
+    std::uint64_t used = 0, uncompressed = 0;
+    for (auto &entry : directory->entries) {
+        if (entry.section == 0) {
+            used += entry.length;
+            uncompressed += is_content_file(entry.name) ? entry.length : 0;
+        }
+    }
+    std::uint64_t unused = section_size + appended - std::min(used, section_size + appended);
+    if ((uncompressed + unused) * 4 > chm_size + appended) {
+        return skip("a quarter of it would be uncompressed or unused");
+    }
+
+    auto new_directory = write_directory(head.substr(directory->directory_offset, 0x54), directory->entries);
+    if (!new_directory) {
+        return skip("directory entries don't fit into chunks");
+    }
+
+    std::uint64_t new_directory_end = directory->directory_offset + new_directory->size();
+    std::uint64_t new_size = new_directory_end + (chm_size - directory_end) + appended;
+    head.resize(directory->directory_offset);
+    write_u64_le(head, 0x50, new_directory->size());
+    if (read_u32_le(head, 0x04) >= 3 && read_u32_le(head, 0x08) >= 0x60) {
+        write_u64_le(head, 0x58, directory->content_offset - directory_end + new_directory_end);
+    }
+    write_u64_le(head, size_section_offset + 0x08, new_size);
+
+    // Written next to the chm and renamed over it, so a failure leaves the previous chm as it was.
+    auto patch_path = config.out_file;
+    patch_path += ".patch";
+    bool written = [&]() {
+        std::ofstream out(patch_path, std::ios::binary);
+        out.write(head.data(), head.size());
+        out.write(new_directory->data(), new_directory->size());
+
+        auto copy = [&](std::istream &from, std::uint64_t size) {
+            char buffer[64 * 1024];
+            while (size && from.read(buffer, std::min<std::uint64_t>(size, sizeof(buffer)))) {
+                out.write(buffer, from.gcount());
+                size -= from.gcount();
+            }
+            return size == 0;
+        };
+
+        in.seekg(directory_end);
+        if (!copy(in, chm_size - directory_end)) {
+            return false;
+        }
+        for (size_t i = 0; i < changed.size(); i++) {
+            std::ifstream file(config.temp / changed[i], std::ios::binary);
+            if (!copy(file, patched[i]->length)) {
+                return false;
+            }
+        }
+        return (bool)out.flush();
+    }();
+
+    in.close();
+    if (written) {
+        std::filesystem::rename(patch_path, config.out_file, ec);
+    }
+    if (!written || ec) {
+        std::filesystem::remove(patch_path, ec);
+        return skip("it couldn't be written");
+    }
+
+    for (auto &path : changed) {
+        log::detail("chm_file_patched", "Patched: %s", path.c_str());
+    }
+    log::info("chm_patched", "Patched %zu changed files into %s without compiling, full-text search finds their previous contents until it's compiled again.", changed.size(), chm_name.c_str());
+    return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "project.hpp"
+#include "reproducibility.hpp"
+
+
+
+// Reading and updating compiled chm files without a compiler.
+// Format is described in https://www.nongnu.org/chmspec/latest/Internal.html
+namespace chm {
+    struct ChmEntry {
+        std::string name;           // Path inside chm, like /pages/Home.html, #SYSTEM or ::DataSpace/NameList
+        std::uint64_t section;      // 0 = uncompressed, 1 = LZX compressed
+        std::uint64_t offset;       // In uncompressed data of the section, section 0 starts at content_offset
+        std::uint64_t length;
+    };
+
+    struct ChmDirectory {
+        std::vector<ChmEntry> entries;      // In the order of the directory, sorted the way viewers search them
+        std::uint64_t directory_offset;
+        std::uint64_t directory_size;
+        std::uint64_t content_offset;       // Start of section 0
+    };
+
+    // chm has to contain at least the header and the directory, contents of the file aren't needed.
+    std::optional<ChmDirectory> read_chm_directory(std::string_view chm);
+
+    // Updates the chm compiled last time instead of compiling it again. Files that changed since then are stored
+    // uncompressed and their directory entries point to them, compressed contents are kept as they are.
+    // Returns false without touching the chm if it can't be done, like when files were added or project files changed,
+    // or when so much of the chm is uncompressed or unused that it's time to compile it again.
+    // Full-text search keeps finding previous contents of patched pages until the next compilation.
+    bool patch_chm(const ProjectConfig &config, const CompileManifest &previous, const CompileManifest &current);
+}
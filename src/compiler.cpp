@@ -2,6 +2,10 @@
 #include "RUtils/Helpers.hpp"
 
 #include "compiler.hpp"
+#include "chm_archive.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "reproducibility.hpp"
 
 
 
@@ -68,7 +72,67 @@ bool chm::compile(const ProjectConfig &config, const compiler_info *compiler) {
         }, i);
     }
 
+    // Compiler writes to stdout itself.
+    log::flush();
+
+    auto start_time = std::chrono::steady_clock::now();
     int status = RUtils::run_process(RUtils::find_executable(compiler->executable), args, config.temp);
-    std::printf("Compiler exited with exit code: %i.\n", status);
+    metrics::set_compiler_result(std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count(), status);
+    log::info("compiler_exited", "Compiler exited with exit code: %i.", status);
     return status == 0;
+}
+
+
+
+bool chm::compile_project(const ProjectConfig &config) {
+    metrics::StageTimer timer(metrics::Stage::compile);
+
+    // Compiler always builds the whole chm again. Output is reproducible, so if none of the files in temp path changed
+    // since the chm was compiled and the chm wasn't touched either, compiling again would give the same bytes.
+    // Only files that were written since then are read to see if their contents changed. When only some of them did,
+    // they can be patched into the chm instead.
+    auto manifest_path = config.temp / ".compile_manifest";
+    auto previous = read_compile_manifest(manifest_path);
+    auto current = stamp_build_output(config, previous);
+
+    if (!previous.empty()) {
+        auto changed = compare_compile_manifests(previous, current);
+        if (changed.empty()) {
+            log::info("compile_skipped", "Nothing changed since %s was compiled, compiler wasn't run.", config.out_file.filename().string().c_str());
+            return true;
+        }
+        for (auto &path : changed) {
+            log::detail("compile_input_changed", "Changed: %s", path.c_str());
+        }
+        log::info("compile_inputs_changed", "%zu of %zu files changed since previous compilation.", changed.size(), current.size());
+
+        if (config.patch_chm && patch_chm(config, previous, current)) {
+            write_compile_manifest(manifest_path, stamp_build_output(config, current));
+            return true;
+        }
+    }
+    // Failed compilation must not leave a manifest that says the old chm is up to date.
+    std::error_code ec;
+    std::filesystem::remove(manifest_path, ec);
+
+    auto* compiler = find_available_compiler();
+    if(!compiler) {
+        log::error("compiler_missing", "Couldn't find any compatible chm compiler, make sure one is installed.");
+        return false;
+    }
+
+    log::info("compiler_started", "Starting compiler...");
+
+    if(!compile(config, compiler)) {
+        log::error("compile_failed", "Compilation failed.");
+        return false;
+    }
+
+    if(!normalize_chm_timestamps(config.out_file)) {
+        log::warning("timestamps_missing", "Couldn't find timestamps in compiled chm, it may differ between builds.");
+    }
+
+    // Inputs were hashed above, only the new chm is stamped.
+    write_compile_manifest(manifest_path, stamp_build_output(config, current));
+    return true;
 }
\ No newline at end of file
@@ -23,4 +23,8 @@ namespace chm {
     const compiler_info* find_available_compiler();
     bool is_compiler_valid(const compiler_info *compiler);
     bool compile(const ProjectConfig &config, const compiler_info *compiler);
+
+    // Compiles project files in temp path with the first available compiler and normalizes timestamps in the result.
+    // Prints why if it fails.
+    bool compile_project(const ProjectConfig &config);
 }
\ No newline at end of file
@@ -1,70 +1,191 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <format>
-#include <fstream>
+#include <future>
+#include <mutex>
+#include <thread>
 
 #include <RUtils/ForEach.hpp>
 
 #include "project.hpp"
+#include "alloc_profile.hpp"
 #include "helpers.hpp"
+#include "file_writer.hpp"
+#include "highlight.hpp"
+#include "log.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
 
 using namespace RUtils;
 
 
 
+// With memory limit, pages being converted can use this part of it, queued writes and unsorted keywords a smaller part each.
+constexpr std::uint64_t pages_memory_share = 4;
+constexpr std::uint64_t writes_memory_share = 16;
+constexpr std::uint64_t keywords_memory_share = 16;
+constexpr std::uint64_t keyword_entry_estimate = 256;
+
+// Source is read, converted and copied by every fix, this is roughly how much memory that takes at once.
+static std::uint64_t page_memory_estimate(std::uintmax_t source_size) {
+    return 64 * 1024 + source_size * 8;
+}
+
+
+
 void chm::convert_project_files(const ProjectConfig &config, ProjectData &data) {
-    // Determine converter
-    for (auto &&file : data.files) {
-        if(file.original.extension() == ".md") {
-            file.converter = ConversionType::from_markdown;
-            continue;
-        }
+    auto start_time = std::chrono::steady_clock::now();
 
-        file.converter = ConversionType::copy;
+    // Every thread has its own shard of keywords, together they can use their share of memory.
+    if (config.memory_limit && config.index_generate) {
+        std::uint64_t threads = config.max_jobs ? config.max_jobs : std::max(std::thread::hardware_concurrency(), 1u);
+        data.keywords.spill_to(config.temp / ".keywords", config.memory_limit / keywords_memory_share / keyword_entry_estimate / threads);
     }
 
+    // Sidebar TOC only needs page lookup, it's created while pages are converted.
+    std::future<TableOfContents> sidebar_toc;
+    if (!data.toc_sidebar.empty()) {
+        sidebar_toc = std::async(std::launch::async, [&]() {
+            return create_toc_entries_from_sidebar(config, data, data.toc_sidebar);
+        });
+    }
 
-    // Determine target file path
-    for (auto &&file : data.files) {
-        switch (file.converter) {
-        case ConversionType::copy:
-            file.target = config.temp / std::filesystem::relative(file.original, config.root);
-            continue;
+    auto ids = data.files.ids();
+    convert_pages(config, data, std::vector<FileId>(ids.begin(), ids.end()));
 
-        case ConversionType::from_markdown:
-            file.target = config.temp / std::filesystem::relative(file.original, config.root).replace_extension(".html");
-            continue;
+    if (sidebar_toc.valid()) {
+        data.toc.append(data.toc_parent, sidebar_toc.get());
+    }
 
-        default:
-            RUtils::Error::unreachable();
+    // Estimate how much time was saved by not converting unreachable pages, based on how fast other pages were converted.
+    if (data.pruned_count) {
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time);
+
+        std::uintmax_t converted_bytes = 0;
+        for (FileId file : data.files.ids()) {
+            std::error_code ec;
+            auto size = std::filesystem::file_size(data.files.original_path(config.root, file), ec);
+            converted_bytes += ec ? 0 : size;
+        }
+
+        if (converted_bytes) {
+            log::info("pruned_pages_skipped", "Skipping %zu unreachable pages saved about %.1f ms of conversion time.",
+                data.pruned_count, elapsed.count() * data.pruned_bytes / converted_bytes);
         }
     }
 
+    if (config.index_generate && data.keywords.spilling()) {
+        data.index_file = data.keywords.merge_to_file(config.max_jobs);
+    } else if (config.index_generate) {
+        data.index = data.keywords.merge(config.max_jobs);
+    }
+
+    // Add TOC entries
+    if (config.toc_generate_automagically) {
+        for (FileId file : data.files.ids()) {
+            data.toc.add(data.toc_parent, page_name_from_file(data.files.link(file)), file);
+        }
+    }
+}
+
+
+
+void chm::convert_pages(const ProjectConfig &config, ProjectData &data, std::span<const FileId> pages) {
+    // Converters and links were determined when files were found, see create_project_data_from_ghwiki().
+    metrics::StageTimer timer(metrics::Stage::convert);
+
+    // Limits pages in flight by their size instead of by number of threads, big pages wait for each other.
+    MemoryBudget budget(config.memory_limit / pages_memory_share);
+    FileWriter writer(64, config.memory_limit ? config.memory_limit / writes_memory_share : 16 * 1024 * 1024);
+    CodeHighlighter highlighter;
+    std::atomic<size_t> minified_from = 0, minified_to = 0;
 
     // Copy or convert files
-    RUtils::for_each_threaded(data.files.begin(), data.files.end(), [&](auto& file) {
-        std::filesystem::create_directories(std::filesystem::absolute(file.target).remove_filename());
-        std::printf("%s\n", std::filesystem::relative(file.original, config.root).string().c_str());
+    log::progress_begin("convert", pages.size());
+    RUtils::for_each_threaded(pages.begin(), pages.end(), [&](FileId file) {
+        log::ProgressItem progress;
+        alloc_profile::Page profile_page(file);
+        auto target = data.files.target_path(config.temp, file);
+        std::string_view link = data.files.link(file);
+
+        std::filesystem::create_directories(std::filesystem::absolute(target).remove_filename());
+        log::detail("page_converted", "%.*s", (int)data.files.original(file).size(), data.files.original(file).data());
 
-        switch (file.converter) {
+        switch (data.files.converter(file)) {
         case ConversionType::copy:
-            std::filesystem::copy_file(file.original, file.target, std::filesystem::copy_options::overwrite_existing);
+            // File is copied later by stage_project_files()
+            if (config.index_generate) {
+                auto &keywords = data.keywords.thread_shard();
+                KeywordIndex::add(keywords, page_name_from_file(target), file);
+                data.keywords.spill(keywords);
+            }
             return;
 
         case ConversionType::from_markdown: {
-            std::string html_out = convert_markdown_file_to_html(file.original);
+            auto page_start_time = std::chrono::steady_clock::now();
+            auto source = data.files.original_path(config.root, file);
+
+            std::error_code ec;
+            auto source_size = std::filesystem::file_size(source, ec);
+            if (ec) {
+                source_size = 0;
+            }
+            auto memory_estimate = page_memory_estimate(source_size);
+            budget.acquire(memory_estimate);
+
+            std::vector<std::string> front_matter_keywords;
+            std::string html_out;
+            {
+                alloc_profile::Site site("markdown");
+                html_out = convert_markdown_file_to_html(source, config.index_generate ? &front_matter_keywords : nullptr);
+            }
+
+            {
+                alloc_profile::Site site("dependencies");
+                scan_html_for_local_dependencies(config, data, html_out);
+                scan_html_for_remote_dependencies(config, data, file, html_out);
+            }
+            {
+                alloc_profile::Site site("headings");
+                update_html_headings_to_include_id(html_out);
+            }
+
+            if (config.index_generate) {
+                alloc_profile::Site site("keywords");
+                auto &keywords = data.keywords.thread_shard();
+                KeywordIndex::add(keywords, page_name_from_file(target), file);
+                for (auto &keyword : front_matter_keywords) {
+                    KeywordIndex::add(keywords, keyword, file);
+                }
+                scan_html_for_keywords(file, html_out, keywords);
+                data.keywords.spill(keywords);
+            }
+
+            std::string head_links = finish_page_html(config, data, file, html_out, highlighter);
 
-            scan_html_for_local_dependencies(config, data, html_out);
-            scan_html_for_remote_dependencies(config, data, html_out);
-            update_html_headings_to_include_id(html_out);
-            update_html_remote_links_to_open_in_new_broser_window(data, html_out);
-            update_html_links_to_pages(config, data, html_out);
+            // Last, so minifier sees everything other stages added.
+            if (config.minify) {
+                alloc_profile::Site site("minify");
+                size_t size = html_out.size();
+                minify_html(html_out);
+                minified_from += size;
+                minified_to += html_out.size();
+                log::detail("page_minified", "Minified %.*s: %zu -> %zu bytes", (int)link.size(), link.data(), size, html_out.size());
+            }
 
-            std::ofstream html_file(file.target);
-            // html head body tags are required, chmcmd crashes if they are not present.
-            // TODO: Custom html style templates
-            html_file << "<!DOCTYPE html><html><head><meta charset=\"UTF-8\"></head><body>";
-            html_file << html_out;
-            html_file << "</body></html>";
+            metrics::add_stage_bytes(metrics::Stage::convert, source_size,
+                page_header_begin.size() + head_links.size() + page_header_end.size() + html_out.size() + page_footer.size());
 
+            {
+                alloc_profile::Site site("write");
+                writer.write(target, page_header_begin, std::move(head_links), page_header_end, std::move(html_out), page_footer);
+            }
+            // Page is owned by the writer now, which has its own limit.
+            budget.release(memory_estimate);
+
+            metrics::add(metrics::Counter::pages_converted);
+            metrics::observe_page_conversion(std::chrono::duration<double>(std::chrono::steady_clock::now() - page_start_time).count());
             return; }
 
         default:
@@ -72,20 +193,61 @@ void chm::convert_project_files(const ProjectConfig &config, ProjectData &data)
         }
     }, config.max_jobs);
 
-    // Add TOC entries
-    if (config.toc_generate_automagically) {
-        for (auto &file : data.files) {
-            std::string entry_name = file.target.filename().replace_extension("").string();
-
-            // replace dashes with spaces
-            // github wiki web editor puts them in the file names
-            for (auto& c : entry_name) {
-                if (c == '-') {
-                    c = ' ';
-                }
-            }
+    if (config.highlight_code) {
+        metrics::add_cache_lookups(metrics::Cache::highlight, highlighter.cache_hits(), highlighter.cache_misses());
+        writer.write(config.temp / highlight_stylesheet_name, highlight_stylesheet);
+        log::info("code_highlighted", "Highlighted %zu code blocks, %zu were cached.", highlighter.cache_hits() + highlighter.cache_misses(), highlighter.cache_hits());
+    }
 
-            data.toc->children.push_back({.name = entry_name, .file_link = &file});
+    if (config.minify && minified_from > 0) {
+        log::info("pages_minified", "Minified pages from %zu to %zu bytes, saved %zu bytes (%.1f%%).",
+            minified_from.load(), minified_to.load(), minified_from - minified_to, 100.0 * (minified_from - minified_to) / minified_from);
+    }
+
+    writer.flush();
+
+    // Dependencies were added in whatever order threads found them.
+    data.local_dependencies.sort_by_link();
+    std::sort(data.remote_dependencies.begin(), data.remote_dependencies.end(), [](auto &a, auto &b) { return a.link < b.link; });
+}
+
+
+
+std::string chm::finish_page_html(const ProjectConfig &config, ProjectData &data, FileId page, std::string &html, CodeHighlighter &highlighter) {
+    std::vector<std::string> external_links;
+    {
+        alloc_profile::Site site("external links");
+        update_html_remote_links_to_open_in_new_broser_window(data, html, config.link_report.empty() ? nullptr : &external_links);
+    }
+    {
+        alloc_profile::Site site("page links");
+        update_html_links_to_pages(config, data, html);
+    }
+
+    if (!external_links.empty()) {
+        // Pages are finished by multiple threads at once.
+        static std::mutex external_links_mutex;
+        std::lock_guard lock(external_links_mutex);
+        for (auto &link : external_links) {
+            auto &pages = data.external_links[std::move(link)];
+            if (pages.empty() || pages.back() != page) {
+                pages.push_back(page);
+            }
         }
     }
+
+    bool highlighted = false;
+    if (config.highlight_code) {
+        alloc_profile::Site site("highlight");
+        highlighted = highlighter.highlight_code_blocks(html) > 0;
+    }
+
+    // Stylesheet is in temp root, link to it relative to the page.
+    std::string head_links;
+    if (highlighted) {
+        auto stylesheet = std::filesystem::path(highlight_stylesheet_name).lexically_relative(std::filesystem::path(data.files.link(page)).parent_path());
+        head_links = "<link rel=\"stylesheet\" href=\"" + stylesheet.generic_string() + "\">";
+    }
+
+    return head_links;
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cmath>
+
+#include "download_controller.hpp"
+
+
+
+chm::DownloadController::DownloadController(std::uint32_t max_downloads, std::FILE* log)
+    : max_window(std::max(max_downloads, 1u)), global_window(std::min(8.0, max_window)), log(log) {
+    start_time = last_update = Clock::now();
+
+    if (log) {
+        std::fprintf(log, "time_ms,host,event,value,host_limit,global_limit,active\n");
+    }
+}
+
+
+bool chm::DownloadController::can_start(const std::string &host, Clock::time_point now) const {
+    if (active >= global_limit()) {
+        return false;
+    }
+
+    auto it = hosts.find(host);
+    if (it == hosts.end()) {
+        return true;
+    }
+    return it->second.active < (std::uint32_t)it->second.window && now >= it->second.blocked_until;
+}
+
+chm::DownloadController::Clock::time_point chm::DownloadController::blocked_until(const std::string &host) const {
+    auto it = hosts.find(host);
+    return it == hosts.end() ? Clock::time_point() : it->second.blocked_until;
+}
+
+std::uint32_t chm::DownloadController::host_limit(const std::string &host) const {
+    auto it = hosts.find(host);
+    return it == hosts.end() ? (std::uint32_t)Host().window : (std::uint32_t)it->second.window;
+}
+
+
+void chm::DownloadController::started(const std::string &host) {
+    Host &h = hosts[host];
+    h.window = std::min(h.window, max_window);
+    h.active++;
+    active++;
+}
+
+void chm::DownloadController::succeeded(const std::string &host, double latency, Clock::time_point now) {
+    Host &h = hosts[host];
+    h.active--;
+    active--;
+
+    h.min_latency = h.min_latency == 0 ? latency : std::min(h.min_latency, latency);
+    h.avg_latency = h.avg_latency == 0 ? latency : h.avg_latency * 0.8 + latency * 0.2;
+
+    // Requests wait in a queue on the server, more of them at once won't help.
+    if (h.avg_latency > h.min_latency * 3 + 0.05) {
+        decrease(host, h, 0.75, "latency", now);
+        return;
+    }
+
+    // Limit only grows while it is what holds the host back, otherwise nothing was learned about a bigger one.
+    if (h.active + 1 < (std::uint32_t)h.window) {
+        return;
+    }
+
+    std::uint32_t old_limit = h.window;
+    if (h.slow_start_threshold == 0 || h.window < h.slow_start_threshold) {
+        h.window += 1;
+    } else {
+        h.window += 1 / h.window;
+    }
+    h.window = std::min(h.window, max_window);
+
+    if ((std::uint32_t)h.window != old_limit) {
+        log_event(now, host, "increase", latency);
+    }
+}
+
+void chm::DownloadController::throttled(const std::string &host, std::uint32_t retry_after, Clock::time_point now) {
+    Host &h = hosts[host];
+    h.active--;
+    active--;
+
+    // Without Retry-After wait a bit anyway, other downloads from the same host would probably get the same answer.
+    auto wait = retry_after ? std::chrono::seconds(retry_after) : std::chrono::seconds(1);
+    h.blocked_until = std::max(h.blocked_until, now + wait);
+
+    decrease(host, h, 0.5, "throttled", now);
+    log_event(now, host, "retry_after", retry_after);
+}
+
+void chm::DownloadController::failed(const std::string &host) {
+    hosts[host].active--;
+    active--;
+}
+
+
+void chm::DownloadController::decrease(const std::string &name, Host &host, double factor, const char *reason, Clock::time_point now) {
+    // Downloads that started before the previous decrease report the same congestion, ignore them.
+    if (now - host.last_decrease < std::chrono::seconds(1)) {
+        return;
+    }
+
+    host.window = std::max(1.0, host.window * factor);
+    host.slow_start_threshold = host.window;
+    host.last_decrease = now;
+    log_event(now, name, reason, host.avg_latency);
+}
+
+
+void chm::DownloadController::update(Clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - last_update).count();
+    if (elapsed < 1) {
+        return;
+    }
+
+    double throughput = received_bytes / elapsed;
+    received_bytes = 0;
+    last_update = now;
+
+    // Throughput only says something about the limit when the limit is what stops more downloads from starting.
+    bool saturated = active >= global_limit();
+    // Remembered best slowly fades, so it follows changes in network and file sizes.
+    best_throughput *= 0.9;
+
+    std::uint32_t old_limit = global_limit();
+
+    // Like host limits, grows fast until the first drop, then slowly.
+    if (saturated && throughput >= best_throughput * 0.9) {
+        global_window = std::min(global_slow_start ? global_window * 1.5 : global_window + 1, max_window);
+    } else if (saturated && throughput < best_throughput * 0.5) {
+        global_window = std::max(1.0, global_window * 0.75);
+        global_slow_start = false;
+    }
+    best_throughput = std::max(best_throughput, throughput);
+
+    if (global_limit() != old_limit) {
+        log_event(now, "", global_limit() > old_limit ? "global_increase" : "global_decrease", throughput);
+    }
+}
+
+
+void chm::DownloadController::log_event(Clock::time_point now, const std::string &host, const char *event, double value) {
+    if (!log) {
+        return;
+    }
+
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time).count();
+    std::fprintf(log, "%lld,%s,%s,%g,%u,%u,%u\n", (long long)time, host.c_str(), event, value, host.empty() ? 0 : host_limit(host), global_limit(), active);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+
+
+
+namespace chm {
+    // Decides how many downloads run at once, for every host and in total.
+    // Limits grow additively while things go well and are cut multiplicatively when a host asks to slow down (429, 503),
+    // its latency grows, or total throughput drops. Configured max downloads is the upper bound.
+    class DownloadController {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // log is optional csv file, every change of a limit is written to it.
+        DownloadController(std::uint32_t max_downloads, std::FILE* log = nullptr);
+
+        // False if the host is backing off or global or host limit is reached.
+        bool can_start(const std::string &host, Clock::time_point now) const;
+        // Host doesn't want new requests before this time.
+        Clock::time_point blocked_until(const std::string &host) const;
+
+        void started(const std::string &host);
+        // latency is time to first byte in seconds.
+        void succeeded(const std::string &host, double latency, Clock::time_point now);
+        // Server asked to slow down, retry_after is in seconds, 0 if it wasn't sent.
+        void throttled(const std::string &host, std::uint32_t retry_after, Clock::time_point now);
+        void failed(const std::string &host);
+
+        void received(size_t bytes) { received_bytes += bytes; }
+        // Call periodically, adjusts global limit from throughput measured since last call.
+        void update(Clock::time_point now);
+
+        std::uint32_t global_limit() const { return (std::uint32_t)global_window; }
+        std::uint32_t host_limit(const std::string &host) const;
+
+    private:
+        struct Host {
+            double window = 4;
+            double slow_start_threshold = 0;    // Window doubles until it reaches this, set on first slowdown
+            std::uint32_t active = 0;
+            double min_latency = 0, avg_latency = 0;
+            Clock::time_point blocked_until, last_decrease;
+        };
+
+        void decrease(const std::string &name, Host &host, double factor, const char *reason, Clock::time_point now);
+        void log_event(Clock::time_point now, const std::string &host, const char *event, double value);
+
+        double max_window;
+        double global_window;
+        bool global_slow_start = true;
+        std::uint32_t active = 0;
+        std::unordered_map<std::string, Host> hosts;
+
+        std::uint64_t received_bytes = 0;
+        double best_throughput = 0;
+        Clock::time_point start_time, last_update;
+
+        std::FILE* log;
+    };
+}
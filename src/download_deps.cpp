@@ -1,113 +1,297 @@
-#include <vector>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
 
 #define NOMINMAX // Maybe a bug in curl.wrap: on windows min max macros are added and collide with std::min/std::max
                  // why microsoft didn't make this the default already??? no one uses those.
 #include "curl/curl.h"
 
 #include "project.hpp"
+#include "file_writer.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "request_runner.hpp"
+
+
 
+using Clock = std::chrono::steady_clock;
 
+// Throttled downloads get this many retries on top of configured ones, rate limited hosts throttle a lot.
+constexpr std::uint32_t max_throttled_retries = 8;
+
+// One for every handle of the runner.
+struct DownloaderState {
+    CURL* handle;
+    chm::RequestRunner* runner;
+    std::string buffer;             // downloaded data, written to target file when download finishes
+    std::uint64_t max_size;         // 0 = no limit
+    bool too_large;                 // download was aborted by write_callback
+};
 
 // for curl
-static size_t write_callback(char *ptr, std::size_t size, std::size_t nmemb, std::ofstream *file) {
+static size_t write_callback(char *ptr, std::size_t size, std::size_t nmemb, DownloaderState *download) {
     size_t bytes_to_write = size * nmemb;
 
-    file->write(ptr, bytes_to_write);
+    // Server didn't send Content-Length or lied about it, so curl couldn't stop it before the body.
+    if (download->max_size && download->buffer.size() + bytes_to_write > download->max_size) {
+        download->too_large = true;
+        return 0;
+    }
+
+    // Avoid reallocating buffer for every chunk if server told us the size.
+    if (download->buffer.empty()) {
+        curl_off_t content_length = -1;
+        if (curl_easy_getinfo(download->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) == CURLE_OK && content_length > 0) {
+            download->buffer.reserve(content_length);
+        }
+    }
+
+    download->buffer.append(ptr, bytes_to_write);
+    download->runner->received(bytes_to_write);
+    chm::metrics::add(chm::metrics::Counter::download_bytes, bytes_to_write);
 
     return bytes_to_write;
 }
 
+
+// Errors that may go away if the same request is made again later.
+static bool is_transient_error(CURLcode result, long status) {
+    switch (result) {
+    case CURLE_OK:
+        return status == 429 || status >= 500;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::string format_size(std::uint64_t bytes) {
+    char text[32];
+    if (bytes >= 1024 * 1024) {
+        std::snprintf(text, sizeof(text), "%.1f MiB", bytes / (1024.0 * 1024.0));
+    } else {
+        std::snprintf(text, sizeof(text), "%.1f KiB", bytes / 1024.0);
+    }
+    return text;
+}
+
+
+// Pages were written with <img> tags pointing to downloaded files. Images that weren't downloaded are replaced
+// with a link to the original url, so the image can still be opened in a browser.
+static void replace_missing_images_with_links(const chm::ProjectConfig &config, const chm::ProjectData &data) {
+    std::map<chm::FileId, std::vector<const chm::RemoteDependency*>> pages;
+    for (auto &dep : data.remote_dependencies) {
+        if (dep.state != chm::DownloadState::Finished) {
+            for (auto page : dep.referenced_by) {
+                pages[page].push_back(&dep);
+            }
+        }
+    }
+
+    chm::FileWriter writer;
+
+    for (auto &[page, deps] : pages) {
+        std::string html;
+        {
+            std::ifstream file(data.files.target_path(config.temp, page), std::ios::binary);
+            html.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+
+        bool replaced = false;
+        for (auto *dep : deps) {
+            std::string tag_begin = "<img src=\"" + std::filesystem::relative(dep->target, config.temp).generic_string() + '"';
+
+            for (size_t pos = html.find(tag_begin); pos != std::string::npos; pos = html.find(tag_begin, pos)) {
+                size_t end = html.find('>', pos + tag_begin.size());
+                end = end == std::string::npos ? html.size() : end + 1;
+
+                std::string_view tag = std::string_view(html).substr(pos, end - pos);
+                std::string_view alt;
+                if (size_t alt_pos = tag.find(" alt=\""); alt_pos != std::string_view::npos) {
+                    alt = tag.substr(alt_pos + 6);
+                    alt = alt.substr(0, alt.find('"'));
+                }
+                if (alt.empty()) {
+                    alt = "image";
+                }
+
+                // Url and alt text are already escaped, error comes from curl and may contain anything.
+                std::string link = "<a href=\"" + dep->link + "\" target=\"_blank\" title=\"";
+                append_attribute_escaped(link, dep->error);
+                link += "\">[" + std::string(alt) + "]</a>";
+                html.replace(pos, end - pos, link);
+                pos += link.size();
+                replaced = true;
+            }
+        }
+
+        // Pages that weren't converted again already link to the url.
+        if (!replaced) {
+            continue;
+        }
+        writer.write(data.files.target_path(config.temp, page), std::move(html));
+    }
+
+    writer.flush();
+}
+
+
 // Download remote dependencies
 void chm::download_dependencies(const ProjectConfig &config, ProjectData &data) {
+    metrics::StageTimer timer(metrics::Stage::download);
+
+    // Watch mode keeps dependencies from previous builds.
+    auto not_started = [](const RemoteDependency &dep) { return dep.state == DownloadState::NotStarted; };
+    size_t queued_count = std::count_if(data.remote_dependencies.begin(), data.remote_dependencies.end(), not_started);
+
     // Nothing to download.
-    if(data.remote_dependencies.size() == 0) {
+    if(queued_count == 0) {
         return;
     }
 
-    std::printf("Will download %zu remote dependencies...\n", data.remote_dependencies.size());
+    log::info("downloads_queued", "Will download %zu remote dependencies...", queued_count);
+    log::progress_begin("download", queued_count);
 
 
-    size_t max_downloads = std::min((size_t)config.max_downloads, data.remote_dependencies.size());
-    size_t next_dep_to_download_index = 0;  // index to remote_dependencies[]
+    std::FILE* controller_log = nullptr;
+    if (!config.dep_download_log.empty()) {
+        controller_log = std::fopen(config.dep_download_log.string().c_str(), "w");
+        if (!controller_log) {
+            log::warning("download_log_failed", "Failed to open download log: %s", config.dep_download_log.string().c_str());
+        }
+    }
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    CURLM* multi_handle = curl_multi_init();
+    RequestRunner runner({
+        .max_requests = config.max_downloads,
+        .retries = config.dep_download_retries,
+        .throttled_retries = max_throttled_retries,
+        .deadline = config.dep_download_deadline ? Clock::now() + std::chrono::seconds(config.dep_download_deadline) : Clock::time_point::max(),
+        .controller_log = controller_log,
+    });
+    for (size_t i = 0; i < data.remote_dependencies.size(); i++) {
+        if (not_started(data.remote_dependencies[i])) {
+            runner.add(i, data.remote_dependencies[i].link);
+        }
+    }
 
+    std::vector<DownloaderState> downloaders(runner.slot_count());
+    FileWriter writer;
+    size_t downloaded_count = 0;
 
-    struct DownloaderState {
-        CURL* handle;
-        RemoteDependency* dep_ptr; // assigned file or nullptr
-        std::ofstream* file_ptr;    // target file output stream or nullptr
+    auto finish = [&](RemoteDependency &dep, DownloadState state, std::string error) {
+        dep.state = state;
+        dep.error = std::move(error);
+        log::progress_advance();
     };
 
-    std::vector<DownloaderState> downloaders(max_downloads);
+    bool in_time = runner.run({
+        .configure = [&](CURL *handle, size_t slot) {
+            curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, !config.dep_download_ignore_ssl);
+            curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, !config.dep_download_ignore_ssl);
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
+            curl_easy_setopt(handle, CURLOPT_WRITEDATA, &downloaders[slot]);
+            curl_easy_setopt(handle, CURLOPT_VERBOSE, config.dep_download_curl_verbose);
+            // Stops before downloading the body if Content-Length is over the limit.
+            curl_easy_setopt(handle, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)config.dep_download_max_size);
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT, (long)config.dep_download_timeout);
+            curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, (long)std::min(config.dep_download_timeout, 15u));
+            curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, (long)config.dep_download_low_speed);
+            curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, config.dep_download_low_speed ? 15L : 0L);
+            downloaders[slot].handle = handle;
+            downloaders[slot].runner = &runner;
+            downloaders[slot].max_size = config.dep_download_max_size;
+        },
 
-    for (auto& download : downloaders) {
-        CURL* handle = curl_easy_init();
-        curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
-        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, !config.dep_download_ignore_ssl);
-        curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, !config.dep_download_ignore_ssl);
-        curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(handle, CURLOPT_VERBOSE, config.dep_download_curl_verbose);
-        download.handle = handle;
-    }
-
-
-    int running_handles = 0;
-    size_t downloaded_count = 0;
+        .start = [&](const RequestAttempt &attempt) {
+            auto &download = downloaders[attempt.slot];
+            RemoteDependency &dep = data.remote_dependencies[attempt.request];
+            dep.state = DownloadState::InProgress;
+            dep.attempts++;
+            download.buffer = {};
+            download.too_large = false;
 
-    do {
-        if((size_t)running_handles < max_downloads && next_dep_to_download_index < data.remote_dependencies.size()) {
-            for (auto& download : downloaders) {
-                if (download.dep_ptr == nullptr && download.file_ptr == nullptr) {
-                    download.dep_ptr = &data.remote_dependencies[next_dep_to_download_index];
-                    next_dep_to_download_index++;
+            std::filesystem::create_directories(std::filesystem::absolute(dep.target).remove_filename());
+            curl_easy_setopt(attempt.handle, CURLOPT_URL, dep.link.c_str());
+            log::detail("download_started", "%s", dep.link.c_str());
+        },
 
-                    std::filesystem::create_directories(std::filesystem::absolute(download.dep_ptr->target).remove_filename());
-                    download.file_ptr = new std::ofstream(download.dep_ptr->target);
+        .finished = [&](const RequestAttempt &attempt, const RequestResult &result) {
+            auto &download = downloaders[attempt.slot];
+            RemoteDependency &dep = data.remote_dependencies[attempt.request];
+            metrics::add_download_response(result.result == CURLE_OK ? result.status : 0);
+            std::string status = result.result == CURLE_OK ? "HTTP " + std::to_string(result.status) : curl_easy_strerror(result.result);
+            log::detail("download_finished", "%s (%s)", dep.link.c_str(), status.c_str());
 
-                    curl_easy_setopt(download.handle, CURLOPT_URL, download.dep_ptr->link.c_str());
-                    curl_easy_setopt(download.handle, CURLOPT_WRITEDATA, download.file_ptr);
-                    curl_multi_add_handle(multi_handle, download.handle);
-                }
+            if (result.result == CURLE_FILESIZE_EXCEEDED || download.too_large) {
+                download.buffer = {};
+                finish(dep, DownloadState::Skipped, "larger than " + format_size(config.dep_download_max_size));
+                return RequestAction::failed;
+            }
 
-                if(next_dep_to_download_index >= data.remote_dependencies.size()) {
-                    break;
-                }
+            if (result.result == CURLE_OK && result.status < 400) {
+                metrics::add_stage_bytes(metrics::Stage::download, download.buffer.size(), download.buffer.size());
+                dep.downloaded_size = download.buffer.size();
+                writer.write(dep.target, std::move(download.buffer));
+                download.buffer = {};
+                finish(dep, DownloadState::Finished, {});
+                downloaded_count++;
+                return RequestAction::done;
             }
-        }
 
-        curl_multi_perform(multi_handle, &running_handles);
-
-        int msgs_in_queue = 0;
-        while (CURLMsg* msg = curl_multi_info_read(multi_handle, &msgs_in_queue)) {
-            if(msg->msg == CURLMSG_DONE) {
-                for (auto& download : downloaders) {
-                    if(download.handle == msg->easy_handle) {
-                        curl_multi_remove_handle(multi_handle, download.handle);
-                        std::printf("%s\n", download.dep_ptr->link.c_str());
-                        download.dep_ptr = nullptr;
-                        delete download.file_ptr;
-                        download.file_ptr = nullptr;
-                        downloaded_count++;
-                        break;
-                    }
-                }
+            download.buffer = {};
+            if (is_transient_error(result.result, result.status) && result.can_retry) {
+                log::detail("download_retried", "Retrying %s (%s)", dep.link.c_str(), status.c_str());
+                // Retried downloads go back to the queue, progress doesn't advance.
+                dep.state = DownloadState::NotStarted;
+                dep.error = std::move(status);
+                metrics::add(metrics::Counter::download_retries);
+                return RequestAction::retry;
             }
-        };
+            finish(dep, DownloadState::Failed, std::move(status));
+            return RequestAction::failed;
+        },
+
+        .expired = [&](size_t request) {
+            finish(data.remote_dependencies[request], DownloadState::Skipped, "download deadline reached");
+        },
+    });
 
-        int fds;
-        curl_multi_poll(multi_handle, nullptr, 0, 1000, &fds);
-    } while (running_handles || next_dep_to_download_index < data.remote_dependencies.size());
+    if (!in_time) {
+        log::warning("download_deadline", "Download deadline of %u seconds reached, remaining downloads were skipped.", config.dep_download_deadline);
+    }
 
+    writer.flush();
 
-    for (auto& download : downloaders) {
-        curl_easy_cleanup(download.handle);
-        download.handle = nullptr;
+    if (controller_log) {
+        std::fclose(controller_log);
     }
 
-    curl_multi_cleanup(multi_handle);
+    size_t skipped_count = 0, failed_count = 0;
+    for (auto &dep : data.remote_dependencies) {
+        if (dep.state == DownloadState::Skipped || dep.state == DownloadState::Failed) {
+            log::warning("download_failed", "%s %s: %s", dep.state == DownloadState::Skipped ? "Skipped" : "Failed", dep.link.c_str(), dep.error.c_str());
+            (dep.state == DownloadState::Skipped ? skipped_count : failed_count)++;
+        }
+    }
+
+    if (skipped_count || failed_count) {
+        replace_missing_images_with_links(config, data);
+    }
 
-    std::printf("%zu/%zu.\n", downloaded_count, data.remote_dependencies.size());
+    log::info("downloads_finished", "%zu/%zu downloaded, %zu skipped, %zu failed, %zu retries.",
+        downloaded_count, queued_count, skipped_count, failed_count, runner.retry_count());
 }
@@ -0,0 +1,387 @@
+#include <cstring>
+#include <fstream>
+
+#ifdef __linux__
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "file_writer.hpp"
+#include "log.hpp"
+
+
+
+static size_t part_size(const chm::FileWriter::Part &part) {
+    return std::visit([](auto &p) { return p.size(); }, part);
+}
+
+static std::string_view part_view(const chm::FileWriter::Part &part) {
+    return std::visit([](auto &p) { return std::string_view(p); }, part);
+}
+
+
+
+#ifdef __linux__
+// Minimal io_uring setup without liburing, only what is needed to submit batches and wait for them.
+struct chm::FileWriter::Ring {
+    int fd = -1;
+    unsigned slots = 0;     // Number of registered file slots, every job in a batch uses one.
+
+    void *sq_ptr = nullptr, *cq_ptr = nullptr;
+    size_t sq_map_size = 0, cq_map_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_map_size = 0;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    bool setup(unsigned file_slots) {
+        io_uring_params params = {};
+        fd = syscall(__NR_io_uring_setup, file_slots * 3, &params);
+        if (fd < 0) {
+            return false;
+        }
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+
+        sq_ptr = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            return false;
+        }
+
+        if (single_mmap) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                cq_ptr = nullptr;
+                return false;
+            }
+        }
+
+        sqes_map_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes_ptr = mmap(nullptr, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            return false;
+        }
+        sqes = (io_uring_sqe*)sqes_ptr;
+
+        auto sq = (char*)sq_ptr;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+
+        auto cq = (char*)cq_ptr;
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        // Files are opened directly into registered slots, so linked writes and closes can refer to them.
+        std::vector<int> sparse_files(file_slots, -1);
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, sparse_files.data(), file_slots) < 0) {
+            return false;
+        }
+
+        if (!probe_direct_open()) {
+            return false;
+        }
+
+        slots = file_slots;
+        return true;
+    }
+
+    // Kernels before 5.15 ignore file_index and open a normal descriptor, writes to the slot would fail
+    // and closing slot 0 would close whatever descriptor 0 is. Opening into a slot returns 0 if it worked.
+    bool probe_direct_open() {
+        io_uring_sqe *open_sqe = next_sqe();
+        open_sqe->opcode = IORING_OP_OPENAT;
+        open_sqe->fd = AT_FDCWD;
+        open_sqe->addr = (std::uint64_t)"/dev/null";
+        open_sqe->open_flags = O_RDONLY;
+        open_sqe->file_index = 1;
+
+        int res = -1;
+        if (!submit_and_wait(1, 1, [&](const io_uring_cqe &cqe) { res = cqe.res; })) {
+            return false;
+        }
+        if (res > 0) {
+            close(res);
+        }
+        if (res != 0) {
+            return false;
+        }
+
+        io_uring_sqe *close_sqe = next_sqe();
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->file_index = 1;
+        return submit_and_wait(1, 1, [](const io_uring_cqe&) {});
+    }
+
+    ~Ring() {
+        if (sqes) munmap(sqes, sqes_map_size);
+        if (cq_ptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_map_size);
+        if (sq_ptr) munmap(sq_ptr, sq_map_size);
+        if (fd >= 0) close(fd);
+    }
+
+    io_uring_sqe* next_sqe() {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        *sqe = {};
+        sq_array[index] = index;
+        std::atomic_ref(*sq_tail).store(tail + 1, std::memory_order_release);
+        return sqe;
+    }
+
+    // Calls callback for every completion that arrived, up to `limit` of them, returns how many.
+    template<typename Callback>
+    unsigned reap(unsigned limit, Callback &&callback) {
+        unsigned head = *cq_head;
+        unsigned reaped = 0;
+        while (head != std::atomic_ref(*cq_tail).load(std::memory_order_acquire) && reaped < limit) {
+            callback(cqes[head & *cq_mask]);
+            head++;
+            reaped++;
+        }
+        std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+        return reaped;
+    }
+
+    // Submits all queued entries and calls callback for every completion until `expected` completions were received.
+    // On failure it still waits for everything that was submitted, entries point to buffers of the caller.
+    template<typename Callback>
+    bool submit_and_wait(unsigned to_submit, unsigned expected, Callback &&callback) {
+        unsigned in_flight = 0;
+        while (expected > 0) {
+            int ret = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Completions show up in the mapped ring without entering the kernel.
+                while (in_flight > 0) {
+                    in_flight -= reap(in_flight, callback);
+                    sched_yield();
+                }
+                return false;
+            }
+            ret = std::min<unsigned>(to_submit, ret);
+            to_submit -= ret;
+            in_flight += ret;
+
+            unsigned reaped = reap(expected, callback);
+            expected -= reaped;
+            in_flight -= std::min(in_flight, reaped);
+        }
+        return true;
+    }
+};
+#else
+struct chm::FileWriter::Ring {};
+#endif
+
+
+
+chm::FileWriter::FileWriter(size_t batch_size, size_t batch_bytes) : batch_size(std::max<size_t>(batch_size, 1)), batch_bytes(batch_bytes) {
+    #ifdef __linux__
+    ring = std::make_unique<Ring>();
+    if (!ring->setup(this->batch_size)) {
+        ring = nullptr;
+    }
+    #endif
+}
+
+
+chm::FileWriter::~FileWriter() {
+    flush();
+}
+
+
+void chm::FileWriter::queue(Job &&job) {
+    std::vector<Job> batch;
+
+    {
+        std::lock_guard lock(queue_mutex);
+
+        for (auto &part : job.parts) {
+            pending_bytes += part_size(part);
+        }
+        pending.push_back(std::move(job));
+
+        if (pending.size() < batch_size && pending_bytes < batch_bytes) {
+            return;
+        }
+
+        batch.swap(pending);
+        pending_bytes = 0;
+    }
+
+    // Written by the thread that filled the batch, others can keep queuing new files in the meantime.
+    write_batch(batch);
+}
+
+
+void chm::FileWriter::flush() {
+    std::vector<Job> batch;
+
+    {
+        std::lock_guard lock(queue_mutex);
+        batch.swap(pending);
+        pending_bytes = 0;
+    }
+
+    if (!batch.empty()) {
+        write_batch(batch);
+    }
+}
+
+
+void chm::FileWriter::write_batch(std::vector<Job> &batch) {
+    std::lock_guard lock(ring_mutex);
+
+    #ifdef __linux__
+    for (size_t first = 0, count = 0; ring && first < batch.size(); first += count) {
+        count = std::min<size_t>(ring->slots, batch.size() - first);
+
+        std::vector<std::vector<iovec>> iovecs(count);
+        std::vector<size_t> expected_sizes(count);
+        std::vector<std::string> paths(count);
+
+        for (size_t i = 0; i < count; i++) {
+            auto &job = batch[first + i];
+            paths[i] = job.path.string();
+
+            for (auto &part : job.parts) {
+                auto view = part_view(part);
+                iovecs[i].push_back({(void*)view.data(), view.size()});
+                expected_sizes[i] += view.size();
+            }
+
+            // user_data is job index and which operation it is
+            io_uring_sqe *open_sqe = ring->next_sqe();
+            open_sqe->opcode = IORING_OP_OPENAT;
+            open_sqe->fd = AT_FDCWD;
+            open_sqe->addr = (std::uint64_t)paths[i].c_str();
+            open_sqe->len = 0644;
+            open_sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;  // O_CLOEXEC is not allowed for files opened into slots
+            open_sqe->file_index = i + 1;
+            open_sqe->flags = IOSQE_IO_LINK;
+            open_sqe->user_data = i * 3 + 0;
+
+            // Hard link, so the file is closed even if writing failed.
+            io_uring_sqe *write_sqe = ring->next_sqe();
+            write_sqe->opcode = IORING_OP_WRITEV;
+            write_sqe->fd = i;
+            write_sqe->addr = (std::uint64_t)iovecs[i].data();
+            write_sqe->len = iovecs[i].size();
+            write_sqe->off = 0;
+            write_sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            write_sqe->user_data = i * 3 + 1;
+
+            io_uring_sqe *close_sqe = ring->next_sqe();
+            close_sqe->opcode = IORING_OP_CLOSE;
+            close_sqe->file_index = i + 1;
+            close_sqe->user_data = i * 3 + 2;
+        }
+
+        // Setup made sure files are opened into slots, failed opens only fail their write.
+        bool ok = ring->submit_and_wait(count * 3, count * 3, [&](const io_uring_cqe &cqe) {
+            size_t i = cqe.user_data / 3;
+            if (cqe.user_data % 3 == 1) {
+                batch[first + i].done = cqe.res >= 0 && (size_t)cqe.res == expected_sizes[i];
+            }
+        });
+
+        if (!ok) {
+            ring = nullptr;
+        }
+    }
+    #endif
+
+    // Anything io_uring didn't write, including files with short writes.
+    for (auto &job : batch) {
+        if (!job.done) {
+            write_fallback(job);
+        }
+    }
+
+    batch.clear();
+}
+
+
+void chm::FileWriter::write_fallback(Job &job) {
+    #ifdef __linux__
+    int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        failed++;
+        log::error("write_failed", "Failed to write file: %s: %s", job.path.string().c_str(), std::strerror(errno));
+        return;
+    }
+
+    std::vector<iovec> iov;
+    for (auto &part : job.parts) {
+        auto view = part_view(part);
+        if (!view.empty()) {
+            iov.push_back({(void*)view.data(), view.size()});
+        }
+    }
+
+    off_t offset = 0;
+    size_t first = 0;
+    while (first < iov.size()) {
+        ssize_t written = pwritev(fd, &iov[first], std::min<size_t>(iov.size() - first, IOV_MAX), offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            failed++;
+            log::error("write_failed", "Failed to write file: %s: %s", job.path.string().c_str(), std::strerror(errno));
+            break;
+        }
+
+        offset += written;
+
+        // Skip fully written parts, and move start of partially written one.
+        while (first < iov.size() && (size_t)written >= iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = (char*)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    close(fd);
+    #else
+    std::ofstream file(job.path, std::ios::binary);
+    for (auto &part : job.parts) {
+        auto view = part_view(part);
+        file.write(view.data(), view.size());
+    }
+    if (!file) {
+        failed++;
+        log::error("write_failed", "Failed to write file: %s", job.path.string().c_str());
+    }
+    #endif
+
+    job.done = true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+
+
+namespace chm {
+    // Writes whole files in batches.
+    // On linux creating, writing and closing all files in a batch is submitted through io_uring at once.
+    // If io_uring is not available open + pwritev + close is used for every file.
+    class FileWriter {
+    public:
+        // Part of file contents. string_view parts must stay valid until the file is written, strings are owned by the writer.
+        using Part = std::variant<std::string_view, std::string>;
+
+        explicit FileWriter(size_t batch_size = 64, size_t batch_bytes = 16 * 1024 * 1024);
+        ~FileWriter();
+
+        // Queues file to be written, parts are written one after another without joining them first.
+        // Directory of the file must already exist.
+        template<typename... Parts>
+        void write(std::filesystem::path path, Parts&&... parts) {
+            Job job = {.path = std::move(path)};
+            job.parts.reserve(sizeof...(parts));
+            (job.parts.emplace_back(std::forward<Parts>(parts)), ...);
+            queue(std::move(job));
+        }
+
+        // Writes all queued files.
+        void flush();
+
+        size_t failed_count() const { return failed.load(); }
+
+    private:
+        struct Job {
+            std::filesystem::path path;
+            std::vector<Part> parts;
+            bool done = false;
+        };
+
+        struct Ring;
+
+        void queue(Job &&job);
+        void write_batch(std::vector<Job> &batch);
+        void write_fallback(Job &job);
+
+        size_t batch_size, batch_bytes;
+
+        std::mutex queue_mutex;
+        std::vector<Job> pending;
+        size_t pending_bytes = 0;
+
+        std::mutex ring_mutex;
+        std::unique_ptr<Ring> ring;     // nullptr if io_uring is not available
+        std::atomic<size_t> failed = 0;
+    };
+}
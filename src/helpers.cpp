@@ -1,83 +1,184 @@
-#include <cctype>
-
 #include "helpers.hpp"
+#include "text_kernels.hpp"
 
 
 
+// Text inside of tags is removed too, only text outside of any tag is kept.
 std::string remove_html_tags(std::string_view in) {
     int tags_inside = 0;
-    bool tag = false;
-    bool is_close_tag = false;
 
     std::string out;
 
     out.reserve(in.size());
 
-    for (auto& c : in) {
-        if (c == '<') {
-            tag = true;
-            continue;
-        }
-        if (!tag) {
-            if (tags_inside == 0) {
-                out += c;
-            }
-            continue;
+    size_t pos = 0;
+    while (pos < in.size()) {
+        size_t tag_open = chm::text::find_first_of(in, pos, "<");
+        if (tags_inside == 0) {
+            out += in.substr(pos, tag_open - pos);
         }
-        if (c == '/') {
-            is_close_tag = true;
+
+        size_t tag_close = chm::text::find_first_of(in, tag_open, ">");
+        if (tag_close == in.size()) {
+            break;
         }
-        if (c == '>') {
-            tag = false;
-            if (!is_close_tag) {
-                tags_inside++;
-            } else {
-                tags_inside--;
-                if (tags_inside < 0) {
-                    tags_inside = 0;
-                }
-            }
-            is_close_tag = false;
+
+        std::string_view tag = in.substr(tag_open + 1, tag_close - tag_open - 1);
+        if (chm::text::find_first_of(tag, 0, "/") == tag.size()) {
+            tags_inside++;
+        } else if (tags_inside > 0) {
+            tags_inside--;
         }
+
+        pos = tag_close + 1;
     }
 
     return out;
 }
 
+// If whole string is whitespace it is returned unchanged.
 std::string_view trim_whitespace(std::string_view in) {
-    size_t start = 0, end = in.size();
+    size_t start = chm::text::find_not_space(in);
+    if (start == in.size()) {
+        return in;
+    }
 
-    for (size_t i = 0; i < in.size(); i++) {
-        auto c = in[i];
+    size_t end = chm::text::rfind_not_space_end(in);
 
-        if (!std::isspace(c)) {
-            start = i;
-            break;
+    return in.substr(start, end - start);
+}
+
+std::string remove_hashes(std::string_view in) {
+    std::string out;
+
+    out.reserve(in.size());
+
+    size_t pos = 0;
+    while (pos < in.size()) {
+        size_t hash = chm::text::find_first_of(in, pos, "#");
+        out += in.substr(pos, hash - pos);
+        pos = hash + 1;
+    }
+
+    return out;
+}
+// Page name displayed to the user, file name without extension.
+// Dashes are replaced with spaces, github wiki web editor puts them in the file names.
+std::string page_name_from_file(const std::filesystem::path &file) {
+    std::string name = file.filename().replace_extension("").string();
+
+    for (auto& c : name) {
+        if (c == '-') {
+            c = ' ';
         }
     }
 
-    for (size_t i = in.size(); i > 0; i--) {
-        auto c = in[i - 1];
+    return name;
+}
+
+// github wiki page links have no file extension, dashes instead of spaces and are all lower case.
+std::string normalize_page_link(std::string_view link) {
+    std::string out(link);
+
+    for (size_t pos = chm::text::find_upper_or_space(out); pos < out.size(); pos = chm::text::find_upper_or_space(out, pos + 1)) {
+        out[pos] = chm::text::is_space(out[pos]) ? '-' : chm::text::to_lower(out[pos]);
+    }
+
+    return out;
+}
 
-        if (!std::isspace(c)) {
-            end = i;
+// Spaces become dashes, letters are lower case and everything else except digits is removed.
+void append_heading_id(std::string &out, std::string_view heading) {
+    size_t pos = 0;
+    while (pos < heading.size()) {
+        size_t end = chm::text::find_not_lower_alnum(heading, pos);
+        out += heading.substr(pos, end - pos);
+        if (end == heading.size()) {
             break;
         }
+
+        char c = heading[end];
+        if (chm::text::is_space(c)) {
+            out += '-';
+        } else if (chm::text::is_upper(c)) {
+            out += chm::text::to_lower(c);
+        }
+
+        pos = end + 1;
     }
+}
 
-    return in.substr(start, end - start);
+
+void append_json_string(std::string &out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if ((unsigned char)c < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
 }
 
-std::string remove_hashes(std::string_view in) {
-    std::string out;
 
-    out.reserve(in.size());
+// Length of character reference like &amp; or &#38; at the start of text, 0 if there isn't one.
+static size_t character_reference_length(std::string_view text) {
+    size_t pos = 1;
+    bool (*is_name_char)(unsigned char) = [](unsigned char c) { return std::isalnum(c) != 0; };
+    if (pos < text.size() && text[pos] == '#') {
+        pos++;
+        is_name_char = [](unsigned char c) { return std::isdigit(c) != 0; };
+        if (pos < text.size() && (text[pos] == 'x' || text[pos] == 'X')) {
+            pos++;
+            is_name_char = [](unsigned char c) { return std::isxdigit(c) != 0; };
+        }
+    } else if (pos == text.size() || !std::isalpha((unsigned char)text[pos])) {
+        return 0;
+    }
+
+    size_t name_start = pos;
+    while (pos < text.size() && is_name_char(text[pos])) {
+        pos++;
+    }
+    if (pos == name_start || pos == text.size() || text[pos] != ';') {
+        return 0;
+    }
+    return pos + 1;
+}
 
-    for (auto c : in) {
-        if(c != '#') {
-            out += c;
+void append_attribute_escaped(std::string &out, std::string_view text) {
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        switch (c) {
+        case '&':
+            // Text taken from generated html is already escaped, its references are kept as they are.
+            if (size_t length = character_reference_length(text.substr(i)); length > 0) {
+                out += text.substr(i, length);
+                i += length - 1;
+            } else {
+                out += "&amp;";
+            }
+            break;
+        case '"': out += "&quot;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        default: out += c; break;
         }
     }
+}
 
-    return out;
-}
\ No newline at end of file
+
+bool is_path_inside(const std::filesystem::path &path, const std::filesystem::path &dir) {
+    auto relative = std::filesystem::absolute(path).lexically_normal().lexically_relative(std::filesystem::absolute(dir).lexically_normal());
+    return !relative.empty() && *relative.begin() != "..";
+}
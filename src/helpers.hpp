@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <filesystem>
+#include <vector>
 
 #include <RUtils/ErrorOr.hpp>
 
@@ -11,4 +13,23 @@
 std::string remove_html_tags(std::string_view in);
 std::string_view trim_whitespace(std::string_view in);
 std::string remove_hashes(std::string_view in);
-RUtils::ErrorOr<std::string> convert_markdown_file_to_html(std::filesystem::path file);
\ No newline at end of file
+std::string page_name_from_file(const std::filesystem::path &file);
+std::string normalize_page_link(std::string_view link);
+void append_heading_id(std::string &out, std::string_view heading);
+// Appends text as a quoted json string.
+void append_json_string(std::string &out, std::string_view text);
+// Appends text with characters that would break out of a quoted html attribute value escaped,
+// character references already in the text are kept.
+void append_attribute_escaped(std::string &out, std::string_view text);
+// 64 bit FNV-1a, pass previous result as hash to continue hashing.
+constexpr std::uint64_t fnv1a_64(std::string_view data, std::uint64_t hash = 0xcbf29ce484222325) {
+    for (auto c : data) {
+        hash ^= (std::uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+// True if path is dir or something in it after resolving dot segments, paths aren't checked on disk.
+bool is_path_inside(const std::filesystem::path &path, const std::filesystem::path &dir);
+// If keywords is not null, front matter "keywords:" values are appended to it.
+RUtils::ErrorOr<std::string> convert_markdown_file_to_html(std::filesystem::path file, std::vector<std::string> *keywords = nullptr);
\ No newline at end of file
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <mutex>
+#include <span>
+
+#include "highlight.hpp"
+#include "helpers.hpp"
+#include "text_kernels.hpp"
+
+
+
+const std::string_view chm::highlight_stylesheet =
+    "pre { background: #f6f8fa; padding: 8px; }\n"
+    "pre .hl-kw { color: #cf222e; }\n"
+    "pre .hl-type { color: #0550ae; }\n"
+    "pre .hl-str { color: #0a3069; }\n"
+    "pre .hl-key { color: #0550ae; }\n"
+    "pre .hl-num { color: #0550ae; }\n"
+    "pre .hl-com { color: #6e7781; font-style: italic; }\n"
+    "pre .hl-pp { color: #8250df; }\n"
+    "pre .hl-var { color: #953800; }\n";
+
+
+
+// Language description, one generic lexer is driven by these tables.
+struct Language {
+    std::span<const std::string_view> names;            // Fenced code block info strings
+    std::span<const std::string_view> keywords;         // Sorted
+    std::span<const std::string_view> types;            // Sorted
+    std::string_view line_comment;
+    std::string_view block_comment_begin, block_comment_end;
+    std::string_view quotes;
+    bool preprocessor = false;          // # at line start starts a directive
+    bool comment_after_space = false;   // Line comment starts only at start of a word, like # in shell
+    bool variables = false;             // $name and ${name}
+    bool triple_quotes = false;         // """python strings"""
+    bool object_keys = false;           // Strings followed by ':' are keys
+};
+
+
+// Keyword tables have to be sorted for binary search, without duplicates.
+template<size_t size>
+constexpr bool is_sorted(const std::array<std::string_view, size> &words) {
+    return std::adjacent_find(words.begin(), words.end(), std::greater_equal<>()) == words.end();
+}
+
+
+constexpr auto c_names = std::to_array<std::string_view>({"c", "cpp", "c++", "cxx", "h", "hpp"});
+constexpr auto c_keywords = std::to_array<std::string_view>({
+    "alignas", "alignof", "asm", "auto", "break", "case", "catch", "class", "co_await", "co_return", "co_yield",
+    "concept", "const", "const_cast", "consteval", "constexpr", "constinit", "continue", "decltype", "default", "delete",
+    "do", "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false", "final", "for", "friend", "goto", "if",
+    "inline", "mutable", "namespace", "new", "noexcept", "nullptr", "operator", "override", "private", "protected",
+    "public", "register", "reinterpret_cast", "requires", "restrict", "return", "sizeof", "static", "static_assert",
+    "static_cast", "struct", "switch", "template", "this", "thread_local", "throw", "true", "try", "typedef", "typeid",
+    "typename", "union", "using", "virtual", "volatile", "while",
+});
+constexpr auto c_types = std::to_array<std::string_view>({
+    "bool", "char", "char16_t", "char32_t", "char8_t", "double", "float", "int", "int16_t", "int32_t", "int64_t",
+    "int8_t", "intptr_t", "long", "ptrdiff_t", "short", "signed", "size_t", "std", "uint16_t", "uint32_t", "uint64_t",
+    "uint8_t", "uintptr_t", "unsigned", "void", "wchar_t",
+});
+static_assert(is_sorted(c_keywords) && is_sorted(c_types));
+
+constexpr auto python_names = std::to_array<std::string_view>({"python", "py", "python3"});
+constexpr auto python_keywords = std::to_array<std::string_view>({
+    "False", "None", "True", "and", "as", "assert", "async", "await", "break", "case", "class", "continue", "def", "del",
+    "elif", "else", "except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda", "match",
+    "nonlocal", "not", "or", "pass", "raise", "return", "try", "while", "with", "yield",
+});
+constexpr auto python_types = std::to_array<std::string_view>({
+    "bool", "bytes", "dict", "float", "int", "len", "list", "object", "print", "self", "set", "str",
+});
+static_assert(is_sorted(python_keywords) && is_sorted(python_types));
+
+constexpr auto json_names = std::to_array<std::string_view>({"json", "jsonc"});
+constexpr auto json_keywords = std::to_array<std::string_view>({"false", "null", "true"});
+static_assert(is_sorted(json_keywords));
+
+constexpr auto shell_names = std::to_array<std::string_view>({"sh", "bash", "shell", "zsh", "console", "shell-session"});
+constexpr auto shell_keywords = std::to_array<std::string_view>({
+    "case", "declare", "do", "done", "elif", "else", "esac", "exit", "export", "fi", "for", "function", "if", "in",
+    "local", "readonly", "return", "select", "set", "source", "then", "unset", "until", "while",
+});
+constexpr auto shell_types = std::to_array<std::string_view>({
+    "cd", "cmake", "cp", "curl", "echo", "git", "ls", "make", "meson", "mkdir", "ninja", "pip", "rm", "sudo",
+});
+static_assert(is_sorted(shell_keywords) && is_sorted(shell_types));
+
+constexpr auto js_names = std::to_array<std::string_view>({"js", "javascript", "ts", "typescript", "jsx"});
+constexpr auto js_keywords = std::to_array<std::string_view>({
+    "abstract", "as", "async", "await", "break", "case", "catch", "class", "const", "continue", "debugger", "declare",
+    "default", "delete", "do", "else", "enum", "export", "extends", "false", "finally", "for", "from", "function", "if",
+    "implements", "import", "in", "instanceof", "interface", "keyof", "let", "namespace", "new", "null", "of", "private",
+    "protected", "public", "readonly", "return", "static", "super", "switch", "this", "throw", "true", "try", "type",
+    "typeof", "undefined", "var", "while", "with", "yield",
+});
+constexpr auto js_types = std::to_array<std::string_view>({
+    "Array", "Map", "Object", "Promise", "Set", "any", "boolean", "number", "string", "void",
+});
+static_assert(is_sorted(js_keywords) && is_sorted(js_types));
+
+constexpr auto rust_names = std::to_array<std::string_view>({"rust", "rs"});
+constexpr auto rust_keywords = std::to_array<std::string_view>({
+    "Self", "as", "async", "await", "break", "const", "continue", "crate", "dyn", "else", "enum", "extern", "false", "fn",
+    "for", "if", "impl", "in", "let", "loop", "match", "mod", "move", "mut", "pub", "ref", "return", "self", "static",
+    "struct", "super", "trait", "true", "type", "unsafe", "use", "where", "while",
+});
+constexpr auto rust_types = std::to_array<std::string_view>({
+    "Box", "Option", "Result", "String", "Vec", "bool", "char", "f32", "f64", "i128", "i16", "i32", "i64", "i8", "isize",
+    "str", "u128", "u16", "u32", "u64", "u8", "usize",
+});
+static_assert(is_sorted(rust_keywords) && is_sorted(rust_types));
+
+
+static const Language languages[] = {
+    {.names = c_names, .keywords = c_keywords, .types = c_types, .line_comment = "//", .block_comment_begin = "/*", .block_comment_end = "*/", .quotes = "\"'", .preprocessor = true},
+    {.names = python_names, .keywords = python_keywords, .types = python_types, .line_comment = "#", .quotes = "\"'", .triple_quotes = true},
+    {.names = json_names, .keywords = json_keywords, .line_comment = "//", .quotes = "\"", .object_keys = true},
+    {.names = shell_names, .keywords = shell_keywords, .types = shell_types, .line_comment = "#", .quotes = "\"'", .comment_after_space = true, .variables = true},
+    {.names = js_names, .keywords = js_keywords, .types = js_types, .line_comment = "//", .block_comment_begin = "/*", .block_comment_end = "*/", .quotes = "\"'`"},
+    {.names = rust_names, .keywords = rust_keywords, .types = rust_types, .line_comment = "//", .block_comment_begin = "/*", .block_comment_end = "*/", .quotes = "\""},
+};
+
+
+static const Language* find_language(std::string_view name) {
+    for (auto &language : languages) {
+        if (std::find(language.names.begin(), language.names.end(), name) != language.names.end()) {
+            return &language;
+        }
+    }
+    return nullptr;
+}
+
+
+enum CharClass : std::uint8_t {
+    ident_start = 1 << 0,
+    ident = 1 << 1,
+    digit = 1 << 2,
+};
+
+static constexpr std::array<std::uint8_t, 256> char_classes = [] {
+    std::array<std::uint8_t, 256> classes = {};
+    for (int c = 0; c < 256; c++) {
+        bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+        bool number = c >= '0' && c <= '9';
+        classes[c] = (letter ? ident_start | ident : 0) | (number ? digit | ident : 0);
+    }
+    return classes;
+}();
+
+static bool has_class(char c, std::uint8_t char_class) {
+    return char_classes[(std::uint8_t)c] & char_class;
+}
+
+
+// maddy may or may not escape code, so it is unescaped before lexing and everything is escaped again on output.
+static std::string unescape_html(std::string_view in) {
+    static constexpr std::pair<std::string_view, char> entities[] = {
+        {"&lt;", '<'}, {"&gt;", '>'}, {"&amp;", '&'}, {"&quot;", '"'}, {"&#39;", '\''}, {"&#x27;", '\''},
+    };
+
+    std::string out;
+    out.reserve(in.size());
+
+    size_t pos = 0;
+    while (pos < in.size()) {
+        size_t amp = chm::text::find_first_of(in, pos, "&");
+        out += in.substr(pos, amp - pos);
+        if (amp == in.size()) {
+            break;
+        }
+
+        pos = amp + 1;
+        out += '&';
+        for (auto &[entity, c] : entities) {
+            if (in.substr(amp).starts_with(entity)) {
+                out.back() = c;
+                pos = amp + entity.size();
+                break;
+            }
+        }
+    }
+
+    return out;
+}
+
+static void append_escaped(std::string &out, std::string_view text) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t special = chm::text::find_first_of(text, pos, "<>&");
+        out += text.substr(pos, special - pos);
+        if (special == text.size()) {
+            break;
+        }
+
+        switch (text[special]) {
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            case '&': out += "&amp;"; break;
+        }
+        pos = special + 1;
+    }
+}
+
+static void append_token(std::string &out, std::string_view css_class, std::string_view text) {
+    out += "<span class=\"";
+    out += css_class;
+    out += "\">";
+    append_escaped(out, text);
+    out += "</span>";
+}
+
+
+static size_t line_end(std::string_view code, size_t pos) {
+    size_t end = code.find('\n', pos);
+    return end == std::string_view::npos ? code.size() : end;
+}
+
+// Position after closing quote, backslash escapes the next char.
+static size_t string_end(std::string_view code, size_t pos, std::string_view quote, bool multiline) {
+    for (size_t i = pos + quote.size(); i < code.size(); i++) {
+        if (code[i] == '\\') {
+            i++;
+        }
+        else if (code.substr(i).starts_with(quote)) {
+            return i + quote.size();
+        }
+        else if (code[i] == '\n' && !multiline) {
+            return i;
+        }
+    }
+    return code.size();
+}
+
+
+static std::string lex(const Language &language, std::string_view code) {
+    std::string out;
+    out.reserve(code.size() * 2);
+
+    auto is_word = [](std::span<const std::string_view> words, std::string_view word) {
+        return std::binary_search(words.begin(), words.end(), word);
+    };
+
+    bool line_start = true;     // Only whitespace since start of the line
+    size_t plain_start = 0;     // Text not part of any token is copied in spans
+
+    auto token = [&](size_t start, size_t end, std::string_view css_class) {
+        append_escaped(out, code.substr(plain_start, start - plain_start));
+        append_token(out, css_class, code.substr(start, end - start));
+        plain_start = end;
+        return end;
+    };
+
+    size_t i = 0;
+    while (i < code.size()) {
+        char c = code[i];
+        std::string_view rest = code.substr(i);
+
+        if (c == '\n') {
+            line_start = true;
+            i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t') {
+            i++;
+            continue;
+        }
+
+        bool was_line_start = line_start;
+        line_start = false;
+
+        if (language.preprocessor && was_line_start && c == '#') {
+            i = token(i, line_end(code, i), "hl-pp");
+        }
+        else if (!language.line_comment.empty() && rest.starts_with(language.line_comment)
+                 && (!language.comment_after_space || i == 0 || chm::text::is_space(code[i - 1]))) {
+            i = token(i, line_end(code, i), "hl-com");
+        }
+        else if (!language.block_comment_begin.empty() && rest.starts_with(language.block_comment_begin)) {
+            size_t end = code.find(language.block_comment_end, i + language.block_comment_begin.size());
+            i = token(i, end == std::string_view::npos ? code.size() : end + language.block_comment_end.size(), "hl-com");
+        }
+        else if (language.quotes.find(c) != std::string_view::npos) {
+            std::string_view quote = code.substr(i, 1);
+            if (language.triple_quotes && rest.size() >= 3 && rest[1] == c && rest[2] == c) {
+                quote = code.substr(i, 3);
+            }
+            size_t end = string_end(code, i, quote, quote.size() == 3 || c == '`');
+
+            std::string_view css_class = "hl-str";
+            if (language.object_keys) {
+                size_t next = end;
+                while (next < code.size() && chm::text::is_space(code[next])) {
+                    next++;
+                }
+                if (next < code.size() && code[next] == ':') {
+                    css_class = "hl-key";
+                }
+            }
+            i = token(i, end, css_class);
+        }
+        else if (has_class(c, digit) || (c == '.' && rest.size() > 1 && has_class(rest[1], digit))) {
+            size_t end = i + 1;
+            while (end < code.size() && (has_class(code[end], ident) || code[end] == '.' || code[end] == '\''
+                   || ((code[end] == '-' || code[end] == '+') && (code[end - 1] == 'e' || code[end - 1] == 'E')))) {
+                end++;
+            }
+            i = token(i, end, "hl-num");
+        }
+        else if (has_class(c, ident_start)) {
+            size_t end = i + 1;
+            while (end < code.size() && has_class(code[end], ident)) {
+                end++;
+            }
+
+            std::string_view word = code.substr(i, end - i);
+            if (is_word(language.keywords, word)) {
+                i = token(i, end, "hl-kw");
+            } else if (is_word(language.types, word)) {
+                i = token(i, end, "hl-type");
+            } else {
+                i = end;
+            }
+        }
+        else if (language.variables && c == '$' && rest.size() > 1) {
+            size_t end = i + 1;
+            if (code[end] == '{') {
+                end = code.find('}', end);
+                end = end == std::string_view::npos ? code.size() : end + 1;
+            } else {
+                while (end < code.size() && has_class(code[end], ident)) {
+                    end++;
+                }
+            }
+            i = end > i + 1 ? token(i, end, "hl-var") : i + 1;
+        }
+        else {
+            i++;
+        }
+    }
+
+    append_escaped(out, code.substr(plain_start));
+    return out;
+}
+
+
+
+const std::string* chm::CodeHighlighter::highlight(std::string_view language_name, std::string_view code) {
+    const Language *language = find_language(language_name);
+    if (!language) {
+        return nullptr;
+    }
+
+    std::uint64_t hash = fnv1a_64(code, fnv1a_64(language_name));
+
+    {
+        std::shared_lock lock(mutex);
+        if (auto it = cache.find(hash); it != cache.end() && it->second.code == code) {
+            hits++;
+            return &it->second.html;
+        }
+    }
+
+    misses++;
+    std::string html = lex(*language, unescape_html(code));
+
+    // Map nodes never move, pointer stays valid after the lock is released.
+    std::unique_lock lock(mutex);
+    auto [it, inserted] = cache.try_emplace(hash, CachedBlock{std::string(code), std::move(html)});
+    if (!inserted && it->second.code != code) {
+        // Hash collision, first block stays cached.
+        static thread_local std::string uncached;
+        uncached = lex(*language, unescape_html(code));
+        return &uncached;
+    }
+    return &it->second.html;
+}
+
+
+size_t chm::CodeHighlighter::highlight_code_blocks(std::string &html) {
+    constexpr std::string_view block_begin = "<pre class=\"";
+    constexpr std::string_view code_begin = "\"><code>";
+    constexpr std::string_view code_end = "</code></pre>";
+
+    size_t highlighted = 0;
+    size_t pos = 0;
+
+    while ((pos = html.find(block_begin, pos)) != std::string::npos) {
+        size_t language_begin = pos + block_begin.size();
+        size_t language_end = html.find(code_begin, language_begin);
+        if (language_end == std::string::npos) {
+            break;
+        }
+        size_t contents_begin = language_end + code_begin.size();
+        size_t contents_end = html.find(code_end, contents_begin);
+        if (contents_end == std::string::npos) {
+            break;
+        }
+
+        // Only first word of info string, lower case.
+        std::string_view info = trim_whitespace(std::string_view(html).substr(language_begin, language_end - language_begin));
+        std::string language(info.substr(0, std::min(info.find_first_of(" \t{,"), info.size())));
+        for (auto &c : language) {
+            c = text::to_lower(c);
+        }
+
+        const std::string *code = highlight(language, std::string_view(html).substr(contents_begin, contents_end - contents_begin));
+        if (!code) {
+            pos = contents_end + code_end.size();
+            continue;
+        }
+
+        html.replace(contents_begin, contents_end - contents_begin, *code);
+        pos = contents_begin + code->size() + code_end.size();
+        highlighted++;
+    }
+
+    return highlighted;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+
+
+namespace chm {
+    // Stylesheet with colors of all hl-* classes, written once to temp and linked from pages with highlighted code.
+    extern const std::string_view highlight_stylesheet;
+    constexpr std::string_view highlight_stylesheet_name = "highlight.css";
+
+    // Turns code blocks into html with <span class="hl-*"> tokens, so code is colored without running scripts in the viewer.
+    // Same snippets repeat across pages, highlighted blocks are cached by hash of language and code.
+    class CodeHighlighter {
+    public:
+        // Highlights contents of all <pre class="language"><code> blocks that maddy created.
+        // Returns number of highlighted blocks, blocks with unknown language are left as is.
+        size_t highlight_code_blocks(std::string &html);
+
+        size_t cache_hits() const { return hits.load(); }
+        size_t cache_misses() const { return misses.load(); }
+
+    private:
+        struct CachedBlock {
+            std::string code;       // To detect hash collisions
+            std::string html;
+        };
+
+        // code is html escaped block contents, returns nullptr if language is not known.
+        const std::string* highlight(std::string_view language, std::string_view code);
+
+        std::shared_mutex mutex;
+        std::unordered_map<std::uint64_t, CachedBlock> cache;
+        std::atomic<size_t> hits = 0, misses = 0;
+    };
+}
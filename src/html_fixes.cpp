@@ -1,15 +1,13 @@
-#include <cstring>
 #include <regex>
 #include <format>
 
 #include <RUtils/Error.hpp>
-#include <RUtils/Defer.hpp>
-
-#define NOMINMAX // Maybe a bug in curl.wrap: on windows min max macros are added and collide with std::min/std::max
-                 // why microsoft didn't make this the default already??? no one uses those.
-#include "curl/curl.h"
 
 #include "project.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "url.hpp"
 
 
 
@@ -26,14 +24,7 @@ void chm::update_html_headings_to_include_id(std::string &html) {
         new_tag += match[1];
         new_tag += " id=\"";
 
-        for (auto c : match[2].str()) {
-            if(std::isspace(c)) {
-                new_tag += '-';
-            }
-            if(std::isalnum(c)) {
-                new_tag += std::tolower(c);
-            }
-        }
+        append_heading_id(new_tag, std::string_view(match[2].first, match[2].second));
 
         new_tag += "\">";
         new_tag += match[2];
@@ -62,26 +53,26 @@ void chm::update_html_links_to_pages(const ProjectConfig &config, ProjectData &d
         }
 
         std::string url_str = match[2];
-        ProjectFile* url_target = find_local_file_pointed_by_url(config, data, url_str);
+        FileId url_target = find_local_file_pointed_by_url(config, data, url_str);
 
-        if(!url_target) {
+        if(url_target == no_file) {
             // std::printf("  Unknown link: \"%s\", it will be broken inside the compiled .chm file.\n", url_str.c_str());
             continue;
         }
 
         std::string new_link_tag = match[1];
-        new_link_tag += std::filesystem::relative(url_target->target, config.temp).string();
+        new_link_tag += data.files.link(url_target);
         new_link_tag += match[3];
 
         html.replace(i + match.position(), match.length(), new_link_tag);
 
-        i += new_link_tag.length() - match.size();
+        i += new_link_tag.length() - match.length();
     }
 }
 
 
-// If url has host add `target="_blank"`
-void chm::update_html_remote_links_to_open_in_new_broser_window(const ProjectData &data, std::string &html) {
+// If url is external add `target="_blank"`
+void chm::update_html_remote_links_to_open_in_new_broser_window(const ProjectData &data, std::string &html, std::vector<std::string> *external_links) {
     std::regex link_tag_test("(<a +href=\")(.*?)(\")(>)");
 
     std::match_results<std::string_view::const_iterator> match;
@@ -93,28 +84,23 @@ void chm::update_html_remote_links_to_open_in_new_broser_window(const ProjectDat
             break;
         }
 
-        std::string url_str = match[2];
-
-        CURLU* url_handle = curl_url();
-        RUtils::Defer( curl_url_cleanup(url_handle); );
-
-        if (CURLUcode err = curl_url_set(url_handle, CURLUPART_URL, url_str.c_str(), CURLU_DEFAULT_SCHEME | CURLU_NO_AUTHORITY | CURLU_ALLOW_SPACE); err != CURLUE_OK) {
-            std::puts(std::format("Failed to parse link: \"{}\": {}.", url_str, curl_url_strerror(err)).c_str());
-            continue;
-        }
+        std::string_view url_str(match[2].first, match[2].second);
 
-        char* url_host;
-        if (CURLUcode err = curl_url_get(url_handle, CURLUPART_HOST, &url_host, 0)) {
-            RUtils::Error(curl_url_strerror(err), RUtils::ErrorType::library).print();
+        url::Parts parts = url::split(url_str);
+        if (parts.kind != url::Kind::external) {
             continue;
         }
 
-        RUtils::Defer( curl_free(url_host); );
-
-        size_t url_host_sz = std::strlen(url_host);
-
-        if (url_host_sz == 0 || (url_host_sz == 1 && url_host[0] == '.')) {
-            continue;
+        if (external_links && (parts.scheme == "http" || parts.scheme == "https")) {
+            // Fragment isn't sent to the server, links to different sections of a page are checked once.
+            std::string_view link = url_str.substr(0, url_str.find('#'));
+            std::string &url = external_links->emplace_back();
+            for (size_t pos = 0; pos < link.size(); pos++) {
+                url += link[pos];
+                if (link.substr(pos).starts_with("&amp;")) {
+                    pos += 4;
+                }
+            }
         }
 
         constexpr std::string_view to_insert = " target=\"_blank\"";
@@ -125,82 +111,43 @@ void chm::update_html_remote_links_to_open_in_new_broser_window(const ProjectDat
 
 
 
-chm::ProjectFile* chm::find_local_file_pointed_by_url(const ProjectConfig &config, ProjectData &data, const std::string &url) {
-    CURLU *url_handle = curl_url();
-    RUtils::Defer( curl_url_cleanup(url_handle); );
+chm::FileId chm::find_local_file_pointed_by_url(const ProjectConfig &config, const ProjectData &data, const std::string &url) {
+    url::Parts parts = url::split(url);
 
-    if (CURLUcode err = curl_url_set(url_handle, CURLUPART_URL, url.c_str(), CURLU_DEFAULT_SCHEME | CURLU_NO_AUTHORITY | CURLU_ALLOW_SPACE); err != CURLUE_OK) {
-        std::puts(std::format("Failed to parse link: \"{}\": {}.", url, curl_url_strerror(err)).c_str());
-        return nullptr;
+    if (parts.kind != url::Kind::page && parts.kind != url::Kind::asset) {
+        // not a local link or no path
+        return no_file;
     }
 
-
-    char *url_host, *url_path;
-    if (CURLUcode err = curl_url_get(url_handle, CURLUPART_HOST, &url_host, 0); err != CURLUE_OK) {
-        RUtils::Error(curl_url_strerror(err), RUtils::ErrorType::library).print();
-        return nullptr;
+    std::string_view path = url::local_path(parts);
+    if (path.empty()) {
+        return no_file;
     }
-    RUtils::Defer( curl_free(url_host); );
 
-    if (CURLUcode err = curl_url_get(url_handle, CURLUPART_PATH, &url_path, 0); err != CURLUE_OK) {
-        RUtils::Error(curl_url_strerror(err), RUtils::ErrorType::library).print();
-        return nullptr;
+    if (FileId file = find_page(data, path); file != no_file) {
+        return file;
     }
-    RUtils::Defer( curl_free(url_path); );
 
+    metrics::add(metrics::Counter::unresolved_links);
+    log::warning("unresolved_link", "Failed to find a file that the link was pointing to, it's either a bug or the link is wrong. Link: \"%s\"", url.c_str());
 
-    if (std::strlen(url_host) > 1 || (std::strlen(url_host) == 1 && url_host[0] != '.')) {
-        // not a local link
-        return nullptr;
-    }
-
-    if (std::strlen(url_path) <= 1) {
-        // no path
-        return nullptr;
-    }
-
-
-
-    // paths always start with '/', skip it to get correct result.
-    std::filesystem::path path_to_search = &url_path[1];
-
-    for (auto& f : data.files) {
-        auto original = std::filesystem::relative(f.original, config.root);
-
-        // links to files
-        if (path_to_search == original) {
-            return &f;
-        }
+    return no_file;
+}
 
-        // github wiki page links
-        // no file extension
-        // dashes instead of spaces
-        // all lower case
-        original = original.replace_extension("");
 
-        auto link_normalize = [](std::string& inout) {
-            for (auto &c : inout) {
-                if (std::isspace(c)) {
-                    c = '-';
-                }
-                else if (std::isalnum(c)) {
-                    c = std::tolower(c);
-                }
-            }
-        };
 
-        std::string path_normalized = path_to_search.string();
-        std::string original_normalized = original.string();
+chm::FileId chm::find_page(const ProjectData &data, std::string_view path) {
+    std::string path_generic = std::filesystem::path(path).generic_string();
 
-        link_normalize(path_normalized);
-        link_normalize(original_normalized);
-
-        if (path_normalized == original_normalized) {
-            return &f;
-        }
+    // links to files
+    if (auto it = data.page_lookup.paths.find(path_generic); it != data.page_lookup.paths.end()) {
+        return it->second;
     }
 
-    RUtils::Error(std::format("Failed to find a file that the link was pointing to, it's either a bug or the link is wrong. Link: \"{}\"", url)).print();
+    // github wiki page links
+    if (auto it = data.page_lookup.page_names.find(normalize_page_link(path_generic)); it != data.page_lookup.page_names.end()) {
+        return it->second;
+    }
 
-    return nullptr;
+    return no_file;
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include <array>
+#include <cstring>
+
+#include "project.hpp"
+#include "text_kernels.hpp"
+
+
+
+static bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (chm::text::to_lower(a[i]) != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whitespace inside these tags is kept as is.
+static bool is_preformatted_tag(std::string_view name) {
+    constexpr std::array<std::string_view, 5> tags = {"pre", "code", "textarea", "script", "style"};
+    for (auto tag : tags) {
+        if (equals_ignore_case(name, tag)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Attributes where only presence matters, checked="checked" and checked="" are the same as checked.
+static bool is_boolean_attribute(std::string_view name) {
+    constexpr std::array<std::string_view, 14> attributes = {
+        "async", "autofocus", "checked", "defer", "disabled", "hidden", "ismap", "multiple", "nowrap", "open", "readonly",
+        "required", "reversed", "selected",
+    };
+    for (auto attribute : attributes) {
+        if (equals_ignore_case(name, attribute)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Minifies html in place, output is never longer than input so it is written over the input as it is read.
+// Everything is done in one pass:
+// - whitespace runs outside of <pre>, <code>, <textarea>, <script> and <style> become a single space
+// - comments are removed, except conditional comments like <!--[if IE]>
+// - whitespace between attributes is collapsed and boolean attributes are shortened
+size_t chm::minify_html(std::string &html) {
+    const size_t size = html.size();
+    char *data = html.data();
+
+    size_t read = 0, write = 0;
+    int preformatted_depth = 0;
+    bool pending_space = false;
+
+    auto copy = [&](size_t from, size_t to) {
+        if (write != from) {
+            std::memmove(data + write, data + from, to - from);
+        }
+        write += to - from;
+    };
+
+    auto flush_space = [&]() {
+        // Whitespace at the start is dropped
+        if (pending_space && write > 0) {
+            data[write++] = ' ';
+        }
+        pending_space = false;
+    };
+
+    std::string_view view(html);
+
+    while (read < size) {
+        char c = data[read];
+
+        if (c != '<') {
+            if (preformatted_depth > 0) {
+                size_t end = text::find_first_of(view, read, "<");
+                copy(read, end);
+                read = end;
+                continue;
+            }
+
+            if (text::is_space(c)) {
+                pending_space = true;
+                read++;
+                continue;
+            }
+
+            flush_space();
+            size_t end = text::find_first_of(view, read, "< \n\t");
+            // \r, \v and \f are rare, handle them here instead of in the search.
+            for (size_t i = read; i < end; i++) {
+                if (text::is_space(data[i])) {
+                    end = i;
+                    break;
+                }
+            }
+            copy(read, end);
+            read = end;
+            continue;
+        }
+
+
+        if (view.substr(read).starts_with("<!--")) {
+            size_t end = view.find("-->", read + 4);
+            end = end == std::string_view::npos ? size : end + 3;
+
+            if (view.substr(read).starts_with("<!--[")) {
+                flush_space();
+                copy(read, end);
+            }
+            read = end;
+            continue;
+        }
+
+
+        // Tag
+        flush_space();
+
+        size_t name_begin = read + 1;
+        bool closing = name_begin < size && data[name_begin] == '/';
+        if (closing) {
+            name_begin++;
+        }
+        size_t name_end = name_begin;
+        while (name_end < size && !text::is_space(data[name_end]) && data[name_end] != '>' && data[name_end] != '/') {
+            name_end++;
+        }
+        std::string_view name = view.substr(name_begin, name_end - name_begin);
+        bool preformatted = is_preformatted_tag(name);
+
+        copy(read, name_end);
+        read = name_end;
+
+        bool self_closing = false;
+        while (read < size && data[read] != '>') {
+            c = data[read];
+
+            if (text::is_space(c)) {
+                size_t next = text::find_not_space(view, read);
+                char prev = data[write - 1];
+                bool drop = next == size || data[next] == '>' || (data[next] == '/' && (prev == '"' || prev == '\''));
+                if (!drop) {
+                    data[write++] = ' ';
+                }
+                read = next;
+                continue;
+            }
+
+            if (c == '"' || c == '\'') {
+                size_t end = view.find(c, read + 1);
+                end = end == std::string_view::npos ? size : end + 1;
+                copy(read, end);
+                read = end;
+                continue;
+            }
+
+            if (c == '/') {
+                self_closing = true;
+                data[write++] = c;
+                read++;
+                continue;
+            }
+
+            // Attribute name, maybe followed by a value
+            size_t attribute_end = read;
+            while (attribute_end < size && !text::is_space(data[attribute_end]) && data[attribute_end] != '=' && data[attribute_end] != '>' && data[attribute_end] != '/') {
+                attribute_end++;
+            }
+            std::string_view attribute = view.substr(read, attribute_end - read);
+
+            if (attribute_end + 1 < size && data[attribute_end] == '=' && (data[attribute_end + 1] == '"' || data[attribute_end + 1] == '\'') && is_boolean_attribute(attribute)) {
+                size_t value_begin = attribute_end + 2;
+                size_t value_end = view.find(data[attribute_end + 1], value_begin);
+                if (value_end != std::string_view::npos) {
+                    std::string_view value = view.substr(value_begin, value_end - value_begin);
+                    if (value.empty() || equals_ignore_case(value, attribute)) {
+                        copy(read, attribute_end);
+                        read = value_end + 1;
+                        continue;
+                    }
+                }
+            }
+
+            self_closing = false;
+            copy(read, std::max(attribute_end, read + 1));
+            read = std::max(attribute_end, read + 1);
+        }
+
+        if (read < size) {
+            data[write++] = '>';
+            read++;
+        }
+
+        if (preformatted && !self_closing) {
+            preformatted_depth += closing ? -1 : 1;
+            preformatted_depth = std::max(preformatted_depth, 0);
+        }
+    }
+
+    html.resize(write);
+    return size - write;
+}
@@ -1,12 +1,15 @@
+#include <mutex>
 #include <regex>
 
 #include "project.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "url.hpp"
 
 
 
 void chm::scan_html_for_local_dependencies(const ProjectConfig &config, ProjectData &data, const std::string& html) {
     std::regex img_tag_test("<img +src=\"(.*?)\" *(alt=\"(.*?)\")?\\/>"); // 1 group - image url, 3 group alt text.
-    std::regex web_link_test("(http|https)://.*\\..*");
 
     auto begin = std::sregex_iterator(html.begin(), html.end(), img_tag_test);
     auto end = std::sregex_iterator();
@@ -14,60 +17,147 @@ void chm::scan_html_for_local_dependencies(const ProjectConfig &config, ProjectD
     for (std::sregex_iterator i = begin; i != end; ++i) {
         std::string url = (*i)[1];
 
-        bool is_web_link = std::regex_match(url, web_link_test);
+        bool is_web_link = url::split(url).kind == url::Kind::external;
 
-        auto file_path = config.root / url;
+        auto file_path = (config.root / url).lexically_normal();
+
+        // Its copy would end up outside of temp path, and the chm can't contain it anyway.
+        if (!is_web_link && !is_path_inside(file_path, config.root)) {
+            log::warning("dependency_outside_root", "Skipping image outside of root path: %s", url.c_str());
+            continue;
+        }
 
         // If local add the file to project.
         if(!is_web_link && std::filesystem::exists(file_path)) {
+            // Pages are scanned by multiple threads at once.
+            static std::mutex local_dependencies_mutex;
+            std::lock_guard lock(local_dependencies_mutex);
+
+            auto relative = std::filesystem::relative(file_path, config.root);
+            auto original = relative.generic_string();
+
             // If already was added to dependencies skip it.
-            for (auto &&dep : data.local_dependencies) {
-                if(dep.original == file_path) {
-                    continue;
-                }
+            if(data.local_dependencies.find_original(original) != no_file) {
+                continue;
             }
 
-            data.local_dependencies.push_back({.original = file_path});
+            data.local_dependencies.add(original, relative.string(), ConversionType::copy);
         }
     }
 }
 
 
-// TODO: This is ugly as f...
-void chm::scan_html_for_remote_dependencies(const ProjectConfig &config, ProjectData &data, std::string& html) {
+// Only http(s) images with a file name are downloaded.
+static bool is_downloadable_image(const chm::url::Parts &parts) {
+    if (parts.scheme != "http" && parts.scheme != "https") {
+        return false;
+    }
+    if (parts.host.find('.') == std::string_view::npos) {
+        return false;
+    }
+
+    std::string_view path = chm::url::local_path(parts);
+    size_t dot = path.find('.');
+    return dot != std::string_view::npos && dot != 0 && dot + 1 < path.size();
+}
+
+
+// Downloaded files are stored in _remote/<host>/<path>, so files with same path from different hosts don't collide.
+// Urls that differ only in query get hash of the query added to the file name. Empty if url has no usable file name.
+static std::filesystem::path remote_dependency_path(const chm::ProjectConfig &config, const chm::url::Parts &parts) {
+    std::filesystem::path path = config.temp / "_remote" / std::string(parts.host);
+
+    // Dot segments could point outside of temp path.
+    std::string_view remaining = chm::url::local_path(parts);
+    bool has_name = false;
+    while (!remaining.empty()) {
+        std::string_view segment = remaining.substr(0, remaining.find('/'));
+        remaining.remove_prefix(std::min(remaining.size(), segment.size() + 1));
+        if (!segment.empty() && segment != "." && segment != "..") {
+            path /= std::string(segment);
+            has_name = true;
+        }
+    }
+    if (!has_name) {
+        return {};
+    }
+
+    if (!parts.query.empty()) {
+        char hash[18];
+        std::snprintf(hash, sizeof(hash), "-%08x", (std::uint32_t)fnv1a_64(parts.query));
+        auto extension = path.extension();
+        path.replace_extension();
+        path += hash;
+        path += extension;
+    }
+
+    return path;
+}
+
+
+void chm::scan_html_for_remote_dependencies(const ProjectConfig &config, ProjectData &data, FileId page, std::string& html) {
     std::regex img_tag_test("<img +src=\"(.*?)\"");
-    std::regex web_link_test("(http|https)://.*\\..*?/(.+\\..+)");
 
-    std::smatch match;
-    std::size_t i = 0;
-    std::string temp = html;
+    std::match_results<std::string_view::const_iterator> match;
+    for (size_t i = 0; i < html.length(); i += match.position() + match.length()) {
+        std::string_view html_sv(html);
+        html_sv = html_sv.substr(i);
+
+        if(!std::regex_search(html_sv.begin(), html_sv.end(), match, img_tag_test)) {
+            break;
+        }
 
-    while (std::regex_search(temp, match, img_tag_test)) {
-        std::string url = match[1];
+        std::string url(match[1].first, match[1].second);
 
-        std::smatch link_match;
-        if(std::regex_match(url, link_match, web_link_test)) {
-            bool already_added = false;
+        url::Parts parts = url::split(url);
+        if (!is_downloadable_image(parts)) {
+            continue;
+        }
+        std::filesystem::path target_path = remote_dependency_path(config, parts);
+        if (target_path.empty()) {
+            continue;
+        }
+
+        std::filesystem::path target;
+        {
+            // Pages are scanned by multiple threads at once.
+            static std::mutex remote_dependencies_mutex;
+            std::lock_guard lock(remote_dependencies_mutex);
+
+            RemoteDependency *found = nullptr;
             for (auto &&dep : data.remote_dependencies) {
                 if(dep.link == url) {
-                    already_added = true;
+                    found = &dep;
                     break;
                 }
             }
-            if(!already_added) {
-                data.remote_dependencies.push_back({.link = url, .target = config.temp / link_match[2].str()});
-                // std::cout << "Found dependency: \"" << url << "\"" << std::endl;
+            if(!found) {
+                found = &data.remote_dependencies.emplace_back(RemoteDependency{.link = url, .target = std::move(target_path)});
             }
+            if (found->referenced_by.empty() || found->referenced_by.back() != page) {
+                found->referenced_by.push_back(page);
+            }
+            target = found->target;
+        }
 
-            std::string temp = "<img src=";
-            temp += std::filesystem::relative(data.remote_dependencies.back().target, config.temp).string();
-            html.replace(i + match.position(), match.length(), temp);
+        std::string new_tag = "<img src=\"";
+        new_tag += std::filesystem::relative(target, config.temp).generic_string();
+        new_tag += '"';
+
+        html.replace(i + match.position(), match.length(), new_tag);
+
+        i += new_tag.length() - match.length();
+    }
+}
 
-            i -= match.length();
-            i += temp.length();
-        }
 
-        i += match.position() + match.length();
-        temp = html.substr(i);
+void chm::scan_html_for_keywords(FileId file, const std::string &html, KeywordIndex::Shard &keywords) {
+    std::regex heading_tag_test("<h[1-6] id=\"(.*?)\">(.*?)<\\/h[1-6]>"); // 1 group - id, 2 group - heading contents.
+
+    auto begin = std::sregex_iterator(html.begin(), html.end(), heading_tag_test);
+    auto end = std::sregex_iterator();
+
+    for (std::sregex_iterator i = begin; i != end; ++i) {
+        KeywordIndex::add(keywords, remove_html_tags((*i)[2].str()), file, (*i)[1].str());
     }
 }
\ No newline at end of file
@@ -0,0 +1,387 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include <RUtils/ForEach.hpp>
+
+#ifdef GHWIKI2CHM_ZLIB
+#include <zlib.h>
+#endif
+
+#include "project.hpp"
+#include "helpers.hpp"
+#include "staging.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "text_kernels.hpp"
+
+
+
+static std::uint32_t read_u32_be(std::string_view data, size_t pos) {
+    return (std::uint32_t)(std::uint8_t)data[pos] << 24 | (std::uint32_t)(std::uint8_t)data[pos + 1] << 16
+         | (std::uint32_t)(std::uint8_t)data[pos + 2] << 8 | (std::uint32_t)(std::uint8_t)data[pos + 3];
+}
+
+static void append_u32_be(std::string &out, std::uint32_t value) {
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+
+
+#ifdef GHWIKI2CHM_ZLIB
+// Inflates whole zlib stream, returns false if data is corrupted or bigger than max_size.
+static bool inflate_all(std::string_view in, std::string &out, size_t max_size) {
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK) {
+        return false;
+    }
+
+    stream.next_in = (Bytef*)in.data();
+    stream.avail_in = in.size();
+
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        if (out.size() >= max_size) {
+            break;
+        }
+        size_t used = out.size();
+        out.resize(std::min(max_size, std::max<size_t>(used * 2, 64 * 1024)));
+
+        stream.next_out = (Bytef*)out.data() + used;
+        stream.avail_out = out.size() - used;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        out.resize(out.size() - stream.avail_out);
+    }
+
+    inflateEnd(&stream);
+    return ret == Z_STREAM_END;
+}
+
+// Deflates with maximum effort, best of default and filtered strategies is returned.
+static std::string deflate_best(std::string_view in) {
+    std::string best;
+
+    for (int strategy : {Z_DEFAULT_STRATEGY, Z_FILTERED}) {
+        z_stream stream = {};
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15, 9, strategy) != Z_OK) {
+            continue;
+        }
+
+        std::string out(deflateBound(&stream, in.size()), '\0');
+        stream.next_in = (Bytef*)in.data();
+        stream.avail_in = in.size();
+        stream.next_out = (Bytef*)out.data();
+        stream.avail_out = out.size();
+
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+            out.resize(stream.total_out);
+            if (best.empty() || out.size() < best.size()) {
+                best = std::move(out);
+            }
+        }
+        deflateEnd(&stream);
+    }
+
+    return best;
+}
+#endif
+
+
+// Chunks that change how the image looks, everything else like text, time, exif and physical size is dropped.
+static bool is_png_chunk_kept(std::string_view type) {
+    constexpr std::string_view kept[] = {"IHDR", "PLTE", "tRNS", "IDAT", "IEND", "sRGB", "gAMA", "cHRM", "iCCP", "sBIT"};
+    for (auto chunk : kept) {
+        if (type == chunk) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns optimized png or empty string if it isn't a png that can be optimized.
+static std::string optimize_png(std::string_view in) {
+    constexpr std::string_view signature = "\x89PNG\r\n\x1a\n";
+    if (!in.starts_with(signature)) {
+        return {};
+    }
+
+    struct Chunk {
+        std::string_view type, data;
+    };
+    std::vector<Chunk> chunks;
+    std::string idat;
+
+    for (size_t pos = signature.size(); pos + 12 <= in.size();) {
+        std::uint32_t size = read_u32_be(in, pos);
+        if (size > in.size() - pos - 12) {
+            return {};
+        }
+        Chunk chunk = {in.substr(pos + 4, 4), in.substr(pos + 8, size)};
+        pos += size + 12;
+
+        // Animated png, frames reference each other by sequence numbers, leave it alone.
+        if (chunk.type == "acTL") {
+            return {};
+        }
+
+        if (chunk.type == "IDAT") {
+            if (!chunk.data.empty()) {
+                chunks.push_back(chunk);
+            }
+            idat += chunk.data;
+        } else if (is_png_chunk_kept(chunk.type)) {
+            chunks.push_back(chunk);
+        }
+
+        if (chunk.type == "IEND") {
+            break;
+        }
+    }
+
+    if (chunks.empty() || chunks.front().type != "IHDR" || chunks.back().type != "IEND" || idat.empty()) {
+        return {};
+    }
+
+    #ifdef GHWIKI2CHM_ZLIB
+    std::string image_data = std::move(idat);
+    // Scanlines and their filters stay the same, only compression of them changes, so the image is exactly the same.
+    std::string scanlines;
+    if (!inflate_all(image_data, scanlines, 512 * 1024 * 1024)) {
+        return {};
+    }
+    if (std::string deflated = deflate_best(scanlines); !deflated.empty() && deflated.size() < image_data.size()) {
+        image_data = std::move(deflated);
+    }
+    #endif
+
+    std::string out(signature);
+    out.reserve(in.size());
+
+    bool idat_written = false;
+    for (auto &chunk : chunks) {
+        std::string_view data = chunk.data;
+        #ifdef GHWIKI2CHM_ZLIB
+        // Recompressed image data goes into one chunk in place of all of them.
+        if (chunk.type == "IDAT") {
+            if (idat_written) {
+                continue;
+            }
+            idat_written = true;
+            data = image_data;
+        }
+        #else
+        (void)idat_written;
+        #endif
+
+        append_u32_be(out, data.size());
+        size_t crc_begin = out.size();
+        out += chunk.type;
+        out += data;
+
+        #ifdef GHWIKI2CHM_ZLIB
+        append_u32_be(out, crc32(0, (const Bytef*)out.data() + crc_begin, out.size() - crc_begin));
+        #else
+        // Without zlib only whole chunks are dropped and image data chunks stay as they are, crc of kept chunks can be copied.
+        append_u32_be(out, read_u32_be(in, chunk.data.data() + chunk.data.size() - in.data()));
+        (void)crc_begin;
+        #endif
+    }
+
+    return out;
+}
+
+
+// Removes exif and xmp (APP1) and comment segments. Everything from start of scan is copied as is.
+// Exif orientation is lost, but the help viewer ignores it anyway.
+static std::string optimize_jpeg(std::string_view in) {
+    if (!in.starts_with("\xff\xd8")) {
+        return {};
+    }
+
+    std::string out(in.substr(0, 2));
+    out.reserve(in.size());
+
+    size_t pos = 2;
+    while (pos + 4 <= in.size()) {
+        if ((std::uint8_t)in[pos] != 0xff) {
+            return {};
+        }
+
+        std::uint8_t marker = in[pos + 1];
+        if (marker == 0xff) {
+            // Fill byte
+            pos++;
+            continue;
+        }
+
+        // Start of scan or end of image, rest is entropy coded data.
+        if (marker == 0xda || marker == 0xd9) {
+            out += in.substr(pos);
+            return out;
+        }
+
+        // Markers without length
+        if ((marker >= 0xd0 && marker <= 0xd7) || marker == 0x01) {
+            out += in.substr(pos, 2);
+            pos += 2;
+            continue;
+        }
+
+        size_t size = (std::uint8_t)in[pos + 2] << 8 | (std::uint8_t)in[pos + 3];
+        if (size < 2 || pos + 2 + size > in.size()) {
+            return {};
+        }
+
+        if (marker != 0xe1 && marker != 0xfe) {
+            out += in.substr(pos, 2 + size);
+        }
+        pos += 2 + size;
+    }
+
+    return {};
+}
+
+
+
+static std::string read_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+// Targets can be hardlinks to original files, they are never written in place.
+// Threads can replace the same cached image at once, so every write gets its own temporary file.
+static bool write_file_replacing(const std::filesystem::path &path, std::string_view data) {
+    static std::atomic<std::uint32_t> temp_counter = 0;
+    auto temp_path = path;
+    temp_path += ".tmp" + std::to_string(temp_counter.fetch_add(1, std::memory_order_relaxed));
+
+    std::error_code ec;
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        file.write(data.data(), data.size());
+        if (!file) {
+            file.close();
+            std::filesystem::remove(temp_path, ec);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        std::error_code remove_ec;
+        std::filesystem::remove(temp_path, remove_ec);
+        return false;
+    }
+    return true;
+}
+
+static bool is_optimizable_image(const std::filesystem::path &path) {
+    std::string ext = path.extension().string();
+    for (auto &c : ext) {
+        c = chm::text::to_lower(c);
+    }
+    return ext == ".png" || ext == ".jpg" || ext == ".jpeg";
+}
+
+
+void chm::optimize_images(const ProjectConfig &config, ProjectData &data) {
+    metrics::StageTimer timer(metrics::Stage::optimize);
+
+    std::vector<std::filesystem::path> images;
+
+    for (FileId file : data.files.ids()) {
+        if (data.files.converter(file) == ConversionType::copy && is_optimizable_image(data.files.link(file))) {
+            images.push_back(data.files.target_path(config.temp, file));
+        }
+    }
+    for (FileId dep : data.local_dependencies.ids()) {
+        if (is_optimizable_image(data.local_dependencies.link(dep))) {
+            images.push_back(data.local_dependencies.target_path(config.temp, dep));
+        }
+    }
+    for (auto &dep : data.remote_dependencies) {
+        if (dep.state == DownloadState::Finished && is_optimizable_image(dep.target)) {
+            images.push_back(dep.target);
+        }
+    }
+
+    if (images.empty()) {
+        return;
+    }
+
+    #ifndef GHWIKI2CHM_ZLIB
+    log::warning("images_not_recompressed", "Built without zlib, png images are not recompressed.");
+    #endif
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Optimized images are stored by hash of their contents, optimized version is also stored under its own hash.
+    // So both original and already optimized images are found in the cache next time.
+    auto cache_dir = config.temp / ".image_cache";
+    std::filesystem::create_directories(cache_dir);
+
+    constexpr std::uint64_t cache_version = fnv1a_64("image-optimizer-1");
+    auto cache_path = [&](std::string_view contents) {
+        char name[17];
+        std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a_64(contents, cache_version));
+        return cache_dir / name;
+    };
+
+    std::atomic<std::uintmax_t> bytes_before = 0, bytes_after = 0;
+    std::atomic<size_t> optimized_count = 0, cached_count = 0;
+
+    log::progress_begin("optimize", images.size());
+    RUtils::for_each_threaded(images.begin(), images.end(), [&](const std::filesystem::path &image) {
+        log::ProgressItem progress;
+        std::string contents = read_file(image);
+        if (contents.empty()) {
+            return;
+        }
+        bytes_before += contents.size();
+
+        auto cached = cache_path(contents);
+        std::error_code ec;
+        if (auto cached_size = std::filesystem::file_size(cached, ec); !ec) {
+            if (cached_size < contents.size()) {
+                stage_file(cached, image);
+            }
+            bytes_after += std::min<std::uintmax_t>(cached_size, contents.size());
+            cached_count++;
+            return;
+        }
+
+        std::string optimized = optimize_png(contents);
+        if (optimized.empty()) {
+            optimized = optimize_jpeg(contents);
+        }
+
+        if (optimized.empty() || optimized.size() >= contents.size()) {
+            write_file_replacing(cached, contents);
+            bytes_after += contents.size();
+            return;
+        }
+
+        if (!write_file_replacing(cached, optimized) || stage_file(cached, image) == StageMethod::failed) {
+            log::error("image_write_failed", "Failed to write optimized image: %s", image.string().c_str());
+            bytes_after += contents.size();
+            return;
+        }
+        stage_file(cached, cache_path(optimized));
+
+        bytes_after += optimized.size();
+        optimized_count++;
+    }, config.max_jobs);
+
+    metrics::add_stage_bytes(metrics::Stage::optimize, bytes_before, bytes_after);
+    metrics::add_cache_lookups(metrics::Cache::image, cached_count, images.size() - cached_count);
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time);
+    log::info("images_optimized", "Optimized %zu of %zu images in %.1f ms (%zu from cache): %.1f KiB -> %.1f KiB, saved %.1f KiB.",
+        optimized_count.load(), images.size(), elapsed.count(), cached_count.load(),
+        bytes_before / 1024.0, bytes_after / 1024.0, (bytes_before - bytes_after) / 1024.0);
+}
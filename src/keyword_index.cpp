@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <queue>
+
+#include <RUtils/ForEach.hpp>
+
+#include "keyword_index.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "project.hpp"
+
+
+
+chm::KeywordIndex::Shard& chm::KeywordIndex::thread_shard() {
+    std::lock_guard lock(shards_mutex);
+
+    auto id = std::this_thread::get_id();
+    for (auto &shard : shards) {
+        if (shard.first == id) {
+            return shard.second;
+        }
+    }
+
+    return shards.emplace_back(id, Shard{}).second;
+}
+
+
+void chm::KeywordIndex::add(Shard &shard, std::string_view keyword, FileId file, std::string_view fragment) {
+    keyword = trim_whitespace(keyword);
+    if (keyword.find_first_not_of(" \t\n\v\f\r") == std::string_view::npos || file == no_file) {
+        return;
+    }
+
+    KeywordEntry entry = {
+        .keyword = std::string(keyword),
+        .sort_key = std::string(keyword),
+        .fragment = std::string(fragment),
+        .file_link = file,
+    };
+
+    for (auto &c : entry.sort_key) {
+        c = std::tolower((unsigned char)c);
+    }
+
+    shard.push_back(std::move(entry));
+}
+
+
+static bool keyword_entry_less(const chm::KeywordEntry &a, const chm::KeywordEntry &b) {
+    if (int cmp = a.sort_key.compare(b.sort_key); cmp != 0) {
+        return cmp < 0;
+    }
+    // Files are sorted when they are found, ids are in the same order as paths.
+    if (a.file_link != b.file_link) {
+        return a.file_link < b.file_link;
+    }
+    if (int cmp = a.fragment.compare(b.fragment); cmp != 0) {
+        return cmp < 0;
+    }
+    return a.keyword < b.keyword;
+}
+
+
+// Run files are entries one after another: sizes of keyword, sort key and fragment, file id, then the strings.
+static void write_entry(std::ostream &out, const chm::KeywordEntry &entry) {
+    std::uint32_t header[4] = {(std::uint32_t)entry.keyword.size(), (std::uint32_t)entry.sort_key.size(), (std::uint32_t)entry.fragment.size(), entry.file_link};
+    out.write((const char*)header, sizeof(header));
+    out.write(entry.keyword.data(), entry.keyword.size());
+    out.write(entry.sort_key.data(), entry.sort_key.size());
+    out.write(entry.fragment.data(), entry.fragment.size());
+}
+
+static bool read_entry(std::istream &in, chm::KeywordEntry &entry) {
+    std::uint32_t header[4];
+    if (!in.read((char*)header, sizeof(header))) {
+        return false;
+    }
+
+    entry.keyword.resize(header[0]);
+    entry.sort_key.resize(header[1]);
+    entry.fragment.resize(header[2]);
+    entry.file_link = header[3];
+
+    in.read(entry.keyword.data(), entry.keyword.size());
+    in.read(entry.sort_key.data(), entry.sort_key.size());
+    in.read(entry.fragment.data(), entry.fragment.size());
+    return (bool)in;
+}
+
+
+void chm::KeywordIndex::spill_to(std::filesystem::path dir, size_t max_shard_entries) {
+    // Runs from an interrupted build would be merged too.
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    std::filesystem::create_directories(dir);
+
+    spill_dir = std::move(dir);
+    this->max_shard_entries = std::max<size_t>(max_shard_entries, 1);
+}
+
+
+void chm::KeywordIndex::spill(Shard &shard) {
+    if (!spilling() || shard.size() < max_shard_entries) {
+        return;
+    }
+    write_run(shard);
+}
+
+
+void chm::KeywordIndex::write_run(Shard &shard) {
+    std::sort(shard.begin(), shard.end(), keyword_entry_less);
+
+    std::filesystem::path path;
+    {
+        std::lock_guard lock(shards_mutex);
+        path = spill_dir / ("run" + std::to_string(runs.size()));
+        runs.push_back(path);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    for (auto &entry : shard) {
+        write_entry(file, entry);
+    }
+    if (!file) {
+        log::error("keywords_write_failed", "Failed to write keywords to: %s", path.string().c_str());
+    }
+
+    // Give memory back, clear() would keep it.
+    shard = Shard{};
+}
+
+
+std::filesystem::path chm::KeywordIndex::merge_to_file(std::uint32_t max_jobs) {
+    std::vector<Shard*> remaining;
+    for (auto &shard : shards) {
+        if (!shard.second.empty()) {
+            remaining.push_back(&shard.second);
+        }
+    }
+    RUtils::for_each_threaded(remaining.begin(), remaining.end(), [&](Shard *shard) {
+        write_run(*shard);
+    }, max_jobs);
+    shards.clear();
+
+    // K-way merge, only the first entry of every run is in memory.
+    std::vector<std::ifstream> files;
+    std::vector<KeywordEntry> heads(runs.size());
+    auto greater = [&](size_t a, size_t b) { return keyword_entry_less(heads[b], heads[a]); };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        files.emplace_back(runs[i], std::ios::binary);
+        if (read_entry(files[i], heads[i])) {
+            queue.push(i);
+        }
+    }
+
+    auto merged_path = spill_dir / "keywords";
+    std::ofstream merged(merged_path, std::ios::binary);
+
+    while (!queue.empty()) {
+        size_t i = queue.top();
+        queue.pop();
+        write_entry(merged, heads[i]);
+        if (read_entry(files[i], heads[i])) {
+            queue.push(i);
+        }
+    }
+
+    files.clear();
+    for (auto &run : runs) {
+        std::error_code ec;
+        std::filesystem::remove(run, ec);
+    }
+    runs.clear();
+
+    return merged_path;
+}
+
+
+std::vector<chm::KeywordEntry> chm::KeywordIndex::read_file(const std::filesystem::path &entries_file) {
+    std::ifstream file(entries_file, std::ios::binary);
+    std::vector<KeywordEntry> entries;
+    KeywordEntry entry;
+    while (read_entry(file, entry)) {
+        entries.push_back(std::move(entry));
+    }
+    return entries;
+}
+
+
+std::vector<chm::KeywordEntry> chm::KeywordIndex::merge(std::uint32_t max_jobs) {
+    std::vector<Shard> runs;
+    for (auto &shard : shards) {
+        if (!shard.second.empty()) {
+            runs.push_back(std::move(shard.second));
+        }
+    }
+    shards.clear();
+
+    if (runs.empty()) {
+        return {};
+    }
+
+    RUtils::for_each_threaded(runs.begin(), runs.end(), [](Shard &run) {
+        std::sort(run.begin(), run.end(), keyword_entry_less);
+    }, max_jobs);
+
+    // Merge sorted runs pairwise, every round halves the number of runs and all pairs in a round are merged concurrently.
+    while (runs.size() > 1) {
+        std::vector<std::pair<Shard*, Shard*>> pairs;
+        for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+            pairs.push_back({&runs[i], &runs[i + 1]});
+        }
+
+        RUtils::for_each_threaded(pairs.begin(), pairs.end(), [](std::pair<Shard*, Shard*> &pair) {
+            Shard merged;
+            merged.reserve(pair.first->size() + pair.second->size());
+            std::merge(
+                std::make_move_iterator(pair.first->begin()), std::make_move_iterator(pair.first->end()),
+                std::make_move_iterator(pair.second->begin()), std::make_move_iterator(pair.second->end()),
+                std::back_inserter(merged), keyword_entry_less
+            );
+            *pair.first = std::move(merged);
+            pair.second->clear();
+        }, max_jobs);
+
+        std::vector<Shard> next;
+        for (size_t i = 0; i < runs.size(); i += 2) {
+            next.push_back(std::move(runs[i]));
+        }
+        runs = std::move(next);
+    }
+
+    return std::move(runs.front());
+}
+
+
+// next() returns sorted entries one at a time and nullptr at the end, previously returned entry must stay valid.
+template<typename Next>
+static void write_hhk_entries(std::ostream &out, Next &&next, const chm::ProjectFiles &files) {
+    // Every page is referenced by many keywords, create its title only once.
+    std::vector<std::string> titles(files.size());
+
+    auto page_title = [&](chm::FileId file) -> const std::string& {
+        if (titles[file].empty()) {
+            titles[file] = page_name_from_file(files.link(file));
+        }
+        return titles[file];
+    };
+
+    std::string buffer = "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
+    "<HTML>\n"
+    "<HEAD>\n"
+        "<meta name=\"GENERATOR\" content=\"ghwiki2chm test\">\n"
+        "<!-- Sitemap 1.0 -->\n"
+    "</HEAD>\n"
+    "<BODY>\n"
+    "<UL>\n";
+
+    // Output is built in a small buffer that is flushed to the stream, so it grows linearly with the number of keywords.
+    constexpr size_t flush_threshold = 64 * 1024;
+
+    const chm::KeywordEntry *previous = nullptr;
+
+    while (const chm::KeywordEntry *entry = next()) {
+        if (!previous || entry->sort_key != previous->sort_key) {
+            if (previous) {
+                buffer += "</OBJECT>\n";
+
+                if (buffer.size() > flush_threshold) {
+                    out.write(buffer.data(), buffer.size());
+                    buffer.clear();
+                }
+            }
+
+            buffer += "<LI> <OBJECT type=\"text/sitemap\">\n<param name=\"Name\" value=\"";
+            append_attribute_escaped(buffer, entry->keyword);
+            buffer += "\">\n";
+        }
+        // Same page and fragment was already listed under this keyword, entries are sorted so duplicates are next to each other.
+        else if (previous->file_link == entry->file_link && previous->fragment == entry->fragment) {
+            previous = entry;
+            continue;
+        }
+
+        buffer += "<param name=\"Name\" value=\"";
+        append_attribute_escaped(buffer, page_title(entry->file_link));
+        buffer += "\">\n<param name=\"Local\" value=\"";
+        append_attribute_escaped(buffer, files.link(entry->file_link));
+        if (!entry->fragment.empty()) {
+            buffer += '#';
+            append_attribute_escaped(buffer, entry->fragment);
+        }
+        buffer += "\">\n";
+
+        previous = entry;
+    }
+
+    if (previous) {
+        buffer += "</OBJECT>\n";
+    }
+
+    buffer += "</UL>\n"
+    "</BODY>\n"
+    "</HTML>\n";
+
+    out.write(buffer.data(), buffer.size());
+}
+
+
+void chm::KeywordIndex::write_hhk(std::ostream &out, const std::vector<KeywordEntry> &entries, const ProjectFiles &files) {
+    size_t i = 0;
+    write_hhk_entries(out, [&]() {
+        return i < entries.size() ? &entries[i++] : nullptr;
+    }, files);
+}
+
+
+void chm::KeywordIndex::write_hhk(std::ostream &out, const std::filesystem::path &entries_file, const ProjectFiles &files) {
+    std::ifstream file(entries_file, std::ios::binary);
+
+    // Two entries are read in turns, so the previous one is still valid.
+    KeywordEntry entries[2];
+    size_t current = 0;
+    write_hhk_entries(out, [&]() -> const KeywordEntry* {
+        current ^= 1;
+        return read_entry(file, entries[current]) ? &entries[current] : nullptr;
+    }, files);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "project_file.hpp"
+
+
+namespace chm {
+    struct KeywordEntry {
+        std::string keyword;                                // Text displayed in the index
+        std::string sort_key;                               // Lower case keyword, index is sorted and grouped by it
+        std::string fragment;                               // HTML page fragment tag id, may be empty
+        FileId file_link = no_file;
+    };
+
+    // Keywords are collected into per thread shards while pages are converted, so workers never wait for each other.
+    // At the end all shards are sorted and merged in parallel into one list that is used to write .hhk file.
+    // When memory is limited, big shards are sorted and spilled to run files instead, and runs are merged into one file.
+    class KeywordIndex {
+    public:
+        using Shard = std::vector<KeywordEntry>;
+
+        KeywordIndex() = default;
+        KeywordIndex(const KeywordIndex &other) : shards(other.shards), spill_dir(other.spill_dir), max_shard_entries(other.max_shard_entries), runs(other.runs) {}
+        KeywordIndex& operator=(const KeywordIndex &other) {
+            shards = other.shards;
+            spill_dir = other.spill_dir;
+            max_shard_entries = other.max_shard_entries;
+            runs = other.runs;
+            return *this;
+        }
+
+        // Returns shard owned by the calling thread.
+        Shard& thread_shard();
+
+        static void add(Shard &shard, std::string_view keyword, FileId file, std::string_view fragment = {});
+
+        // Shards with more than max_shard_entries entries are spilled to run files in dir by spill().
+        void spill_to(std::filesystem::path dir, size_t max_shard_entries);
+        bool spilling() const { return !spill_dir.empty(); }
+        // Stops spilling, call after merge_to_file() when the index is changed in memory from then on.
+        void keep_in_memory() { spill_dir.clear(); }
+        // Call with the calling thread's shard after adding to it, writes it to a sorted run file if it's too big.
+        void spill(Shard &shard);
+
+        // Sort and merge all shards, shards are empty afterwards.
+        std::vector<KeywordEntry> merge(std::uint32_t max_jobs);
+        // Same when spilling, remaining shards and all runs are merged into one file that is returned.
+        std::filesystem::path merge_to_file(std::uint32_t max_jobs);
+        // Reads all entries of a file returned by merge_to_file(), they are still sorted.
+        static std::vector<KeywordEntry> read_file(const std::filesystem::path &entries_file);
+
+        // Writes sorted entries as .hhk, entries with the same keyword are grouped into one index item.
+        static void write_hhk(std::ostream &out, const std::vector<KeywordEntry> &entries, const ProjectFiles &files);
+        // Same, entries are read one at a time from a file returned by merge_to_file().
+        static void write_hhk(std::ostream &out, const std::filesystem::path &entries_file, const ProjectFiles &files);
+
+    private:
+        void write_run(Shard &shard);
+
+        std::mutex shards_mutex;
+        std::deque<std::pair<std::thread::id, Shard>> shards;
+
+        std::filesystem::path spill_dir;                    // Empty = everything is kept in memory
+        size_t max_shard_entries = 0;
+        std::vector<std::filesystem::path> runs;            // Sorted run files, guarded by shards_mutex
+    };
+}
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "project.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "request_runner.hpp"
+
+
+
+using Clock = std::chrono::steady_clock;
+
+// Seconds for one request, a link that doesn't answer in this time is as good as broken.
+constexpr long link_check_timeout = 30;
+
+struct LinkResult {
+    std::int64_t checked_at = 0;    // Unix time
+    long status = 0;                // HTTP status, 0 if there was no response
+    std::string error;              // Empty if the link works
+    bool definitive = false;        // Server answered with something other than "try again later", result can be cached
+};
+
+// Status is known once the body starts, so the body is aborted right away.
+static size_t discard_body(char*, size_t, size_t, void*) {
+    return 0;
+}
+
+
+// Cache remembers links that got a definitive answer, with time they were checked and their status.
+static std::unordered_map<std::string, LinkResult> read_link_cache(const std::filesystem::path &path, std::int64_t now, std::uint32_t ttl) {
+    std::unordered_map<std::string, LinkResult> cache;
+    std::ifstream file(path);
+
+    LinkResult result;
+    std::string url;
+    while (file >> result.checked_at >> result.status && file.get() == ' ' && std::getline(file, url)) {
+        if (now - result.checked_at >= (std::int64_t)ttl) {
+            continue;
+        }
+        result.error = result.status >= 400 ? "HTTP " + std::to_string(result.status) : std::string();
+        result.definitive = true;
+        cache[url] = result;
+    }
+
+    return cache;
+}
+
+
+size_t chm::check_external_links(const ProjectConfig &config, const ProjectData &data) {
+    auto start_time = Clock::now();
+    std::int64_t now_unix = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    auto cache_path = config.temp / ".link_cache";
+    auto cache = read_link_cache(cache_path, now_unix, config.link_cache_ttl);
+
+    // External links are unique already, every link is checked once however many pages link to it.
+    std::unordered_map<std::string, LinkResult> results;
+    std::vector<const std::string*> links;
+    size_t cached_count = 0;
+
+    for (auto &[link, pages] : data.external_links) {
+        auto it = results.emplace(link, LinkResult{}).first;
+        if (auto cached = cache.find(link); cached != cache.end()) {
+            it->second = cached->second;
+            cached_count++;
+            continue;
+        }
+        links.push_back(&it->first);
+    }
+    metrics::add_cache_lookups(metrics::Cache::link, cached_count, links.size());
+
+    size_t checked_count = links.size();
+    if (!links.empty()) {
+        log::info("links_queued", "Checking %zu external links, %zu are cached...", links.size(), cached_count);
+        log::progress_begin("check links", links.size());
+    }
+
+
+    // Same engine, limits and retries as downloads, link checks are small but many of them go to the same hosts.
+    RequestRunner runner({
+        .max_requests = config.max_downloads,
+        .retries = config.dep_download_retries,
+    });
+    for (size_t i = 0; i < links.size(); i++) {
+        runner.add(i, *links[i]);
+    }
+
+    // Server didn't accept HEAD, first byte is requested with GET instead.
+    std::vector<bool> ranged_get(runner.slot_count());
+
+    auto finish = [&](size_t request, long status, std::string error, bool definitive) {
+        results[*links[request]] = {now_unix, status, std::move(error), definitive};
+        log::progress_advance();
+    };
+
+    runner.run({
+        .configure = [&](CURL *handle, size_t) {
+            curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+            curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, !config.dep_download_ignore_ssl);
+            curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, !config.dep_download_ignore_ssl);
+            curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, discard_body);
+            curl_easy_setopt(handle, CURLOPT_VERBOSE, config.dep_download_curl_verbose);
+            curl_easy_setopt(handle, CURLOPT_USERAGENT, "ghwiki2chm link checker");
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT, link_check_timeout);
+            curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, std::min(link_check_timeout, 15L));
+        },
+
+        .start = [&](const RequestAttempt &attempt) {
+            // HEAD has no body, servers that don't support it get a GET of the first byte.
+            ranged_get[attempt.slot] = false;
+            curl_easy_setopt(attempt.handle, CURLOPT_URL, links[attempt.request]->c_str());
+            curl_easy_setopt(attempt.handle, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt(attempt.handle, CURLOPT_RANGE, nullptr);
+        },
+
+        .finished = [&](const RequestAttempt &attempt, const RequestResult &result) {
+            // Status is known once headers arrive, errors after that are about the body, which ranged GET aborts on purpose anyway.
+            bool answered = result.status != 0;
+            if (answered && result.status < 400) {
+                finish(attempt.request, result.status, {}, true);
+                return RequestAction::done;
+            }
+
+            if (!ranged_get[attempt.slot] && answered && !result.throttled) {
+                // Many servers answer HEAD with 403, 404 or 405 while GET works.
+                ranged_get[attempt.slot] = true;
+                curl_easy_setopt(attempt.handle, CURLOPT_HTTPGET, 1L);
+                curl_easy_setopt(attempt.handle, CURLOPT_RANGE, "0-0");
+                return RequestAction::restart;
+            }
+
+            std::string error = answered ? "HTTP " + std::to_string(result.status) : curl_easy_strerror(result.result);
+            bool transient = !answered || result.throttled || result.status >= 500;
+            if (transient && result.can_retry) {
+                return RequestAction::retry;
+            }
+            // Errors without an answer or with a server error may go away, they are checked again next build.
+            finish(attempt.request, answered ? result.status : 0, std::move(error), !transient);
+            return RequestAction::failed;
+        },
+
+        .expired = [](size_t) {},
+    });
+    size_t retry_count = runner.retry_count();
+
+
+    std::ofstream cache_file(cache_path);
+    for (auto &[link, result] : results) {
+        if (result.definitive) {
+            cache_file << result.checked_at << " " << result.status << " " << link << "\n";
+        }
+    }
+
+
+    // Report is ordered by link, pages of every link by their path.
+    size_t broken_count = 0;
+    std::string json = "{\n\"broken\": [\n";
+    for (auto &[link, pages] : data.external_links) {
+        auto &result = results[link];
+        if (result.error.empty()) {
+            continue;
+        }
+
+        std::vector<std::string_view> page_paths;
+        for (FileId page : pages) {
+            page_paths.push_back(data.files.original(page));
+        }
+        std::sort(page_paths.begin(), page_paths.end());
+        page_paths.erase(std::unique(page_paths.begin(), page_paths.end()), page_paths.end());
+
+        json += broken_count ? ",\n  {\"url\": " : "  {\"url\": ";
+        append_json_string(json, link);
+        json += ", \"status\": " + std::to_string(result.status);
+        json += ", \"error\": ";
+        append_json_string(json, result.error);
+        json += ", \"pages\": [";
+        for (size_t i = 0; i < page_paths.size(); i++) {
+            json += i ? ", " : "";
+            append_json_string(json, page_paths[i]);
+        }
+        json += "]}";
+        broken_count++;
+
+        log::warning("broken_link", "Broken link %s (%s) on %zu pages, first: %.*s", link.c_str(), result.error.c_str(), page_paths.size(),
+            (int)page_paths.front().size(), page_paths.front().data());
+    }
+    json += broken_count ? "\n],\n" : "],\n";
+    json += "\"links\": " + std::to_string(results.size());
+    json += ",\n\"checked\": " + std::to_string(checked_count);
+    json += ",\n\"cached\": " + std::to_string(cached_count);
+    json += "\n}\n";
+
+    std::ofstream report_file(config.link_report, std::ios::binary);
+    report_file << json;
+    report_file.close();
+    if (!report_file) {
+        log::error("link_report_failed", "Failed to write link report: %s", config.link_report.string().c_str());
+    }
+
+    auto elapsed = std::chrono::duration<double, std::milli>(Clock::now() - start_time);
+    log::info("links_checked", "Checked %zu external links in %.1f ms (%zu from cache, %zu retries), %zu are broken.",
+        results.size(), elapsed.count(), cached_count, retry_count, broken_count);
+
+    return broken_count;
+}
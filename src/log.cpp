@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "log.hpp"
+#include "helpers.hpp"
+
+using namespace chm::log;
+
+
+
+constexpr size_t ring_capacity = 1024;
+constexpr auto drain_interval = std::chrono::milliseconds(50);
+
+constexpr const char* level_names[] = {"detail", "info", "warning", "error"};
+
+
+struct Record {
+    std::chrono::system_clock::time_point time;
+    Level level = Level::detail;
+    const char *event = "";
+    std::string message;
+    unsigned thread = 0;
+};
+
+// Written only by its thread and read only by the writer, so head and tail are the only shared state.
+struct Ring {
+    Record records[ring_capacity];
+    std::atomic<size_t> head = 0;       // Next record the thread writes
+    std::atomic<size_t> tail = 0;       // Next record the writer reads
+    unsigned thread = 0;
+
+    Ring();
+    ~Ring();
+};
+
+
+// Rings are registered and drained under one mutex, so a ring is never drained while its thread exits.
+static std::mutex rings_mutex;
+static std::vector<Ring*> rings;
+static unsigned next_thread = 0;
+
+static std::atomic<bool> running = false;
+static std::atomic<Level> print_level = Level::detail;
+static std::atomic<bool> log_all_levels = false;       // JSON file wants messages below print_level too
+static bool show_progress = false;
+static bool progress_shown = false;
+static std::FILE *json_file = nullptr;
+
+static std::thread writer;
+static std::mutex writer_mutex;
+static std::condition_variable writer_wake;
+static bool writer_stop = false;
+
+static std::atomic<const char*> progress_stage = nullptr;
+static std::atomic<size_t> progress_total = 0;
+static std::atomic<size_t> progress_done = 0;
+static size_t progress_drawn = (size_t)-1;
+
+
+
+static bool stdout_is_terminal() {
+    #ifdef _WIN32
+    return _isatty(_fileno(stdout));
+    #else
+    return isatty(fileno(stdout));
+    #endif
+}
+
+
+// Writes records in time order with one write to stdout, and redraws progress line below them.
+// Caller holds rings_mutex.
+static void write_records(std::vector<Record> &records, bool keep_progress) {
+    std::stable_sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+        return a.time < b.time;
+    });
+
+    std::string text;
+    std::string json;
+    for (auto &record : records) {
+        if (record.level >= print_level.load(std::memory_order_relaxed)) {
+            text += record.message;
+            text += '\n';
+        }
+        if (json_file) {
+            char time[32];
+            std::snprintf(time, sizeof(time), "%.6f", std::chrono::duration<double>(record.time.time_since_epoch()).count());
+            json += "{\"time\":";
+            json += time;
+            json += ",\"level\":\"";
+            json += level_names[(size_t)record.level];
+            json += "\",\"event\":";
+            append_json_string(json, record.event);
+            json += ",\"thread\":";
+            json += std::to_string(record.thread);
+            json += ",\"message\":";
+            append_json_string(json, record.message);
+            json += "}\n";
+        }
+    }
+
+    if (show_progress) {
+        const char *stage = progress_stage.load();
+        size_t total = progress_total.load();
+        size_t done = progress_done.load();
+        // Finished stage isn't drawn, so the line goes away until next stage begins.
+        bool draw = keep_progress && stage && done < total;
+
+        if (progress_shown && (!text.empty() || !draw || done != progress_drawn)) {
+            text.insert(0, "\r\033[K");
+            progress_shown = false;
+        }
+        if (draw && !progress_shown) {
+            char line[128];
+            std::snprintf(line, sizeof(line), "%s %zu/%zu", stage, done, total);
+            text += line;
+            progress_shown = true;
+            progress_drawn = done;
+        }
+    }
+
+    if (!text.empty()) {
+        std::fwrite(text.data(), 1, text.size(), stdout);
+        std::fflush(stdout);
+    }
+    if (!json.empty()) {
+        std::fwrite(json.data(), 1, json.size(), json_file);
+        std::fflush(json_file);
+    }
+}
+
+// Caller holds rings_mutex.
+static void drain(bool keep_progress) {
+    std::vector<Record> records;
+    for (auto *ring : rings) {
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        size_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            records.push_back(std::move(ring->records[tail % ring_capacity]));
+        }
+        ring->tail.store(tail, std::memory_order_release);
+    }
+    write_records(records, keep_progress);
+}
+
+static void writer_loop() {
+    std::unique_lock lock(writer_mutex);
+    while (!writer_stop) {
+        writer_wake.wait_for(lock, drain_interval);
+        lock.unlock();
+        {
+            std::lock_guard rings_lock(rings_mutex);
+            drain(true);
+        }
+        lock.lock();
+    }
+}
+
+
+
+Ring::Ring() {
+    std::lock_guard lock(rings_mutex);
+    thread = next_thread++;
+    rings.push_back(this);
+}
+
+Ring::~Ring() {
+    std::lock_guard lock(rings_mutex);
+    drain(running);
+    std::erase(rings, this);
+}
+
+
+
+void chm::log::start(const Options &options) {
+    if (running) {
+        stop();
+    }
+
+    print_level = options.level;
+    show_progress = options.progress && stdout_is_terminal();
+    progress_stage = nullptr;
+
+    if (!options.json_file.empty()) {
+        #ifdef _WIN32
+        json_file = _wfopen(options.json_file.c_str(), L"wb");
+        #else
+        json_file = std::fopen(options.json_file.c_str(), "wb");
+        #endif
+        if (!json_file) {
+            // Not running yet, so it is written right away.
+            warning("log_file_failed", "Failed to open log file: %s", options.json_file.string().c_str());
+        }
+    }
+    log_all_levels = json_file != nullptr;
+
+    writer_stop = false;
+    writer = std::thread(writer_loop);
+    running = true;
+}
+
+
+void chm::log::stop() {
+    if (!running) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(writer_mutex);
+        writer_stop = true;
+    }
+    writer_wake.notify_one();
+    writer.join();
+
+    std::lock_guard lock(rings_mutex);
+    running = false;
+    drain(false);
+
+    if (json_file) {
+        std::fclose(json_file);
+        json_file = nullptr;
+    }
+    log_all_levels = false;
+    show_progress = false;
+}
+
+
+void chm::log::flush() {
+    std::lock_guard lock(rings_mutex);
+    drain(false);
+}
+
+
+
+void chm::log::write(Level level, const char *event, std::string message) {
+    Record record = {std::chrono::system_clock::now(), level, event, std::move(message), 0};
+
+    if (!running) {
+        std::lock_guard lock(rings_mutex);
+        std::vector<Record> records;
+        records.push_back(std::move(record));
+        write_records(records, false);
+        return;
+    }
+
+    thread_local Ring ring;
+    record.thread = ring.thread;
+
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    // Full ring waits for the writer instead of dropping messages.
+    while (head - ring.tail.load(std::memory_order_acquire) >= ring_capacity) {
+        writer_wake.notify_one();
+        std::this_thread::yield();
+    }
+
+    ring.records[head % ring_capacity] = std::move(record);
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+
+static bool wanted(Level level) {
+    return level >= print_level.load(std::memory_order_relaxed) || log_all_levels.load(std::memory_order_relaxed);
+}
+
+static void write_formatted(Level level, const char *event, const char *format, std::va_list args) {
+    std::va_list size_args;
+    va_copy(size_args, args);
+    int size = std::vsnprintf(nullptr, 0, format, size_args);
+    va_end(size_args);
+
+    std::string message(size > 0 ? size : 0, '\0');
+    std::vsnprintf(message.data(), message.size() + 1, format, args);
+    write(level, event, std::move(message));
+}
+
+#define CHM_LOG_FUNCTION(name)                                      \
+    void chm::log::name(const char *event, const char *format, ...) { \
+        if (!wanted(Level::name)) {                                 \
+            return;                                                 \
+        }                                                           \
+        std::va_list args;                                          \
+        va_start(args, format);                                     \
+        write_formatted(Level::name, event, format, args);          \
+        va_end(args);                                               \
+    }
+
+CHM_LOG_FUNCTION(detail)
+CHM_LOG_FUNCTION(info)
+CHM_LOG_FUNCTION(warning)
+CHM_LOG_FUNCTION(error)
+
+#undef CHM_LOG_FUNCTION
+
+
+
+void chm::log::progress_begin(const char *stage, size_t total) {
+    progress_done = 0;
+    progress_total = total;
+    progress_stage = stage;
+}
+
+void chm::log::progress_advance(size_t count) {
+    progress_done.fetch_add(count, std::memory_order_relaxed);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#ifdef __GNUC__
+#define CHM_LOG_FORMAT(format_index, args_index) __attribute__((format(printf, format_index, args_index)))
+#else
+#define CHM_LOG_FORMAT(format_index, args_index)
+#endif
+
+
+
+// Build output. Every thread queues messages into its own ring buffer, one writer thread drains all of them
+// a few times per second and writes them in one go, so workers never wait for the terminal or each other.
+// Before start() and after stop() messages are written right away.
+namespace chm::log {
+    enum class Level : std::uint8_t {
+        detail,     // Every page, file and download
+        info,       // Summary of a stage
+        warning,
+        error,
+    };
+
+    struct Options {
+        Level level = Level::detail;            // Messages below it aren't printed
+        bool progress = false;                  // Live progress line, only if stdout is a terminal
+        std::filesystem::path json_file;        // JSON lines with every message regardless of level, empty = none
+    };
+
+    void start(const Options &options);
+    void stop();
+    // Writes everything queued so far, call before something else writes to stdout.
+    void flush();
+
+    // Starts logging and stops it when it goes out of scope.
+    class Session {
+    public:
+        explicit Session(const Options &options) { start(options); }
+        ~Session() { stop(); }
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+    };
+
+    // event is a short name of what happened for machine readable log, message is printed without a new line.
+    void write(Level level, const char *event, std::string message);
+
+    void detail(const char *event, const char *format, ...) CHM_LOG_FORMAT(2, 3);
+    void info(const char *event, const char *format, ...) CHM_LOG_FORMAT(2, 3);
+    void warning(const char *event, const char *format, ...) CHM_LOG_FORMAT(2, 3);
+    void error(const char *event, const char *format, ...) CHM_LOG_FORMAT(2, 3);
+
+    // Progress line shows how many of total items the current stage finished.
+    void progress_begin(const char *stage, size_t total);
+    void progress_advance(size_t count = 1);
+
+    // Advances progress when one item is done, however its processing returns.
+    class ProgressItem {
+    public:
+        ProgressItem() = default;
+        ~ProgressItem() { progress_advance(); }
+        ProgressItem(const ProgressItem&) = delete;
+        ProgressItem& operator=(const ProgressItem&) = delete;
+    };
+}
@@ -5,15 +5,24 @@
 
 #include "project.hpp"
 #include "config.hpp"
+#include "alloc_profile.hpp"
 #include "compiler.hpp"
+#include "log.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "preview.hpp"
+#include "reproducibility.hpp"
+#include "size_report.hpp"
+#include "watch.hpp"
 
 
 
-int main(int argc, const char *argv[]) {
-    // Disable stdout and stderr buffering.
-    std::setbuf(stdout, nullptr);
-    std::setbuf(stderr, nullptr);
+static int build(const chm::ProjectConfig &config, const std::filesystem::path &default_file, chm::ProjectData &data);
+static bool parse_size(const std::string &param, std::uint64_t &size);
+
+
 
+int main(int argc, const char *argv[]) {
     chm::ProjectConfig config;
 
     auto pwd = std::filesystem::current_path();
@@ -22,6 +31,10 @@ int main(int argc, const char *argv[]) {
     config.out_file = pwd / "out.chm";
 
     std::filesystem::path default_file;
+    bool verify_reproducible = false;
+    bool watch = false;
+    std::uint16_t preview_port = 0;
+    chm::log::Options log_options;
 
     RUtils::CommandLine cmd = {
         .program_name = "ghwiki2chm",
@@ -96,12 +109,40 @@ int main(int argc, const char *argv[]) {
                 "jobs",
                 [&](std::string param) {
                     if(std::sscanf(param.c_str(), "%u", &config.max_jobs) != 1) {
-                        std::printf("-j --jobs: expected a positive number or 0 but got: \"%s\". Ignored...\n", param.c_str());
+                        chm::log::warning("invalid_argument", "-j --jobs: expected a positive number or 0 but got: \"%s\". Ignored...", param.c_str());
                     }
                 },
                 "amount",
                 "Max nuber of threads to use during conversion. (default: number of threads)",
             },
+            {
+                'q',
+                "quiet",
+                [&]() {
+                    log_options.level = chm::log::Level::warning;
+                },
+                nullptr,
+                "Only print warnings and errors.",
+            },
+            {
+                0,
+                "progress",
+                [&]() {
+                    log_options.level = chm::log::Level::info;
+                    log_options.progress = true;
+                },
+                nullptr,
+                "Print stage summaries and a live progress line instead of every file.",
+            },
+            {
+                0,
+                "log-json",
+                [&](std::string param) {
+                    log_options.json_file = param;
+                },
+                "file",
+                "Write every log message as a json line with time, level, event and thread.",
+            },
             // {
             //     0,
             //     "toc-no-section-links",
@@ -130,17 +171,232 @@ int main(int argc, const char *argv[]) {
                 "name",
                 "Don't create TOC items for page sections.",
             },
+            {
+                0,
+                "prune-unreachable",
+                [&]() {
+                    config.prune_unreachable = true;
+                },
+                nullptr,
+                "Only include pages that can be reached by following links from sidebar and default page.",
+            },
+            {
+                0,
+                "highlight-code",
+                [&]() {
+                    config.highlight_code = true;
+                },
+                nullptr,
+                "Color code blocks with known languages when converting, colors are in a shared stylesheet.",
+            },
+            {
+                0,
+                "minify",
+                [&]() {
+                    config.minify = true;
+                },
+                nullptr,
+                "Remove unneeded whitespace and comments from converted pages.",
+            },
+            {
+                0,
+                "optimize-images",
+                [&]() {
+                    config.optimize_images = true;
+                },
+                nullptr,
+                "Losslessly recompress png images and strip metadata from png and jpeg images.",
+            },
+            {
+                0,
+                "no-index",
+                [&]() {
+                    config.index_generate = false;
+                },
+                nullptr,
+                "Don't create keyword index from page titles, headings and front matter keywords.",
+            },
+            {
+                0,
+                "verify-reproducible",
+                [&]() {
+                    verify_reproducible = true;
+                },
+                nullptr,
+                "Build twice from scratch and fail if any output file differs.",
+            },
+            {
+                0,
+                "watch",
+                [&]() {
+                    watch = true;
+                },
+                nullptr,
+                "After building, keep running and rebuild when files in root path change. Only changed pages are converted again.",
+            },
+            {
+                0,
+                "patch-chm",
+                [&]() {
+                    config.patch_chm = true;
+                },
+                nullptr,
+                "When only contents of pages or images changed, store them uncompressed in the previous chm instead of compiling it again. Full-text search isn't updated.",
+            },
+            {
+                0,
+                "watch-debounce",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.watch_debounce) != 1) {
+                        chm::log::warning("invalid_argument", "--watch-debounce: expected a number of milliseconds but got: \"%s\". Ignored...", param.c_str());
+                        config.watch_debounce = 200;
+                    }
+                },
+                "ms",
+                "How long watch mode waits for more changes before rebuilding. (default: 200)",
+            },
+            {
+                0,
+                "preview",
+                [&](std::string param) {
+                    unsigned port = 0;
+                    if(std::sscanf(param.c_str(), "%u", &port) != 1 || port == 0 || port > 65535) {
+                        chm::log::warning("invalid_argument", "--preview: expected a port number but got: \"%s\". Ignored...", param.c_str());
+                        return;
+                    }
+                    preview_port = port;
+                },
+                "port",
+                "Don't build, serve the wiki on http://127.0.0.1:port instead. Pages are converted when they are opened.",
+            },
+            {
+                0,
+                "memory-limit",
+                [&](std::string param) {
+                    if(!parse_size(param, config.memory_limit)) {
+                        chm::log::warning("invalid_argument", "--memory-limit: expected a size like 512M or 2G but got: \"%s\". Ignored...", param.c_str());
+                    }
+                },
+                "size",
+                "Keep memory use of a build around this size: fewer pages are converted at once and keywords are sorted on disk. Peak memory use is reported.",
+            },
             {
                 0,
                 "max-downloads",
                 [&](std::string param) {
                     if(std::sscanf(param.c_str(), "%u", &config.max_downloads) != 1 || config.max_downloads == 0) {
-                        std::printf("--max-downloads: expected a positive number but got: \"%s\". Ignored...\n", param.c_str());
-                        config.max_downloads = 8;
+                        chm::log::warning("invalid_argument", "--max-downloads: expected a positive number but got: \"%s\". Ignored...", param.c_str());
+                        config.max_downloads = 32;
                     }
                 },
                 "amount",
-                "Max number of parallel file downloads. (default: 8)",
+                "Max number of parallel file downloads, fewer are used when hosts slow down or throttle. (default: 32)",
+            },
+            {
+                0,
+                "download-log",
+                [&](std::string param) {
+                    config.dep_download_log = param;
+                },
+                "file",
+                "Write changes of download concurrency limits to a csv file.",
+            },
+            {
+                0,
+                "metrics-file",
+                [&](std::string param) {
+                    config.metrics_file = param;
+                },
+                "file",
+                "Write build metrics in Prometheus text format after every build, for node_exporter textfile collector.",
+            },
+            {
+                0,
+                "size-report",
+                [&](std::string param) {
+                    config.size_report = param;
+                },
+                "file",
+                "Write size of every file in the chm to a json file, with totals by directory and origin. Biggest ones are printed.",
+            },
+            {
+                0,
+                "check-links",
+                [&](std::string param) {
+                    config.link_report = param;
+                },
+                "file",
+                "Check external links of all pages and write broken ones with pages linking to them to a json file.",
+            },
+            {
+                0,
+                "link-cache-ttl",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.link_cache_ttl) != 1) {
+                        chm::log::warning("invalid_argument", "--link-cache-ttl: expected a number of seconds but got: \"%s\". Ignored...", param.c_str());
+                    }
+                },
+                "seconds",
+                "How long a checked link isn't checked again, 0 checks every build. (default: 86400)",
+            },
+            {
+                0,
+                "max-download-size",
+                [&](std::string param) {
+                    if(!parse_size(param, config.dep_download_max_size)) {
+                        chm::log::warning("invalid_argument", "--max-download-size: expected a size like 512K or 16M but got: \"%s\". Ignored...", param.c_str());
+                    }
+                },
+                "size",
+                "Skip remote images larger than this, they are linked instead. 0 disables the limit. (default: 16M)",
+            },
+            {
+                0,
+                "download-timeout",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.dep_download_timeout) != 1) {
+                        chm::log::warning("invalid_argument", "--download-timeout: expected a number but got: \"%s\". Ignored...", param.c_str());
+                        config.dep_download_timeout = 60;
+                    }
+                },
+                "seconds",
+                "Max time for a single download, 0 disables the limit. (default: 60)",
+            },
+            {
+                0,
+                "download-deadline",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.dep_download_deadline) != 1) {
+                        chm::log::warning("invalid_argument", "--download-deadline: expected a number but got: \"%s\". Ignored...", param.c_str());
+                        config.dep_download_deadline = 0;
+                    }
+                },
+                "seconds",
+                "Max time for all downloads, images that weren't downloaded by then are linked instead. (default: no limit)",
+            },
+            {
+                0,
+                "download-retries",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.dep_download_retries) != 1) {
+                        chm::log::warning("invalid_argument", "--download-retries: expected a number but got: \"%s\". Ignored...", param.c_str());
+                        config.dep_download_retries = 2;
+                    }
+                },
+                "amount",
+                "How many times to retry downloads that failed because of timeouts or server errors. (default: 2)",
+            },
+            {
+                0,
+                "download-min-speed",
+                [&](std::string param) {
+                    if(std::sscanf(param.c_str(), "%u", &config.dep_download_low_speed) != 1) {
+                        chm::log::warning("invalid_argument", "--download-min-speed: expected a number but got: \"%s\". Ignored...", param.c_str());
+                        config.dep_download_low_speed = 1024;
+                    }
+                },
+                "bytes/s",
+                "Abort downloads slower than this for 15 seconds, 0 disables the check. (default: 1024)",
             },
             {
                 0,
@@ -168,26 +424,100 @@ int main(int argc, const char *argv[]) {
         return 0;
     }
 
+    chm::log::Session log_session(log_options);
+
+    if(preview_port) {
+        return chm::serve_preview(config, default_file, preview_port);
+    }
+
+    chm::ProjectData data;
+    int status = build(config, default_file, data);
+    if(watch) {
+        return chm::watch_project(config, default_file, data);
+    }
+    if(status != 0 || !verify_reproducible) {
+        return status;
+    }
+
+    // Second build starts from nothing, so caches from the first one can't hide differences.
+    auto first_build = chm::snapshot_build_output(config);
+    std::filesystem::remove_all(config.temp);
+    std::filesystem::remove(config.out_file);
+
+    chm::log::info("reproducibility_check", "Building again to verify that output is reproducible...");
+    chm::ProjectData second_data;
+    status = build(config, default_file, second_data);
+    if(status != 0) {
+        return status;
+    }
+
+    auto differences = chm::compare_build_snapshots(first_build, chm::snapshot_build_output(config));
+    if(!differences.empty()) {
+        chm::log::error("build_not_reproducible", "Build is not reproducible, %zu files differ:", differences.size());
+        for(auto &path : differences) {
+            chm::log::error("build_not_reproducible", "    %s", path.c_str());
+        }
+        return 1;
+    }
+
+    chm::log::info("build_reproducible", "Build is reproducible, %zu files are identical.", first_build.size());
+    return 0;
+}
+
+
+
+static int build(const chm::ProjectConfig &config, const std::filesystem::path &default_file, chm::ProjectData &data) {
     std::filesystem::create_directories(config.temp);
 
-    chm::ProjectData data = chm::create_project_data_from_ghwiki(config, default_file);
+    data = chm::create_project_data_from_ghwiki(config, default_file);
 
     chm::convert_project_files(config, data);
+    chm::stage_project_files(config, data);
     chm::download_dependencies(config, data);
+    if(config.optimize_images) {
+        chm::optimize_images(config, data);
+    }
     chm::generate_project_files(config, data);
-
-    auto* compiler = chm::find_available_compiler();
-    if(!compiler) {
-        std::printf("Couldn't find any compatible chm compiler, make sure one is installed.\n");
-        return 1;
+    if(!config.size_report.empty()) {
+        chm::write_size_report(config, data, config.size_report);
+    }
+    if(!config.link_report.empty()) {
+        chm::check_external_links(config, data);
     }
 
-    std::printf("Starting compiler...\n");
+    int status = chm::compile_project(config) ? 0 : 1;
+    if(!config.metrics_file.empty()) {
+        chm::metrics::write_file(config.metrics_file);
+    }
 
-    if(!chm::compile(config, compiler)) {
-        std::printf("Compilation failed.\n");
-        return 1;
+    if(config.memory_limit) {
+        auto peak = chm::peak_memory_usage();
+        chm::log::info("peak_memory", "Peak memory use was %.1f MiB of %.1f MiB limit%s", peak / (1024.0 * 1024.0), config.memory_limit / (1024.0 * 1024.0),
+            peak > config.memory_limit ? ", limit was exceeded." : ".");
     }
+    chm::alloc_profile::print_report(data);
+    return status;
+}
 
-    return 0;
+
+
+// Number of bytes with optional K, M or G suffix.
+static bool parse_size(const std::string &param, std::uint64_t &size) {
+    unsigned long long value = 0;
+    char unit = 0;
+    int read = std::sscanf(param.c_str(), "%llu%c", &value, &unit);
+    switch (read == 2 ? unit : 0) {
+    case 'G': case 'g': value *= 1024; [[fallthrough]];
+    case 'M': case 'm': value *= 1024; [[fallthrough]];
+    case 'K': case 'k': value *= 1024; [[fallthrough]];
+    case 0:
+        break;
+    default:
+        return false;
+    }
+    if(read < 1) {
+        return false;
+    }
+    size = value;
+    return true;
 }
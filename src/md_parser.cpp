@@ -8,8 +8,78 @@ using namespace RUtils;
 
 
 
-ErrorOr<std::string> convert_markdown_file_to_html(std::filesystem::path file) {
+// Key is a word of letters, digits, '_' and '-' at the start of the line, followed by ':' and a space or end of line.
+static bool is_front_matter_line(std::string_view line) {
+    size_t key_end = 0;
+    while (key_end < line.size() && (std::isalnum((unsigned char)line[key_end]) || line[key_end] == '_' || line[key_end] == '-')) {
+        key_end++;
+    }
+    if (key_end == 0 || key_end == line.size() || line[key_end] != ':') {
+        return false;
+    }
+    return key_end + 1 == line.size() || std::isspace((unsigned char)line[key_end + 1]);
+}
+
+
+// Front matter is a block of "key: value" lines at the start of the file, enclosed in "---" lines.
+// Only "keywords:" is used, values are separated with commas and may be wrapped in [].
+// If the block isn't closed or any line in it isn't "key: value", it's page text starting with a horizontal rule.
+static void parse_front_matter(std::istream &md_file, std::vector<std::string> *keywords) {
+    std::string line;
+    std::vector<std::string> found_keywords;
+
+    if (std::getline(md_file, line) && trim_whitespace(line) == "---") {
+        while (std::getline(md_file, line)) {
+            if (trim_whitespace(line) == "---") {
+                if (keywords) {
+                    keywords->insert(keywords->end(), found_keywords.begin(), found_keywords.end());
+                }
+                return;
+            }
+
+            if (!is_front_matter_line(line)) {
+                break;
+            }
+
+            std::string_view line_sv = trim_whitespace(line);
+            if (!line_sv.starts_with("keywords:")) {
+                continue;
+            }
+
+            line_sv.remove_prefix(std::string_view("keywords:").size());
+            line_sv = trim_whitespace(line_sv);
+            if (line_sv.starts_with('[') && line_sv.ends_with(']')) {
+                line_sv = line_sv.substr(1, line_sv.size() - 2);
+            }
+
+            while (!line_sv.empty()) {
+                size_t comma = line_sv.find(',');
+                std::string_view keyword = trim_whitespace(line_sv.substr(0, comma));
+
+                if (keyword.size() >= 2 && (keyword.front() == '"' || keyword.front() == '\'') && keyword.back() == keyword.front()) {
+                    keyword = keyword.substr(1, keyword.size() - 2);
+                }
+                if (!keyword.empty()) {
+                    found_keywords.emplace_back(keyword);
+                }
+
+                if (comma == std::string_view::npos) {
+                    break;
+                }
+                line_sv.remove_prefix(comma + 1);
+            }
+        }
+    }
+
+    // No front matter, parse the whole file.
+    md_file.clear();
+    md_file.seekg(0);
+}
+
+
+ErrorOr<std::string> convert_markdown_file_to_html(std::filesystem::path file, std::vector<std::string> *keywords) {
     static maddy::Parser parser;
     std::ifstream md_file(file);
+    parse_front_matter(md_file, keywords);
     return parser.Parse(md_file);
-}
\ No newline at end of file
+}
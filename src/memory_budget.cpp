@@ -0,0 +1,51 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "memory_budget.hpp"
+
+
+
+void chm::MemoryBudget::acquire(std::uint64_t bytes) {
+    if (!limit) {
+        return;
+    }
+
+    std::unique_lock lock(mutex);
+    released.wait(lock, [&]() { return in_use == 0 || in_use + bytes <= limit; });
+    in_use += bytes;
+}
+
+
+void chm::MemoryBudget::release(std::uint64_t bytes) {
+    if (!limit) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        in_use -= bytes;
+    }
+    released.notify_all();
+}
+
+
+
+std::uint64_t chm::peak_memory_usage() {
+    #ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+    #else
+    rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return (std::uint64_t)usage.ru_maxrss * 1024;   // Kilobytes on linux
+    #endif
+}
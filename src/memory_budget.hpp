@@ -0,0 +1,29 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+
+
+namespace chm {
+    // Limits how many bytes are used by work in flight, instead of how many threads do the work.
+    // Threads wait in acquire() until enough bytes are released, one request always fits when nothing else is in flight.
+    class MemoryBudget {
+    public:
+        // 0 = no limit, acquire() never waits.
+        explicit MemoryBudget(std::uint64_t limit) : limit(limit) {}
+
+        void acquire(std::uint64_t bytes);
+        void release(std::uint64_t bytes);
+
+    private:
+        std::uint64_t limit;
+        std::uint64_t in_use = 0;
+        std::mutex mutex;
+        std::condition_variable released;
+    };
+
+    // Highest resident memory of this process so far in bytes, 0 if the platform can't tell.
+    std::uint64_t peak_memory_usage();
+}
@@ -0,0 +1,245 @@
+#include <atomic>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+#include "metrics.hpp"
+#include "alloc_profile.hpp"
+#include "log.hpp"
+
+using namespace chm::metrics;
+
+
+
+constexpr size_t stage_count = (size_t)Stage::count;
+constexpr size_t cache_count = (size_t)Cache::count;
+constexpr size_t counter_count = (size_t)Counter::count;
+constexpr size_t response_class_count = 6;      // No response, 1xx to 5xx
+
+constexpr const char* stage_names[stage_count] = {"discover", "convert", "stage", "download", "optimize", "generate", "compile"};
+constexpr const char* cache_names[cache_count] = {"highlight", "staging", "image", "preview", "link"};
+constexpr const char* response_class_names[response_class_count] = {"error", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+struct CounterInfo {
+    const char* name;
+    const char* help;
+};
+constexpr CounterInfo counter_infos[counter_count] = {
+    {"ghwiki2chm_pages_converted_total", "Pages converted from markdown."},
+    {"ghwiki2chm_unresolved_links_total", "Links to local files that weren't found in the project."},
+    {"ghwiki2chm_download_bytes_total", "Bytes received while downloading remote dependencies."},
+    {"ghwiki2chm_download_retries_total", "Downloads that were retried after a transient error."},
+};
+
+// Upper bounds of duration histogram buckets in seconds, last bucket is +Inf.
+constexpr double duration_buckets[] = {0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60, 300};
+constexpr size_t bucket_count = std::size(duration_buckets);
+
+
+// All values of one thread are in one flat array, so adding threads together is a loop.
+// Histograms are bucket counts, +Inf count and sum in nanoseconds.
+constexpr size_t counters_at = 0;
+constexpr size_t bytes_in_at = counters_at + counter_count;
+constexpr size_t bytes_out_at = bytes_in_at + stage_count;
+constexpr size_t cache_hits_at = bytes_out_at + stage_count;
+constexpr size_t cache_misses_at = cache_hits_at + cache_count;
+constexpr size_t responses_at = cache_misses_at + cache_count;
+constexpr size_t histograms_at = responses_at + response_class_count;
+constexpr size_t histogram_size = bucket_count + 2;
+constexpr size_t page_histogram = stage_count;      // Stage durations, then page conversion times
+constexpr size_t value_count = histograms_at + (stage_count + 1) * histogram_size;
+
+struct Values {
+    std::atomic<std::uint64_t> values[value_count] = {};
+};
+
+
+static std::mutex threads_mutex;
+static std::vector<Values*> thread_values;
+static Values exited_threads;       // Values of threads that already exited
+
+static std::atomic<double> compiler_seconds = 0;
+static std::atomic<int> compiler_exit_code = 0;
+static std::atomic<bool> compiler_ran = false;
+
+
+// Values are registered when a thread first updates a metric, and added to exited_threads when the thread exits.
+struct ThreadValues {
+    Values values;
+
+    ThreadValues() {
+        std::lock_guard lock(threads_mutex);
+        thread_values.push_back(&values);
+    }
+
+    ~ThreadValues() {
+        std::lock_guard lock(threads_mutex);
+        for (size_t i = 0; i < value_count; i++) {
+            exited_threads.values[i].fetch_add(values.values[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        std::erase(thread_values, &values);
+    }
+};
+
+// Only the owning thread writes, export only reads, so a plain load and store is enough and no locked instruction is used.
+static void add_value(size_t index, std::uint64_t value) {
+    thread_local ThreadValues local;
+    auto &v = local.values.values[index];
+    v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+static void observe(size_t histogram, double seconds) {
+    size_t bucket = 0;
+    while (bucket < bucket_count && seconds > duration_buckets[bucket]) {
+        bucket++;
+    }
+
+    size_t at = histograms_at + histogram * histogram_size;
+    add_value(at + bucket, 1);
+    add_value(at + bucket_count + 1, (std::uint64_t)(seconds * 1e9));
+}
+
+
+
+void chm::metrics::add(Counter counter, std::uint64_t value) {
+    add_value(counters_at + (size_t)counter, value);
+}
+
+void chm::metrics::add_stage_bytes(Stage stage, std::uint64_t bytes_in, std::uint64_t bytes_out) {
+    add_value(bytes_in_at + (size_t)stage, bytes_in);
+    add_value(bytes_out_at + (size_t)stage, bytes_out);
+}
+
+void chm::metrics::add_cache_lookups(Cache cache, std::uint64_t hits, std::uint64_t misses) {
+    add_value(cache_hits_at + (size_t)cache, hits);
+    add_value(cache_misses_at + (size_t)cache, misses);
+}
+
+void chm::metrics::add_download_response(long status) {
+    add_value(responses_at + (status >= 100 && status < 600 ? status / 100 : 0), 1);
+}
+
+void chm::metrics::observe_stage_duration(Stage stage, double seconds) {
+    observe((size_t)stage, seconds);
+}
+
+void chm::metrics::observe_page_conversion(double seconds) {
+    observe(page_histogram, seconds);
+}
+
+chm::metrics::StageTimer::StageTimer(Stage stage) : stage(stage), outer_stage(alloc_profile::enter_stage(stage)), start(std::chrono::steady_clock::now()) {}
+
+chm::metrics::StageTimer::~StageTimer() {
+    observe_stage_duration(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    alloc_profile::enter_stage(outer_stage);
+}
+
+
+void chm::metrics::set_compiler_result(double seconds, int exit_code) {
+    compiler_seconds = seconds;
+    compiler_exit_code = exit_code;
+    compiler_ran = true;
+}
+
+
+
+std::string chm::metrics::export_text() {
+    std::vector<std::uint64_t> totals(value_count);
+    {
+        std::lock_guard lock(threads_mutex);
+        for (size_t i = 0; i < value_count; i++) {
+            totals[i] = exited_threads.values[i].load(std::memory_order_relaxed);
+            for (auto *values : thread_values) {
+                totals[i] += values->values[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string out;
+    auto header = [&](std::string_view name, std::string_view type, std::string_view help) {
+        out += std::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+    };
+    auto labeled = [&](std::string_view name, std::string_view label, const char* const* label_values, size_t count, size_t at) {
+        for (size_t i = 0; i < count; i++) {
+            out += std::format("{}{{{}=\"{}\"}} {}\n", name, label, label_values[i], totals[at + i]);
+        }
+    };
+    auto histogram = [&](std::string_view name, std::string labels, size_t index) {
+        size_t at = histograms_at + index * histogram_size;
+        std::string separator = labels.empty() ? "" : ",";
+
+        std::uint64_t count = 0;
+        for (size_t i = 0; i < bucket_count; i++) {
+            count += totals[at + i];
+            out += std::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, separator, duration_buckets[i], count);
+        }
+        count += totals[at + bucket_count];
+        out += std::format("{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, separator, count);
+
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out += std::format("{}_sum{} {}\n{}_count{} {}\n", name, braces, totals[at + bucket_count + 1] / 1e9, name, braces, count);
+    };
+
+    for (size_t i = 0; i < counter_count; i++) {
+        header(counter_infos[i].name, "counter", counter_infos[i].help);
+        out += std::format("{} {}\n", counter_infos[i].name, totals[counters_at + i]);
+    }
+
+    header("ghwiki2chm_stage_input_bytes_total", "counter", "Bytes read by a stage.");
+    labeled("ghwiki2chm_stage_input_bytes_total", "stage", stage_names, stage_count, bytes_in_at);
+    header("ghwiki2chm_stage_output_bytes_total", "counter", "Bytes written by a stage.");
+    labeled("ghwiki2chm_stage_output_bytes_total", "stage", stage_names, stage_count, bytes_out_at);
+
+    header("ghwiki2chm_cache_hits_total", "counter", "Lookups answered from a cache.");
+    labeled("ghwiki2chm_cache_hits_total", "cache", cache_names, cache_count, cache_hits_at);
+    header("ghwiki2chm_cache_misses_total", "counter", "Lookups that weren't in a cache.");
+    labeled("ghwiki2chm_cache_misses_total", "cache", cache_names, cache_count, cache_misses_at);
+
+    header("ghwiki2chm_download_responses_total", "counter", "Finished downloads by HTTP status class, error if there was no response.");
+    labeled("ghwiki2chm_download_responses_total", "code", response_class_names, response_class_count, responses_at);
+
+    header("ghwiki2chm_stage_duration_seconds", "histogram", "Time spent in a stage.");
+    for (size_t i = 0; i < stage_count; i++) {
+        histogram("ghwiki2chm_stage_duration_seconds", std::format("stage=\"{}\"", stage_names[i]), i);
+    }
+    header("ghwiki2chm_page_conversion_seconds", "histogram", "Time to convert one page.");
+    histogram("ghwiki2chm_page_conversion_seconds", "", page_histogram);
+
+    if (compiler_ran) {
+        header("ghwiki2chm_compiler_duration_seconds", "gauge", "Duration of the last compiler run.");
+        out += std::format("ghwiki2chm_compiler_duration_seconds {}\n", compiler_seconds.load());
+        header("ghwiki2chm_compiler_exit_code", "gauge", "Exit code of the last compiler run.");
+        out += std::format("ghwiki2chm_compiler_exit_code {}\n", compiler_exit_code.load());
+    }
+
+    auto now = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header("ghwiki2chm_last_export_timestamp_seconds", "gauge", "When these metrics were exported.");
+    out += std::format("ghwiki2chm_last_export_timestamp_seconds {}\n", now);
+
+    return out;
+}
+
+
+bool chm::metrics::write_file(const std::filesystem::path &path) {
+    auto temp_path = path;
+    temp_path += ".tmp";
+
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        file << export_text();
+        if (!file) {
+            log::error("metrics_write_failed", "Failed to write metrics: %s", path.string().c_str());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) {
+        log::error("metrics_write_failed", "Failed to write metrics: %s: %s", path.string().c_str(), ec.message().c_str());
+        return false;
+    }
+    return true;
+}
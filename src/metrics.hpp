@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+
+
+// Build metrics exported in Prometheus text format, for node_exporter textfile collector or a scrape endpoint.
+// Every thread updates its own counters without locks or atomic read-modify-write, they are summed only on export.
+namespace chm::metrics {
+    enum class Stage : std::uint8_t {
+        discover,
+        convert,
+        stage,
+        download,
+        optimize,
+        generate,
+        compile,
+        count,
+    };
+
+    enum class Cache : std::uint8_t {
+        highlight,      // Highlighted code blocks
+        staging,        // Files that were already staged by previous build
+        image,          // Optimized images
+        preview,        // Converted pages kept by preview server
+        link,           // External links checked by previous builds
+        count,
+    };
+
+    enum class Counter : std::uint8_t {
+        pages_converted,
+        unresolved_links,       // Links to local files that find_local_file_pointed_by_url() couldn't find
+        download_bytes,
+        download_retries,
+        count,
+    };
+
+    void add(Counter counter, std::uint64_t value = 1);
+    void add_stage_bytes(Stage stage, std::uint64_t bytes_in, std::uint64_t bytes_out);
+    void add_cache_lookups(Cache cache, std::uint64_t hits, std::uint64_t misses);
+    // HTTP status code of a finished download, 0 if the request failed without a response.
+    void add_download_response(long status);
+
+    void observe_stage_duration(Stage stage, double seconds);
+    void observe_page_conversion(double seconds);
+
+    // Last compiler run, exported as gauges.
+    void set_compiler_result(double seconds, int exit_code);
+
+    // Observes time from construction to destruction as duration of a stage.
+    // It's also the stage allocations are attributed to in allocation profiling builds, see alloc_profile.hpp.
+    class StageTimer {
+    public:
+        explicit StageTimer(Stage stage);
+        ~StageTimer();
+
+    private:
+        Stage stage;
+        Stage outer_stage;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Sums counters of all threads, including threads that already exited.
+    std::string export_text();
+    // Replaces file atomically, so the collector never reads a partial file.
+    bool write_file(const std::filesystem::path &path);
+}
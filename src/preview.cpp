@@ -0,0 +1,349 @@
+#include <cctype>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "preview.hpp"
+#include "helpers.hpp"
+#include "highlight.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "text_kernels.hpp"
+
+
+
+// Pages, TOC frame and metrics of the preview, everything else is served from root path.
+constexpr std::string_view toc_frame_path = ".preview/toc.html";
+constexpr std::string_view metrics_path = "metrics";
+
+
+static std::string_view content_type(std::string_view path) {
+    std::string extension = std::filesystem::path(path).extension().string();
+    for (auto &c : extension) {
+        c = chm::text::to_lower(c);
+    }
+
+    if (extension == ".html" || extension == ".htm") return "text/html; charset=utf-8";
+    if (extension == ".css") return "text/css";
+    if (extension == ".png") return "image/png";
+    if (extension == ".jpg" || extension == ".jpeg") return "image/jpeg";
+    if (extension == ".gif") return "image/gif";
+    if (extension == ".svg") return "image/svg+xml";
+    return "application/octet-stream";
+}
+
+
+// Request target without leading slash, query and fragment, with %XX escapes decoded.
+static std::string decode_request_path(std::string_view target) {
+    target = target.substr(0, target.find_first_of("?#"));
+    while (target.starts_with('/')) {
+        target.remove_prefix(1);
+    }
+
+    std::string path;
+    for (size_t i = 0; i < target.size(); i++) {
+        if (target[i] == '%' && i + 2 < target.size() && std::isxdigit((unsigned char)target[i + 1]) && std::isxdigit((unsigned char)target[i + 2])) {
+            path += (char)std::stoi(std::string(target.substr(i + 1, 2)), nullptr, 16);
+            i += 2;
+        } else {
+            path += target[i];
+        }
+    }
+    return path;
+}
+
+
+static std::string read_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+
+// Nested lists of links that open in the page frame, same tree as .hhc file.
+static std::string render_toc(const chm::TableOfContents &toc, const chm::ProjectFiles &files) {
+    using ItemId = chm::TableOfContents::ItemId;
+
+    std::string out = std::string(chm::page_header_begin) + "<base target=\"page\">" + std::string(chm::page_header_end) + "<ul>\n";
+
+    std::vector<ItemId> stack;
+    ItemId id = toc[chm::TableOfContents::root].first_child;
+
+    while (true) {
+        if (id == chm::TableOfContents::none) {
+            if (stack.empty()) {
+                break;
+            }
+            out += "</ul></li>\n";
+            id = stack.back();
+            stack.pop_back();
+            continue;
+        }
+
+        auto &item = toc[id];
+        out += "<li>";
+        if (item.file_link != chm::no_file) {
+            out += "<a href=\"/";
+            out += files.link(item.file_link);
+            if (item.fragment_size) {
+                out += '#';
+                out += toc.fragment(id);
+            }
+            out += "\">";
+            out += toc.name(id);
+            out += "</a>";
+        } else {
+            out += toc.name(id);
+        }
+
+        if (item.first_child == chm::TableOfContents::none) {
+            out += "</li>\n";
+            id = item.next_sibling;
+            continue;
+        }
+
+        out += "<ul>\n";
+        stack.push_back(item.next_sibling);
+        id = item.first_child;
+    }
+
+    out += "</ul>\n";
+    out += chm::page_footer;
+    return out;
+}
+
+
+
+#ifndef _WIN32
+static void send_response(int client, int status, std::string_view type, std::string_view body) {
+    std::string header = std::format("HTTP/1.1 {} {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nCache-Control: no-store\r\nConnection: close\r\n\r\n",
+        status, status == 200 ? "OK" : status == 404 ? "Not Found" : "Bad Request", type, body.size());
+
+    for (std::string_view part : {std::string_view(header), body}) {
+        while (!part.empty()) {
+            ssize_t sent = send(client, part.data(), part.size(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return;
+            }
+            part.remove_prefix(sent);
+        }
+    }
+}
+
+
+// Request line of a GET request, empty if the request is something else.
+static std::string read_request_target(int client) {
+    std::string request;
+    char buffer[4096];
+
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 64 * 1024) {
+        ssize_t size = recv(client, buffer, sizeof(buffer), 0);
+        if (size <= 0) {
+            break;
+        }
+        request.append(buffer, size);
+    }
+
+    std::string_view line = std::string_view(request).substr(0, request.find("\r\n"));
+    if (!line.starts_with("GET ")) {
+        return {};
+    }
+    line.remove_prefix(4);
+    return std::string(line.substr(0, line.find(' ')));
+}
+#endif
+
+
+
+int chm::serve_preview(const ProjectConfig &project_config, const std::filesystem::path &default_file, std::uint16_t port) {
+    #ifdef _WIN32
+    log::error("preview_unsupported", "Preview server is not supported on Windows.");
+    return 1;
+    #else
+    // Preview only needs to know which pages exist, pages aren't read until they are requested.
+    ProjectConfig config = project_config;
+    config.toc_use_sidebar = false;
+    config.prune_unreachable = false;
+    config.link_report.clear();
+
+    auto data_or_error = create_project_data_from_ghwiki(config, default_file);
+    if (data_or_error.is_error()) {
+        data_or_error.error().print();
+        return 1;
+    }
+    ProjectData &data = data_or_error;
+
+    // Requests are for converted pages, the same paths that links in converted pages point to.
+    std::unordered_map<std::string, FileId> pages;
+    for (FileId id : data.files.ids()) {
+        pages.emplace(std::filesystem::path(data.files.link(id)).generic_string(), id);
+    }
+
+    struct CachedPage {
+        std::string html;
+        std::filesystem::file_time_type source_time;
+        std::uintmax_t source_size = 0;
+    };
+    std::mutex mutex;
+    std::unordered_map<FileId, CachedPage> cache;
+    CodeHighlighter highlighter;
+
+    auto sidebar_path = config.root / "_Sidebar.md";
+    std::filesystem::file_time_type sidebar_time;
+    std::string toc_html;
+
+    // TOC is created again only when the sidebar changes.
+    auto toc_frame = [&]() {
+        std::error_code ec;
+        auto time = std::filesystem::last_write_time(sidebar_path, ec);
+        if (!toc_html.empty() && time == sidebar_time) {
+            return toc_html;
+        }
+
+        TableOfContents toc;
+        if (!ec) {
+            toc.append(TableOfContents::root, create_toc_entries_from_sidebar(config, data, sidebar_path));
+        } else {
+            for (FileId id : data.files.ids()) {
+                toc.add(TableOfContents::root, page_name_from_file(data.files.link(id)), id);
+            }
+        }
+
+        sidebar_time = time;
+        toc_html = render_toc(toc, data.files);
+        return toc_html;
+    };
+
+    // Converted page from cache, or converted now if it's not cached or its source changed since.
+    auto page_html = [&](FileId page, bool &converted) {
+        auto source = data.files.original_path(config.root, page);
+
+        std::error_code ec;
+        auto time = std::filesystem::last_write_time(source, ec);
+        auto size = std::filesystem::file_size(source, ec);
+
+        {
+            std::lock_guard lock(mutex);
+            if (auto it = cache.find(page); it != cache.end() && it->second.source_time == time && it->second.source_size == size) {
+                converted = false;
+                metrics::add_cache_lookups(metrics::Cache::preview, 1, 0);
+                return it->second.html;
+            }
+        }
+
+        metrics::add_cache_lookups(metrics::Cache::preview, 0, 1);
+        auto convert_start_time = std::chrono::steady_clock::now();
+
+        std::string body = convert_markdown_file_to_html(source);
+        update_html_headings_to_include_id(body);
+        std::string head_links = finish_page_html(config, data, page, body, highlighter);
+
+        std::string html = std::string(page_header_begin) + head_links + std::string(page_header_end) + body + std::string(page_footer);
+
+        metrics::add(metrics::Counter::pages_converted);
+        metrics::observe_page_conversion(std::chrono::duration<double>(std::chrono::steady_clock::now() - convert_start_time).count());
+
+        std::lock_guard lock(mutex);
+        cache[page] = {html, time, size};
+        converted = true;
+        return html;
+    };
+
+    auto handle = [&](int client) {
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::string target = read_request_target(client);
+        if (target.empty()) {
+            send_response(client, 400, "text/plain", "Only GET requests are supported.");
+            close(client);
+            return;
+        }
+        std::string path = decode_request_path(target);
+
+        int status = 200;
+        const char *note = "";
+
+        if (path.empty()) {
+            std::string frames = std::format("<!DOCTYPE html><html><head><meta charset=\"UTF-8\"><title>{}</title></head>"
+                "<frameset cols=\"280,*\"><frame src=\"/{}\" name=\"toc\"><frame src=\"/{}\" name=\"page\"></frameset></html>",
+                config.title, toc_frame_path, data.files.link(data.default_file));
+            send_response(client, 200, content_type(".html"), frames);
+        }
+        else if (path == toc_frame_path) {
+            std::string html;
+            {
+                std::lock_guard lock(mutex);
+                html = toc_frame();
+            }
+            send_response(client, 200, content_type(".html"), html);
+        }
+        else if (path == metrics_path) {
+            send_response(client, 200, "text/plain; version=0.0.4", metrics::export_text());
+        }
+        else if (path == highlight_stylesheet_name) {
+            send_response(client, 200, content_type(path), highlight_stylesheet);
+        }
+        else if (auto it = pages.find(path); it != pages.end() && data.files.converter(it->second) == ConversionType::from_markdown) {
+            bool converted = false;
+            send_response(client, 200, content_type(".html"), page_html(it->second, converted));
+            note = converted ? " converted" : " cached";
+        }
+        else {
+            // Pages that are copied, images and other files are served as they are, but only from root path.
+            auto file = std::filesystem::path(path).lexically_normal();
+            std::error_code ec;
+            if (!file.empty() && file.is_relative() && *file.begin() != ".." && std::filesystem::is_regular_file(config.root / file, ec)) {
+                send_response(client, 200, content_type(path), read_file(config.root / file));
+            } else {
+                status = 404;
+                send_response(client, 404, "text/plain", "Not found.");
+            }
+        }
+
+        close(client);
+
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time);
+        log::info("preview_request", "GET /%s %i%s %.1f ms", path.c_str(), status, note, elapsed.count());
+    };
+
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Loopback only, preview isn't meant to be reachable from other machines.
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (server < 0 || bind(server, (sockaddr*)&address, sizeof(address)) != 0 || listen(server, 64) != 0) {
+        log::error("preview_start_failed", "Failed to start preview server on port %u.", port);
+        if (server >= 0) {
+            close(server);
+        }
+        return 1;
+    }
+
+    log::info("preview_started", "Preview of %zu pages is on http://127.0.0.1:%u/", data.files.size(), port);
+
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        // Browser loads a page, its images and the TOC at once, every connection gets its own thread.
+        std::thread(handle, client).detach();
+    }
+    #endif
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+#include "project.hpp"
+
+
+
+namespace chm {
+    // Serves the wiki on http://127.0.0.1:port until the program is interrupted, without building a chm.
+    // Pages are converted when they are first requested and kept in memory until their source changes.
+    // Root shows the TOC from _Sidebar.md in a frame next to the default page.
+    int serve_preview(const ProjectConfig &config, const std::filesystem::path &default_file, std::uint16_t port);
+}
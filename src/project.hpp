@@ -2,10 +2,14 @@
 
 #include <deque>
 #include <filesystem>
+#include <map>
+#include <span>
 #include <string>
+#include <unordered_map>
 
 #include <RUtils/ErrorOr.hpp>
 
+#include "keyword_index.hpp"
 #include "project_file.hpp"
 #include "remote_dependency.hpp"
 #include "table_of_contents.hpp"
@@ -20,51 +24,138 @@ namespace chm {
         std::string toc_root_item_name;
 
         std::uint32_t max_jobs = 0;
-        std::uint32_t max_downloads = 8;
+        std::uint32_t max_downloads = 32;   // Upper limit, actual number of parallel downloads is adjusted while downloading
+        std::uint64_t memory_limit = 0;     // Bytes, 0 = no limit. Limits pages converted at once and keywords kept in memory
 
         // Those shoud probably be converted to bitflags, but who cares
         bool toc_use_sidebar = true;
         bool toc_generate_automagically = false;
+        bool index_generate = true;
+        bool prune_unreachable = false;
+        bool highlight_code = false;
+        bool minify = false;
+        bool optimize_images = false;
+        bool patch_chm = false;             // Changed files are patched into previous chm instead of compiling it again
+
+        std::uint32_t watch_debounce = 200;                         // Milliseconds without changes before watch mode rebuilds
+
+        std::uint64_t dep_download_max_size = 16 * 1024 * 1024;    // Bytes, 0 = no limit
+        std::uint32_t dep_download_timeout = 60;                    // Seconds for a single request, 0 = no limit
+        std::uint32_t dep_download_deadline = 0;                    // Seconds for all downloads, 0 = no limit
+        std::uint32_t dep_download_retries = 2;
+        std::uint32_t dep_download_low_speed = 1024;                // Bytes per second, slower downloads are aborted after 15 seconds
+        std::uint32_t link_cache_ttl = 24 * 60 * 60;                // Seconds a checked external link isn't checked again, 0 = check every build
+
+        std::filesystem::path dep_download_log;                     // Csv file with download concurrency changes, empty = no log
+        std::filesystem::path metrics_file;                         // Prometheus text file written after every build, empty = no file
+        std::filesystem::path size_report;                          // Json file with sizes of compiled files, empty = no report
+        std::filesystem::path link_report;                          // Json file with broken external links, empty = links aren't checked
 
         bool dep_download_ignore_ssl = false;
         bool dep_download_curl_verbose = false;
     };
 
+    // Maps links to project files, built once after files are found.
+    struct PageLookup {
+        std::unordered_map<std::string, FileId> paths;          // Original file path relative to root
+        std::unordered_map<std::string, FileId> page_names;     // Github wiki page links, see normalize_page_link()
+    };
+
     struct ProjectData {
-        TableOfContentsItem toc_root;
-        TableOfContentsItem *toc = nullptr;
-        ProjectFile* default_file_link = nullptr;
-        std::deque<ProjectFile> files;                      // Project files, that may be converted and are pages.
-        std::deque<ProjectFile> local_dependencies;         // Other files like images, required by project pages
+        TableOfContents toc;
+        TableOfContents::ItemId toc_parent = TableOfContents::root;   // Where new TOC items are added
+        std::filesystem::path toc_sidebar;                  // TOC is created from this sidebar while pages are converted, empty = none
+        FileId default_file = no_file;
+        ProjectFiles files;                                 // Project files, that may be converted and are pages.
+        ProjectFiles local_dependencies;                    // Other files like images, required by project pages
         std::deque<RemoteDependency> remote_dependencies;   // Other files like images, but needed to be downloaded.
+        KeywordIndex keywords;                              // Keywords found during conversion, not sorted.
+        std::vector<KeywordEntry> index;                    // Sorted keywords, written to .hhk file.
+        std::filesystem::path index_file;                   // Sorted keywords spilled to disk when memory is limited, used instead of index.
+        std::map<std::string, std::vector<FileId>> external_links;  // Http urls without fragment or html escapes and pages that link to them, collected only when links are checked.
+        PageLookup page_lookup;
+
+        size_t pruned_count = 0;                            // Number of unreachable pages that were removed from the project
+        std::uintmax_t pruned_bytes = 0;                    // and size of their sources.
     };
 
     // Search for compatible files in root path, create ProjectData from them.
     RUtils::ErrorOr<ProjectData> create_project_data_from_ghwiki(const ProjectConfig &config, std::filesystem::path default_file);
 
+    void build_page_lookup(const ProjectConfig &config, ProjectData &data);
+    // Remove pages that can't be reached by following links from sidebar and default page.
+    void prune_unreachable_files(const ProjectConfig &config, ProjectData &data, const std::filesystem::path &sidebar_path);
+    // Paths of local pages and files linked from raw markdown or html, relative to root and not resolved yet, see find_page().
+    std::vector<std::string_view> scan_text_for_page_links(std::string_view text);
+
     // Run converters for project files
     void convert_project_files(const ProjectConfig &config, ProjectData &data);
+    // Converts only some pages, without merging keywords or adding TOC entries. Used to reconvert changed pages in watch mode.
+    void convert_pages(const ProjectConfig &config, ProjectData &data, std::span<const FileId> pages);
+
+    // html head body tags are required, chmcmd crashes if they are not present.
+    // TODO: Custom html style templates
+    constexpr std::string_view page_header_begin = "<!DOCTYPE html><html><head><meta charset=\"UTF-8\">";
+    constexpr std::string_view page_header_end = "</head><body>";
+    constexpr std::string_view page_footer = "</body></html>";
+
+    class CodeHighlighter;
+    // Last fixes of converted page html: external links open in a new window, links point to converted pages and code is highlighted.
+    // Returns tags that have to be added to the page head.
+    std::string finish_page_html(const ProjectConfig &config, ProjectData &data, FileId page, std::string &html, CodeHighlighter &highlighter);
 
 
     // Looks for local dependencies like images and includes them into the project
     void scan_html_for_local_dependencies(const ProjectConfig &config, ProjectData &data, const std::string &html);
     // Same as above but looks for remote images that should be downloaded and updates the url to point to a local file
-    void scan_html_for_remote_dependencies(const ProjectConfig &config, ProjectData &data, std::string &html);
+    void scan_html_for_remote_dependencies(const ProjectConfig &config, ProjectData &data, FileId page, std::string &html);
+    // Adds headings with ids to the keyword index, run after update_html_headings_to_include_id.
+    void scan_html_for_keywords(FileId file, const std::string &html, KeywordIndex::Shard &keywords);
 
-    // Download remote images that are used in the project
+    // Copy pages that don't need conversion and local dependencies into temp path
+    void stage_project_files(const ProjectConfig &config, ProjectData &data);
+    // Download remote images that are used in the project, pages are updated to link to images that couldn't be downloaded
     void download_dependencies(const ProjectConfig &config, ProjectData &data);
-    // Create .hhc .hhp
+    // Check that external links still work, broken ones are written to config.link_report. Returns number of broken links.
+    size_t check_external_links(const ProjectConfig &config, const ProjectData &data);
+    // Losslessly shrink staged and downloaded png and jpeg images, results are cached in temp path
+    void optimize_images(const ProjectConfig &config, ProjectData &data);
+    // Create .hhc .hhk .hhp
     void generate_project_files(const ProjectConfig &config, const ProjectData &data);
 
+    // Entry of [FILES] section of .hhp, a file that is compiled into the chm.
+    struct CompiledFile {
+        enum class Origin : std::uint8_t {
+            page,           // Converted from markdown
+            local,          // Copied page or local dependency
+            remote,         // Downloaded dependency
+            generated,      // Written by ghwiki2chm, like the highlight stylesheet
+        };
+
+        std::string link;                   // Path inside chm, relative to temp path
+        std::string source;                 // Original file relative to root or url, empty for generated files
+        Origin origin;
+        std::uint64_t source_size = 0;      // Size before conversion or optimization, only with source_sizes
+    };
+    // In the same order as in [FILES]. Original files are only stat'ed for their size with source_sizes.
+    std::vector<CompiledFile> list_compiled_files(const ProjectConfig &config, const ProjectData &data, bool source_sizes = false);
+
 
 
     void update_html_headings_to_include_id(std::string &html);
     void update_html_links_to_pages(const ProjectConfig &config, ProjectData &data, std::string &html);
-    void update_html_remote_links_to_open_in_new_broser_window(const ProjectData &data, std::string &html);
+    // If external_links is not null, http and https urls of the links are appended to it.
+    void update_html_remote_links_to_open_in_new_broser_window(const ProjectData &data, std::string &html, std::vector<std::string> *external_links = nullptr);
+    // Collapses whitespace and removes comments in place, returns number of removed bytes.
+    size_t minify_html(std::string &html);
 
-    ProjectFile* find_local_file_pointed_by_url(const ProjectConfig &config, ProjectData &data, const std::string &url);
+    FileId find_local_file_pointed_by_url(const ProjectConfig &config, const ProjectData &data, const std::string &url);
+    // Path relative to root, returns no_file if not found.
+    FileId find_page(const ProjectData &data, std::string_view path);
 
 
-    TableOfContentsItem create_toc_entries_from_sidebar(const ProjectConfig &config, ProjectData &data, std::filesystem::path sidebar_path);
-    // TableOfContentsItem create_toc_entries(const ProjectConfig &config, ProjectFile* file, const std::string& html);  // Create toc entry by looking for heading tags in generated html
+    // Parses nested markdown lists of the sidebar directly, links are resolved with page lookup.
+    // Only reads files and page lookup of data, so it can run while pages are converted.
+    TableOfContents create_toc_entries_from_sidebar(const ProjectConfig &config, const ProjectData &data, const std::filesystem::path &sidebar_path);
+    // TableOfContents create_toc_entries(const ProjectConfig &config, FileId file, const std::string& html);  // Create toc entry by looking for heading tags in generated html
 }
\ No newline at end of file
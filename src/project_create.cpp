@@ -1,6 +1,10 @@
+#include <algorithm>
 #include <format>
 
 #include "project.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
 
 using namespace RUtils;
 
@@ -11,68 +15,86 @@ ErrorOr<chm::ProjectData> chm::create_project_data_from_ghwiki(const ProjectConf
         return Error("Root path doesn't exist.", ErrorType::invalid_argument);
     }
 
+    metrics::StageTimer timer(metrics::Stage::discover);
+
     chm::ProjectData data;
 
     std::filesystem::path sidebar_path;
 
-    for (auto &&dir_entry : std::filesystem::recursive_directory_iterator(config.root)) {
-        // Skip all non-file entries
-        if(!dir_entry.is_regular_file()) {
+    std::vector<std::filesystem::path> found_files;
+
+    for (auto it = std::filesystem::recursive_directory_iterator(config.root); it != std::filesystem::recursive_directory_iterator(); ++it) {
+        // Skip temp directory, it contains pages from previous builds
+        std::error_code ec;
+        if(it->is_directory() && std::filesystem::equivalent(it->path(), config.temp, ec)) {
+            it.disable_recursion_pending();
             continue;
         }
 
-        auto file = dir_entry.path();
-
-        // Skip files inside temp directory
-        if(file.compare(config.temp) > 0) {
+        // Skip all non-file entries
+        if(!it->is_regular_file()) {
             continue;
         }
 
-        // Add compatible file types to project
+        found_files.push_back(it->path());
+    }
+
+    // Directory iteration order depends on the file system, every build has to see files in the same order.
+    std::sort(found_files.begin(), found_files.end());
+
+    for (auto &file : found_files) {
+        // Add compatible file types to project, paths relative to root and temp path are computed only here.
         // TODO: Refactor
         if(file.filename() == "_Sidebar.md") {
             sidebar_path = file;
         }
         else if(file.extension() == ".md") {
-            data.files.push_back({file});
+            auto relative = std::filesystem::relative(file, config.root);
+            auto original = relative.generic_string();
+            data.files.add(original, relative.replace_extension(".html").string(), ConversionType::from_markdown);
         }
         else if(file.extension() == ".html") {
-            data.files.push_back({file});
+            auto relative = std::filesystem::relative(file, config.root);
+            data.files.add(relative.generic_string(), relative.string(), ConversionType::copy);
         }
     }
 
     // Search for default file, if provided.
     if(!default_file.empty()) {
-        for (auto &&file : data.files) {
-            if(file.original == default_file) {
-                data.default_file_link = &file;
+        for (FileId id : data.files.ids()) {
+            if(data.files.original_path(config.root, id) == default_file) {
+                data.default_file = id;
                 break;
             }
         }
     }
 
-    if(data.files.size() == 0) {
+    if(data.files.empty()) {
         return Error(std::format("Found no files in project root path: \"{}\".", config.root.string()), ErrorType::invalid_argument);
     }
 
     // Look for common files that may be the defalt.
-    if(!data.default_file_link) {
-        data.default_file_link = &data.files.front();
+    if(data.default_file == no_file) {
+        data.default_file = 0;
 
-        for (auto &&file : data.files) {
-            if(file.original.filename() == "Home.md") {
-                data.default_file_link = &file;
+        for (FileId id : data.files.ids()) {
+            auto original = data.files.original(id);
+            if(original == "Home.md" || original.ends_with("/Home.md")) {
+                data.default_file = id;
                 break;
             }
         }
     }
 
+    build_page_lookup(config, data);
+
+    if (config.prune_unreachable) {
+        prune_unreachable_files(config, data, sidebar_path);
+    }
+
     // Custom TOC root
-    if (config.toc_root_item_name.empty()) {
-        data.toc = &data.toc_root;
-    } else {
-        data.toc_root.children.push_back({.name = config.toc_root_item_name, .file_link = nullptr});
-        data.toc = &data.toc_root.children.front();
+    if (!config.toc_root_item_name.empty()) {
+        data.toc_parent = data.toc.add(TableOfContents::root, config.toc_root_item_name);
     }
 
     // TOC from _Sidebar
@@ -80,9 +102,24 @@ ErrorOr<chm::ProjectData> chm::create_project_data_from_ghwiki(const ProjectConf
         if (sidebar_path.empty()) {
             return Error("No _Sidebar.md file found.", ErrorType::invalid_argument);
         }
-        std::printf("TOC will be created from sidebar: %s\n", sidebar_path.c_str());
-        *data.toc = create_toc_entries_from_sidebar(config, data, sidebar_path);
+        log::info("sidebar_toc", "TOC will be created from sidebar: %s", sidebar_path.c_str());
+        data.toc_sidebar = sidebar_path;
     }
 
     return data;
+}
+
+
+
+void chm::build_page_lookup(const ProjectConfig &config, ProjectData &data) {
+    data.page_lookup = {};
+
+    for (FileId id : data.files.ids()) {
+        std::string_view original = data.files.original(id);
+        std::string_view name = original.substr(0, original.rfind('.'));
+
+        // If multiple files match, first one wins.
+        data.page_lookup.paths.try_emplace(std::string(original), id);
+        data.page_lookup.page_names.try_emplace(normalize_page_link(name), id);
+    }
 }
\ No newline at end of file
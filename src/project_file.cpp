@@ -0,0 +1,56 @@
+#include <algorithm>
+#include <numeric>
+
+#include "project_file.hpp"
+
+
+
+chm::FileId chm::ProjectFiles::add(std::string_view original, std::string_view link, ConversionType converter) {
+    FileId id = size();
+
+    StringRef original_ref = intern(original);
+    // Copied files and dependencies keep their path, both refer to the same string.
+    StringRef link_ref = link == original ? original_ref : intern(link);
+
+    originals.push_back(original_ref);
+    links.push_back(link_ref);
+    converters.push_back(converter);
+
+    return id;
+}
+
+
+chm::ProjectFiles::StringRef chm::ProjectFiles::intern(std::string_view text) {
+    StringRef ref = {(std::uint32_t)strings.size(), (std::uint32_t)text.size()};
+    strings += text;
+    return ref;
+}
+
+
+chm::FileId chm::ProjectFiles::find_original(std::string_view original) const {
+    for (FileId id : ids()) {
+        if (this->original(id) == original) {
+            return id;
+        }
+    }
+    return no_file;
+}
+
+
+void chm::ProjectFiles::sort_by_link() {
+    std::vector<FileId> order(size());
+    std::iota(order.begin(), order.end(), FileId(0));
+    std::sort(order.begin(), order.end(), [&](FileId a, FileId b) { return link(a) < link(b); });
+
+    ProjectFiles sorted;
+    for (FileId id : order) {
+        sorted.add(original(id), link(id), converter(id));
+    }
+    *this = std::move(sorted);
+}
+
+
+size_t chm::ProjectFiles::memory_usage() const {
+    return originals.capacity() * sizeof(StringRef) + links.capacity() * sizeof(StringRef)
+         + converters.capacity() * sizeof(ConversionType) + strings.capacity();
+}
@@ -2,20 +2,79 @@
 
 #include <cstdint>
 #include <filesystem>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
 
 namespace chm {
     // github supports more markup formats so potentialy others can be added in the future.
-    enum class ConversionType : std::uint32_t {
+    enum class ConversionType : std::uint8_t {
         none,
         copy,
         from_markdown,
     };
 
-    struct ProjectFile {
-        std::filesystem::path original;                     // Original file
-        std::filesystem::path target;                       // File in temp path, copied or converted from supported format to html. Will be included inside chm.
-        ConversionType converter = ConversionType::none;    // What converter should be used.
+    // Index of a file in ProjectFiles.
+    using FileId = std::uint32_t;
+    constexpr FileId no_file = UINT32_MAX;
+
+    // Project files stored as struct of arrays, files are referenced by index.
+    // Paths are stored once, relative to root and temp path, in one string arena. Full paths are created only when a file is opened.
+    class ProjectFiles {
+    public:
+        // original is relative to root, link is target relative to temp path, computed once and used in all links pointing to this file.
+        FileId add(std::string_view original, std::string_view link, ConversionType converter);
+
+        std::string_view original(FileId id) const { return view(originals[id]); }
+        std::string_view link(FileId id) const { return view(links[id]); }
+        ConversionType converter(FileId id) const { return converters[id]; }
+
+        // Original file
+        std::filesystem::path original_path(const std::filesystem::path &root, FileId id) const { return root / original(id); }
+        // File in temp path, copied or converted from supported format to html. Will be included inside chm.
+        std::filesystem::path target_path(const std::filesystem::path &temp, FileId id) const { return temp / link(id); }
+
+        // Index of file with this original path or no_file, linear search.
+        FileId find_original(std::string_view original) const;
+
+        size_t size() const { return converters.size(); }
+        bool empty() const { return converters.empty(); }
+        auto ids() const { return std::views::iota(FileId(0), FileId(size())); }
+
+        // Keeps only files for which keep(id) returns true, kept files get new ids in the same order.
+        // Returns old id to new id map, removed files map to no_file.
+        template<typename Predicate>
+        std::vector<FileId> filter(Predicate keep) {
+            ProjectFiles kept;
+            std::vector<FileId> new_ids(size(), no_file);
+            for (FileId id : ids()) {
+                if (keep(id)) {
+                    new_ids[id] = kept.add(original(id), link(id), converter(id));
+                }
+            }
+            *this = std::move(kept);
+            return new_ids;
+        }
+
+        // Orders files by link.
+        void sort_by_link();
+
+        // Bytes used by all arrays and the arena.
+        size_t memory_usage() const;
+
+    private:
+        struct StringRef {
+            std::uint32_t offset = 0, size = 0;
+        };
+
+        StringRef intern(std::string_view text);
+        std::string_view view(StringRef ref) const { return std::string_view(strings).substr(ref.offset, ref.size); }
+
+        std::vector<StringRef> originals, links;
+        std::vector<ConversionType> converters;
+        std::string strings;
     };
-}
\ No newline at end of file
+}
@@ -1,11 +1,16 @@
 #include <fstream>
+#include <iomanip>
 
 #include "hh_constants.hpp"
+#include "highlight.hpp"
+#include "metrics.hpp"
 #include "project.hpp"
 
 
 
 void chm::generate_project_files(const ProjectConfig &config, const ProjectData &data) {
+    metrics::StageTimer timer(metrics::Stage::generate);
+
     std::ofstream file_stream;
 
     // .gitignore
@@ -19,7 +24,9 @@ void chm::generate_project_files(const ProjectConfig &config, const ProjectData
 
     // Configured with recomended settings https://www.nongnu.org/chmspec/latest/INI.html#HHP
     file_stream << "[OPTIONS]\n";
-    file_stream << "Auto Index=Yes\n";
+    if (!config.index_generate) {
+        file_stream << "Auto Index=Yes\n";
+    }
     // file_stream << "Auto TOC=Yes\n";
     file_stream << "Binary Index=Yes\n";
     file_stream << "Binary TOC=Yes\n";
@@ -30,18 +37,21 @@ void chm::generate_project_files(const ProjectConfig &config, const ProjectData
 
     file_stream << "Flat=No\n";
     file_stream << "Full-text search=Yes\n";
-    file_stream << "Title=test\n";
+    if (config.index_generate) {
+        file_stream << "Index file=proj.hhk\n";
+    }
+    file_stream << "Title=" << config.title << "\n";
 
     file_stream << "[WINDOWS]\n";
 
-    auto default_file = std::filesystem::relative(data.default_file_link->target, config.temp);
+    auto default_file = std::quoted(data.files.link(data.default_file));
 
     // NOTE: Switching styles sometimes might not work because https://shouldiblamecaching.com/
     // just why?????
     file_stream << "main=";                                                     // Window type
     file_stream << "\"" << config.title << "\",";                                      // Title bar text
     file_stream << "\"" << "proj.hhc" << "\",";                                 // Table of contents .hhc file
-    file_stream << ",";                                                         // Index .hhk file
+    file_stream << (config.index_generate ? "\"proj.hhk\"," : ",");              // Index .hhk file
     file_stream << default_file << ",";                                         // Default html file
     file_stream << default_file << ",";                                         // File shown when home button was pressed
     file_stream << ",,";                                                        // Jump1 button file to open and text
@@ -59,16 +69,8 @@ void chm::generate_project_files(const ProjectConfig &config, const ProjectData
     file_stream << "0\n";                                                       // idk
 
     file_stream << "[FILES]\n";
-    for (auto &&file : data.files) {
-        file_stream << std::filesystem::relative(file.target, config.temp).string() << "\n";
-    }
-
-    for (auto &&file : data.local_dependencies) {
-        file_stream << std::filesystem::relative(file.target, config.temp).string() << "\n";
-    }
-
-    for (auto &&file : data.remote_dependencies) {
-        file_stream << std::filesystem::relative(file.target, config.temp).string() << "\n";
+    for (auto &file : list_compiled_files(config, data)) {
+        file_stream << file.link << "\n";
     }
 
     file_stream.close();
@@ -76,7 +78,64 @@ void chm::generate_project_files(const ProjectConfig &config, const ProjectData
 
     // HTML Help table of Contents .hhc
     file_stream.open(config.temp / "proj.hhc");
-    file_stream << data.toc_root.to_hhc(config.temp);
+    data.toc.write_hhc(file_stream, data.files);
     file_stream.close();
+
+
+    // HTML Help index .hhk
+    if (config.index_generate) {
+        file_stream.open(config.temp / "proj.hhk");
+        if (!data.index_file.empty()) {
+            KeywordIndex::write_hhk(file_stream, data.index_file, data.files);
+        } else {
+            KeywordIndex::write_hhk(file_stream, data.index, data.files);
+        }
+        file_stream.close();
+    }
+}
+
+
+
+std::vector<chm::CompiledFile> chm::list_compiled_files(const ProjectConfig &config, const ProjectData &data, bool source_sizes) {
+    std::vector<CompiledFile> files;
+
+    auto original_size = [&](const std::filesystem::path &path) -> std::uint64_t {
+        if (!source_sizes) {
+            return 0;
+        }
+        std::error_code ec;
+        auto size = std::filesystem::file_size(path, ec);
+        return ec ? 0 : size;
+    };
+
+    for (FileId file : data.files.ids()) {
+        bool converted = data.files.converter(file) == ConversionType::from_markdown;
+        files.push_back({
+            std::string(data.files.link(file)), std::string(data.files.original(file)),
+            converted ? CompiledFile::Origin::page : CompiledFile::Origin::local,
+            original_size(data.files.original_path(config.root, file)),
+        });
+    }
+
+    for (FileId file : data.local_dependencies.ids()) {
+        files.push_back({
+            std::string(data.local_dependencies.link(file)), std::string(data.local_dependencies.original(file)),
+            CompiledFile::Origin::local, original_size(data.local_dependencies.original_path(config.root, file)),
+        });
+    }
+
+    for (auto &&file : data.remote_dependencies) {
+        // Pages link to the original url instead.
+        if (file.state != DownloadState::Finished) {
+            continue;
+        }
+        files.push_back({std::filesystem::relative(file.target, config.temp).string(), file.link, CompiledFile::Origin::remote, file.downloaded_size});
+    }
+
+    if (config.highlight_code) {
+        files.push_back({std::string(highlight_stylesheet_name), {}, CompiledFile::Origin::generated, highlight_stylesheet.size()});
+    }
+
+    return files;
 }
 
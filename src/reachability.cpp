@@ -0,0 +1,165 @@
+#include <chrono>
+#include <fstream>
+#include <iterator>
+
+#include <RUtils/ForEach.hpp>
+
+#include "project.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "url.hpp"
+
+
+
+// Returns link targets found in raw markdown or html, without converting it.
+// Finds [text](target), [[Page]], [[text|Page]], [id]: target and href="target".
+static std::vector<std::string_view> scan_text_for_links(std::string_view text) {
+    std::vector<std::string_view> links;
+
+    auto link_end = [&](size_t start, std::string_view terminators) {
+        size_t end = text.find_first_of(terminators, start);
+        return end == std::string_view::npos ? text.size() : end;
+    };
+
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+
+        if (c == ']' && i + 1 < text.size() && (text[i + 1] == '(' || text[i + 1] == ':')) {
+            size_t start = i + 2;
+            while (start < text.size() && (text[start] == ' ' || text[start] == '\t')) {
+                start++;
+            }
+            if (start < text.size() && text[start] == '<') {
+                start++;
+                size_t end = link_end(start, ">\n");
+                links.push_back(text.substr(start, end - start));
+                i = end;
+            } else {
+                size_t end = link_end(start, " \t\r\n)");
+                links.push_back(text.substr(start, end - start));
+                i = end - 1;
+            }
+        }
+        else if (c == '[' && text.substr(i).starts_with("[[")) {
+            size_t start = i + 2;
+            size_t end = text.find("]]", start);
+            if (end == std::string_view::npos) {
+                break;
+            }
+
+            std::string_view wiki_link = text.substr(start, end - start);
+            if (size_t separator = wiki_link.find('|'); separator != std::string_view::npos) {
+                wiki_link.remove_prefix(separator + 1);
+            }
+            links.push_back(trim_whitespace(wiki_link));
+            i = end + 1;
+        }
+        else if (c == 'h' && text.substr(i).starts_with("href=\"")) {
+            size_t start = i + 6;
+            size_t end = link_end(start, "\"");
+            links.push_back(text.substr(start, end - start));
+            i = end;
+        }
+    }
+
+    return links;
+}
+
+
+std::vector<std::string_view> chm::scan_text_for_page_links(std::string_view text) {
+    std::vector<std::string_view> paths;
+
+    for (auto link : scan_text_for_links(text)) {
+        url::Parts parts = url::split(link);
+        if (parts.kind != url::Kind::page && parts.kind != url::Kind::asset) {
+            continue;
+        }
+        if (auto path = url::local_path(parts); !path.empty()) {
+            paths.push_back(path);
+        }
+    }
+
+    return paths;
+}
+
+
+void chm::prune_unreachable_files(const ProjectConfig &config, ProjectData &data, const std::filesystem::path &sidebar_path) {
+    auto start_time = std::chrono::steady_clock::now();
+
+    std::vector<bool> reachable(data.files.size());
+
+    // Pages found in every step of the search, all pages in a step are scanned concurrently.
+    std::vector<FileId> frontier;
+
+    auto visit = [&](FileId file) {
+        if (file != no_file && !reachable[file]) {
+            reachable[file] = true;
+            frontier.push_back(file);
+        }
+    };
+
+    auto scan_file = [&](const std::filesystem::path &path) {
+        std::ifstream file(path, std::ios::binary);
+        std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        std::vector<FileId> found;
+        for (auto page_path : scan_text_for_page_links(text)) {
+            found.push_back(find_page(data, page_path));
+        }
+        return found;
+    };
+
+    // Search starts from default page, sidebar and github wiki header and footer that are shown on every page.
+    visit(data.default_file);
+    if (!sidebar_path.empty()) {
+        for (auto file : scan_file(sidebar_path)) {
+            visit(file);
+        }
+    }
+    for (FileId id : data.files.ids()) {
+        auto name = std::filesystem::path(data.files.original(id)).filename();
+        if (name == "_Footer.md" || name == "_Header.md") {
+            visit(id);
+        }
+    }
+
+    while (!frontier.empty()) {
+        std::vector<std::pair<FileId, std::vector<FileId>>> step;
+        for (auto file : frontier) {
+            step.push_back({file, {}});
+        }
+        frontier.clear();
+
+        RUtils::for_each_threaded(step.begin(), step.end(), [&](auto &item) {
+            item.second = scan_file(data.files.original_path(config.root, item.first));
+        }, config.max_jobs);
+
+        for (auto &item : step) {
+            for (auto file : item.second) {
+                visit(file);
+            }
+        }
+    }
+
+    auto new_ids = data.files.filter([&](FileId id) {
+        if (reachable[id]) {
+            return true;
+        }
+
+        std::error_code ec;
+        auto size = std::filesystem::file_size(data.files.original_path(config.root, id), ec);
+
+        data.pruned_count++;
+        data.pruned_bytes += ec ? 0 : size;
+        log::detail("page_pruned", "Pruned unreachable page: %.*s", (int)data.files.original(id).size(), data.files.original(id).data());
+        return false;
+    });
+
+    // Ids of files changed, find them again.
+    build_page_lookup(config, data);
+    data.default_file = new_ids[data.default_file];
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time);
+    log::info("pages_pruned", "Pruned %zu of %zu pages (%.1f KiB of sources), link scan took %.1f ms.",
+        data.pruned_count, data.pruned_count + data.files.size(), data.pruned_bytes / 1024.0, elapsed.count());
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <string>
+#include <vector>
+
+#include "project_file.hpp"
 
 
 
@@ -11,11 +15,16 @@ namespace chm {
         InProgress,
         Finished,
         Failed,
+        Skipped,    // Not downloaded because of download limits, see ProjectConfig::dep_download_*
     };
 
     struct RemoteDependency {
         std::string link;
         std::filesystem::path target;
         DownloadState state = DownloadState::NotStarted;
+        std::uint32_t attempts = 0;
+        std::string error;                                  // Why download failed or was skipped
+        std::uint64_t downloaded_size = 0;                  // Before the image was optimized
+        std::vector<FileId> referenced_by;                  // Pages that link to it, updated if download doesn't finish
     };
 }
\ No newline at end of file
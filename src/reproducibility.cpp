@@ -0,0 +1,210 @@
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+
+#include "reproducibility.hpp"
+#include "chm_archive.hpp"
+#include "helpers.hpp"
+
+
+
+static void write_u64_le(std::string &data, size_t pos, std::uint64_t value) {
+    for (size_t i = 0; i < 8; i++) {
+        data[pos + i] = (char)(value >> (i * 8));
+    }
+}
+
+
+// Offset of uncompressed file in the chm or 0 if not found.
+static size_t find_uncompressed_file(std::string_view chm, std::string_view name) {
+    auto directory = chm::read_chm_directory(chm);
+    if (!directory) {
+        return 0;
+    }
+
+    for (auto &entry : directory->entries) {
+        if (entry.name == name) {
+            return entry.section == 0 ? directory->content_offset + entry.offset : 0;
+        }
+    }
+    return 0;
+}
+
+
+bool chm::normalize_chm_timestamps(const std::filesystem::path &chm_file) {
+    std::string chm;
+    {
+        std::ifstream file(chm_file, std::ios::binary);
+        chm.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    std::int64_t epoch = 0;
+    if (const char* source_date_epoch = std::getenv("SOURCE_DATE_EPOCH")) {
+        epoch = std::strtoll(source_date_epoch, nullptr, 10);
+    }
+
+    size_t system_offset = find_uncompressed_file(chm, "#SYSTEM");
+    if (!system_offset || system_offset + 4 > chm.size()) {
+        return false;
+    }
+
+    // Header timestamp, it is not used by viewers.
+    chm[0x10] = chm[0x11] = chm[0x12] = chm[0x13] = 0;
+
+    // #SYSTEM is a version followed by entries of code, size and data. Entry 4 has FILETIME after 5 DWORDs.
+    for (size_t pos = system_offset + 4; pos + 4 <= chm.size();) {
+        std::uint16_t code = (std::uint8_t)chm[pos] | (std::uint8_t)chm[pos + 1] << 8;
+        std::uint16_t size = (std::uint8_t)chm[pos + 2] | (std::uint8_t)chm[pos + 3] << 8;
+        pos += 4;
+
+        if (code == 4 && size >= 28 && pos + 28 <= chm.size()) {
+            // FILETIME counts 100 ns intervals since 1601
+            write_u64_le(chm, pos + 20, (std::uint64_t)(epoch + 11644473600) * 10000000);
+            break;
+        }
+        pos += size;
+    }
+
+    std::ofstream file(chm_file, std::ios::binary);
+    file.write(chm.data(), chm.size());
+    return (bool)file;
+}
+
+
+
+static std::uint64_t hash_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    std::uint64_t hash = fnv1a_64({});
+
+    char buffer[64 * 1024];
+    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
+        hash = fnv1a_64(std::string_view(buffer, file.gcount()), hash);
+    }
+    return hash;
+}
+
+// Calls callback with every file in temp path that ends up in the chm.
+template<typename Callback>
+static void for_each_build_file(const chm::ProjectConfig &config, Callback &&callback) {
+    for (auto it = std::filesystem::recursive_directory_iterator(config.temp); it != std::filesystem::recursive_directory_iterator(); ++it) {
+        // Caches and manifests, they don't end up in the chm.
+        if (it->path().filename().string().starts_with('.')) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (it->is_regular_file()) {
+            callback(*it, std::filesystem::relative(it->path(), config.temp).generic_string());
+        }
+    }
+}
+
+chm::BuildSnapshot chm::snapshot_build_output(const ProjectConfig &config) {
+    BuildSnapshot snapshot;
+
+    for_each_build_file(config, [&](const std::filesystem::directory_entry &entry, std::string relative) {
+        snapshot[std::move(relative)] = hash_file(entry.path());
+    });
+
+    if (std::filesystem::exists(config.out_file)) {
+        snapshot[std::filesystem::relative(config.out_file, config.temp).generic_string()] = hash_file(config.out_file);
+    }
+
+    return snapshot;
+}
+
+std::vector<std::string> chm::compare_build_snapshots(const BuildSnapshot &first, const BuildSnapshot &second) {
+    std::vector<std::string> differences;
+
+    for (auto &[path, hash] : first) {
+        auto it = second.find(path);
+        if (it == second.end()) {
+            differences.push_back(path + " (missing in second build)");
+        } else if (it->second != hash) {
+            differences.push_back(path);
+        }
+    }
+    for (auto &[path, hash] : second) {
+        if (!first.contains(path)) {
+            differences.push_back(path + " (missing in first build)");
+        }
+    }
+
+    return differences;
+}
+
+
+chm::CompileManifest chm::stamp_build_output(const ProjectConfig &config, const CompileManifest &previous) {
+    CompileManifest manifest;
+
+    auto stamp = [](const std::filesystem::directory_entry &entry) {
+        FileStamp stamp;
+        std::error_code ec;
+        stamp.size = entry.file_size(ec);
+        stamp.modified = entry.last_write_time(ec).time_since_epoch().count();
+        return stamp;
+    };
+
+    for_each_build_file(config, [&](const std::filesystem::directory_entry &entry, std::string relative) {
+        FileStamp current = stamp(entry);
+        auto it = previous.find(relative);
+        if (it != previous.end() && it->second.size == current.size && it->second.modified == current.modified) {
+            current.hash = it->second.hash;
+        } else {
+            current.hash = hash_file(entry.path());
+        }
+        manifest[std::move(relative)] = current;
+    });
+
+    // Compiled chm is only written by the compiler, so a file that wasn't modified is the one compiled last time.
+    if (std::filesystem::directory_entry out_file(config.out_file); out_file.exists()) {
+        FileStamp current = stamp(out_file);
+        std::uint64_t values[2] = {current.size, (std::uint64_t)current.modified};
+        current.hash = fnv1a_64(std::string_view((const char*)values, sizeof(values)));
+        manifest[std::filesystem::relative(config.out_file, config.temp).generic_string()] = current;
+    }
+
+    return manifest;
+}
+
+std::vector<std::string> chm::compare_compile_manifests(const CompileManifest &previous, const CompileManifest &current) {
+    std::vector<std::string> differences;
+
+    for (auto &[path, stamp] : previous) {
+        auto it = current.find(path);
+        if (it == current.end()) {
+            differences.push_back(path + " (removed)");
+        } else if (it->second.hash != stamp.hash) {
+            differences.push_back(path);
+        }
+    }
+    for (auto &[path, stamp] : current) {
+        if (!previous.contains(path)) {
+            differences.push_back(path + " (added)");
+        }
+    }
+
+    return differences;
+}
+
+
+chm::CompileManifest chm::read_compile_manifest(const std::filesystem::path &path) {
+    CompileManifest manifest;
+    std::ifstream file(path);
+
+    FileStamp stamp;
+    std::string relative;
+    while (file >> std::hex >> stamp.hash >> std::dec >> stamp.size >> stamp.modified && file.get() == ' ' && std::getline(file, relative)) {
+        manifest[relative] = stamp;
+    }
+
+    return manifest;
+}
+
+void chm::write_compile_manifest(const std::filesystem::path &path, const CompileManifest &manifest) {
+    std::ofstream file(path);
+    for (auto &[relative, stamp] : manifest) {
+        char hash[17];
+        std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)stamp.hash);
+        file << hash << " " << stamp.size << " " << stamp.modified << " " << relative << "\n";
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "project.hpp"
+
+
+
+namespace chm {
+    // Chm compilers store the time of compilation in the file header and in #SYSTEM file,
+    // they are replaced with SOURCE_DATE_EPOCH environment variable or 0, so the same project always compiles to the same bytes.
+    bool normalize_chm_timestamps(const std::filesystem::path &chm_file);
+
+    // Hash of compiled chm and of every file in temp path, keyed by path relative to temp. Hidden caches are skipped.
+    using BuildSnapshot = std::map<std::string, std::uint64_t>;
+    BuildSnapshot snapshot_build_output(const ProjectConfig &config);
+    // Paths that have different contents or exist in only one of the snapshots.
+    std::vector<std::string> compare_build_snapshots(const BuildSnapshot &first, const BuildSnapshot &second);
+
+    // Size, modification time and hash of the same files, compile_project() uses it to find out if anything changed.
+    struct FileStamp {
+        std::uint64_t size = 0;
+        std::int64_t modified = 0;
+        std::uint64_t hash = 0;     // Compiled chm isn't read, its hash is made from size and modification time
+    };
+    using CompileManifest = std::map<std::string, FileStamp>;
+    // Files with the same size and modification time as in previous aren't read again, their hash is taken from previous.
+    CompileManifest stamp_build_output(const ProjectConfig &config, const CompileManifest &previous);
+    // Paths that have different hashes or exist in only one of the manifests.
+    std::vector<std::string> compare_compile_manifests(const CompileManifest &previous, const CompileManifest &current);
+    // Empty manifest if the file doesn't exist.
+    CompileManifest read_compile_manifest(const std::filesystem::path &path);
+    void write_compile_manifest(const std::filesystem::path &path, const CompileManifest &manifest);
+}
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "request_runner.hpp"
+#include "url.hpp"
+
+
+
+void chm::RequestRunner::add(size_t request, std::string_view url) {
+    queue.push_back({request, std::string(url::split(url).host)});
+}
+
+
+size_t chm::RequestRunner::slot_count() const {
+    return std::min<size_t>(options.max_requests, queue.size());
+}
+
+
+bool chm::RequestRunner::run(const Handlers &handlers) {
+    if (queue.empty()) {
+        return true;
+    }
+
+    controller.emplace(slot_count(), options.controller_log);
+
+    // Jitter spreads retries, so requests that failed together don't hit the server together again.
+    std::minstd_rand random(std::random_device{}());
+    auto retry_delay = [&](std::uint32_t attempt) {
+        std::uniform_real_distribution<double> jitter(0.5, 1.5);
+        auto base = std::chrono::milliseconds(500) * (1 << std::min(attempt - 1, 5u));
+        return std::chrono::duration_cast<Clock::duration>(base * jitter(random));
+    };
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    CURLM* multi_handle = curl_multi_init();
+
+    struct Slot {
+        CURL* handle;
+        Pending request;
+        bool active = false;
+    };
+    std::vector<Slot> slots(slot_count());
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].handle = curl_easy_init();
+        handlers.configure(slots[i].handle, i);
+    }
+
+    auto attempt_of = [&](size_t i) {
+        return RequestAttempt{slots[i].handle, i, slots[i].request.request, slots[i].request.attempts};
+    };
+
+    bool in_time = true;
+    int running_handles = 0;
+
+    do {
+        auto now = Clock::now();
+
+        if (now >= options.deadline) {
+            for (auto &slot : slots) {
+                if (slot.active) {
+                    curl_multi_remove_handle(multi_handle, slot.handle);
+                    controller->failed(slot.request.host);
+                    slot.active = false;
+                    handlers.expired(slot.request.request);
+                }
+            }
+            for (auto &pending : queue) {
+                handlers.expired(pending.request);
+            }
+            queue.clear();
+            in_time = false;
+            break;
+        }
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].active) {
+                continue;
+            }
+
+            auto ready = std::find_if(queue.begin(), queue.end(), [&](const Pending &pending) {
+                return pending.not_before <= now && controller->can_start(pending.host, now);
+            });
+            if (ready == queue.end()) {
+                break;
+            }
+
+            slots[i].request = std::move(*ready);
+            slots[i].request.attempts++;
+            slots[i].active = true;
+            queue.erase(ready);
+
+            controller->started(slots[i].request.host);
+            handlers.start(attempt_of(i));
+            curl_multi_add_handle(multi_handle, slots[i].handle);
+            running_handles++;
+        }
+
+        curl_multi_perform(multi_handle, &running_handles);
+        controller->update(Clock::now());
+
+        int msgs_in_queue = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi_handle, &msgs_in_queue)) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            auto slot = std::find_if(slots.begin(), slots.end(), [&](const Slot &slot) { return slot.active && slot.handle == msg->easy_handle; });
+            if (slot == slots.end()) {
+                continue;
+            }
+            curl_multi_remove_handle(multi_handle, slot->handle);
+
+            RequestResult result = {msg->data.result, 0, false, false};
+            curl_easy_getinfo(slot->handle, CURLINFO_RESPONSE_CODE, &result.status);
+            result.throttled = result.status == 429 || result.status == 503;
+            result.can_retry = slot->request.attempts <= options.retries + (result.throttled ? options.throttled_retries : 0);
+
+            auto &host = slot->request.host;
+            RequestAction action = handlers.finished(attempt_of(slot - slots.begin()), result);
+
+            if (action == RequestAction::restart) {
+                curl_multi_add_handle(multi_handle, slot->handle);
+                running_handles++;
+                continue;
+            }
+            slot->active = false;
+
+            if (action == RequestAction::done) {
+                curl_off_t latency_us = 0;
+                curl_easy_getinfo(slot->handle, CURLINFO_STARTTRANSFER_TIME_T, &latency_us);
+                controller->succeeded(host, latency_us / 1e6, Clock::now());
+                continue;
+            }
+
+            auto retry_at = Clock::now() + retry_delay(slot->request.attempts);
+            if (result.throttled) {
+                curl_off_t retry_after = 0;
+                curl_easy_getinfo(slot->handle, CURLINFO_RETRY_AFTER, &retry_after);
+                controller->throttled(host, std::clamp<curl_off_t>(retry_after, 0, 3600), Clock::now());
+                retry_at = std::max(retry_at, controller->blocked_until(host));
+            } else {
+                controller->failed(host);
+            }
+
+            if (action == RequestAction::retry && result.can_retry) {
+                slot->request.not_before = retry_at;
+                queue.push_back(std::move(slot->request));
+                retries++;
+            }
+        }
+
+        // Wake up for the next retry or the deadline, even if nothing is running.
+        int timeout_ms = 1000;
+        auto wake_up_at = [&](Clock::time_point time) {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(time - Clock::now()).count();
+            timeout_ms = (int)std::clamp<long long>(wait, 0, timeout_ms);
+        };
+        for (auto &pending : queue) {
+            wake_up_at(std::max(pending.not_before, controller->blocked_until(pending.host)));
+        }
+        wake_up_at(options.deadline);
+
+        int fds;
+        curl_multi_poll(multi_handle, nullptr, 0, timeout_ms, &fds);
+    } while (running_handles || !queue.empty());
+
+    for (auto &slot : slots) {
+        curl_easy_cleanup(slot.handle);
+    }
+    curl_multi_cleanup(multi_handle);
+
+    return in_time;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#define NOMINMAX // See download_deps.cpp
+#include "curl/curl.h"
+
+#include "download_controller.hpp"
+
+
+
+namespace chm {
+    // One attempt of a request on one of the runner's handles.
+    struct RequestAttempt {
+        CURL* handle;
+        size_t slot;                // Index of the handle, less than RequestRunner::slot_count()
+        size_t request;             // Index given to RequestRunner::add()
+        std::uint32_t attempt;      // 1 for the first one
+    };
+
+    // How an attempt ended.
+    struct RequestResult {
+        CURLcode result;
+        long status;                // HTTP status, 0 if there was no response
+        bool throttled;             // Server asked to slow down (429, 503)
+        bool can_retry;             // Attempts are left, finished() may return RequestAction::retry only if set
+    };
+
+    enum class RequestAction {
+        done,           // Request finished and the host worked
+        failed,         // Request finished and the host failed
+        retry,          // Try again after a backoff, or after the time a throttling server asked for
+        restart,        // Add the handle again right away with whatever finished() changed on it, it's the same attempt
+    };
+
+    // Runs queued requests with curl multi. DownloadController decides how many of them run at once, in total and for
+    // every host, failed ones are retried with exponential backoff. Dependency downloads and link checks both use it.
+    class RequestRunner {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        struct Options {
+            std::uint32_t max_requests = 1;                         // Upper limit, controller adjusts actual number
+            std::uint32_t retries = 0;                              // Attempts after the first one
+            std::uint32_t throttled_retries = 0;                    // More retries for requests a server throttled
+            Clock::time_point deadline = Clock::time_point::max();  // Requests that didn't finish by then expire
+            std::FILE* controller_log = nullptr;                    // See DownloadController
+        };
+
+        struct Handlers {
+            std::function<void(CURL *handle, size_t slot)> configure;                               // Once for every handle
+            std::function<void(const RequestAttempt &attempt)> start;                               // Before every attempt, sets url
+            std::function<RequestAction(const RequestAttempt &attempt, const RequestResult &result)> finished;
+            std::function<void(size_t request)> expired;                                            // Deadline passed first
+        };
+
+        explicit RequestRunner(const Options &options) : options(options) {}
+
+        void add(size_t request, std::string_view url);
+        size_t queued() const { return queue.size(); }
+        // Number of handles run() will use.
+        size_t slot_count() const;
+
+        // Returns when every request finished, false if the deadline passed before that.
+        bool run(const Handlers &handlers);
+
+        // Bytes received by a running request, controller adjusts limits from throughput.
+        void received(size_t bytes) { controller->received(bytes); }
+        size_t retry_count() const { return retries; }
+
+    private:
+        // Waiting for a free handle, retries wait here until their backoff passes.
+        struct Pending {
+            size_t request;
+            std::string host;
+            std::uint32_t attempts = 0;
+            Clock::time_point not_before;
+        };
+
+        Options options;
+        std::deque<Pending> queue;
+        std::optional<DownloadController> controller;
+        size_t retries = 0;
+    };
+}
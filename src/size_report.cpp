@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <map>
+
+#include <RUtils/ForEach.hpp>
+
+#ifdef GHWIKI2CHM_ZLIB
+#include <zlib.h>
+#endif
+
+#include "size_report.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "url.hpp"
+
+
+
+struct FileSizes {
+    const chm::CompiledFile *file;
+    std::uint64_t output_size = 0;
+    std::uint64_t compressed_size = 0;
+};
+
+struct GroupSizes {
+    std::string name;
+    size_t count = 0;
+    std::uint64_t source_size = 0, output_size = 0, compressed_size = 0;
+
+    void add(const FileSizes &sizes) {
+        count++;
+        source_size += sizes.file->source_size;
+        output_size += sizes.output_size;
+        compressed_size += sizes.compressed_size;
+    }
+};
+
+
+// Big files are estimated from samples spread over the whole file, they are compressed separately
+// like chm compressor resets its window every few blocks.
+constexpr size_t sample_size = 64 * 1024;
+constexpr size_t max_samples = 16;
+
+static std::uint64_t estimate_compressed_size(const std::filesystem::path &path, std::uint64_t size) {
+    #ifdef GHWIKI2CHM_ZLIB
+    if (size == 0) {
+        return 0;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    size_t samples = std::min<std::uint64_t>(max_samples, (size + sample_size - 1) / sample_size);
+    std::uint64_t sampled = 0, compressed = 0;
+
+    std::string in(sample_size, '\0');
+    std::string out(compressBound(sample_size), '\0');
+
+    for (size_t i = 0; i < samples; i++) {
+        file.seekg(samples == 1 ? 0 : (size - sample_size) * i / (samples - 1));
+        file.read(in.data(), sample_size);
+        if (file.gcount() <= 0) {
+            break;
+        }
+
+        uLongf out_size = out.size();
+        if (compress2((Bytef*)out.data(), &out_size, (const Bytef*)in.data(), file.gcount(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+            return size;
+        }
+        sampled += file.gcount();
+        compressed += std::min<std::uint64_t>(out_size, file.gcount());
+        file.clear();
+    }
+
+    return sampled ? size * compressed / sampled : size;
+    #else
+    (void)path;
+    return size;
+    #endif
+}
+
+
+static std::string format_size(std::uint64_t bytes) {
+    char text[32];
+    if (bytes >= 1024 * 1024) {
+        std::snprintf(text, sizeof(text), "%.1f MiB", bytes / (1024.0 * 1024.0));
+    } else {
+        std::snprintf(text, sizeof(text), "%.1f KiB", bytes / 1024.0);
+    }
+    return text;
+}
+
+static std::string_view origin_name(chm::CompiledFile::Origin origin) {
+    switch (origin) {
+    case chm::CompiledFile::Origin::page: return "page";
+    case chm::CompiledFile::Origin::local: return "local";
+    case chm::CompiledFile::Origin::remote: return "remote";
+    case chm::CompiledFile::Origin::generated: return "generated";
+    }
+    return {};
+}
+
+
+// Biggest compressed first, same sizes by name, so reports of the same build are identical.
+template<typename T, typename Name>
+static void sort_by_compressed_size(std::vector<T> &items, Name &&name) {
+    std::sort(items.begin(), items.end(), [&](const T &a, const T &b) {
+        if (a.compressed_size != b.compressed_size) {
+            return a.compressed_size > b.compressed_size;
+        }
+        return name(a) < name(b);
+    });
+}
+
+template<typename GroupName>
+static std::vector<GroupSizes> group_by(const std::vector<FileSizes> &files, GroupName &&group_name) {
+    std::map<std::string, GroupSizes> groups;
+    for (auto &sizes : files) {
+        auto name = group_name(*sizes.file);
+        auto &group = groups[name];
+        group.name = name;
+        group.add(sizes);
+    }
+
+    std::vector<GroupSizes> sorted;
+    for (auto &[name, group] : groups) {
+        sorted.push_back(std::move(group));
+    }
+    sort_by_compressed_size(sorted, [](const GroupSizes &group) -> const std::string& { return group.name; });
+    return sorted;
+}
+
+
+
+bool chm::write_size_report(const ProjectConfig &config, const ProjectData &data, const std::filesystem::path &json_path) {
+    auto compiled_files = list_compiled_files(config, data, true);
+
+    std::vector<FileSizes> files;
+    files.reserve(compiled_files.size());
+    for (auto &file : compiled_files) {
+        files.push_back({&file});
+    }
+
+    RUtils::for_each_threaded(files.begin(), files.end(), [&](FileSizes &sizes) {
+        auto path = config.temp / sizes.file->link;
+        std::error_code ec;
+        sizes.output_size = std::filesystem::file_size(path, ec);
+        if (ec) {
+            sizes.output_size = 0;
+        }
+        sizes.compressed_size = estimate_compressed_size(path, sizes.output_size);
+    }, config.max_jobs);
+
+    sort_by_compressed_size(files, [](const FileSizes &sizes) -> const std::string& { return sizes.file->link; });
+
+    auto directories = group_by(files, [](const CompiledFile &file) {
+        auto directory = std::filesystem::path(file.link).parent_path().generic_string();
+        return directory.empty() ? std::string(".") : directory;
+    });
+    // Remote files are grouped by host they were downloaded from.
+    auto origins = group_by(files, [](const CompiledFile &file) {
+        std::string name(origin_name(file.origin));
+        if (file.origin == CompiledFile::Origin::remote) {
+            name += ' ';
+            name += url::split(file.source).host;
+        }
+        return name;
+    });
+
+    GroupSizes total;
+    for (auto &sizes : files) {
+        total.add(sizes);
+    }
+
+
+    std::string json = "{\n";
+    #ifdef GHWIKI2CHM_ZLIB
+    json += "\"compressed_sizes_estimated\": true,\n";
+    #else
+    json += "\"compressed_sizes_estimated\": false,\n";
+    #endif
+
+    auto append_sizes = [&](std::uint64_t source_size, std::uint64_t output_size, std::uint64_t compressed_size) {
+        json += ", \"source_bytes\": " + std::to_string(source_size);
+        json += ", \"output_bytes\": " + std::to_string(output_size);
+        json += ", \"compressed_bytes\": " + std::to_string(compressed_size);
+    };
+    auto append_groups = [&](std::string_view key, const std::vector<GroupSizes> &groups) {
+        json += '"';
+        json += key;
+        json += "\": [\n";
+        for (size_t i = 0; i < groups.size(); i++) {
+            json += "  {\"name\": ";
+            append_json_string(json, groups[i].name);
+            json += ", \"files\": " + std::to_string(groups[i].count);
+            append_sizes(groups[i].source_size, groups[i].output_size, groups[i].compressed_size);
+            json += i + 1 < groups.size() ? "},\n" : "}\n";
+        }
+        json += "]";
+    };
+
+    json += "\"total\": {\"files\": " + std::to_string(total.count);
+    append_sizes(total.source_size, total.output_size, total.compressed_size);
+    json += "},\n\"files\": [\n";
+    for (size_t i = 0; i < files.size(); i++) {
+        auto &file = *files[i].file;
+        json += "  {\"path\": ";
+        append_json_string(json, file.link);
+        json += ", \"source\": ";
+        append_json_string(json, file.source);
+        json += ", \"origin\": ";
+        append_json_string(json, origin_name(file.origin));
+        append_sizes(file.source_size, files[i].output_size, files[i].compressed_size);
+        json += i + 1 < files.size() ? "},\n" : "}\n";
+    }
+    json += "],\n";
+    append_groups("directories", directories);
+    json += ",\n";
+    append_groups("origins", origins);
+    json += "\n}\n";
+
+    std::ofstream json_file(json_path, std::ios::binary);
+    json_file << json;
+    json_file.close();
+    if (!json_file) {
+        log::error("size_report_failed", "Failed to write size report: %s", json_path.string().c_str());
+        return false;
+    }
+
+
+    constexpr size_t summary_rows = 20;
+    auto print_row = [](std::uint64_t compressed_size, std::uint64_t output_size, std::uint64_t source_size, std::string_view name) {
+        log::info("size_report_row", "  %12s %12s %12s  %.*s", format_size(compressed_size).c_str(), format_size(output_size).c_str(),
+            format_size(source_size).c_str(), (int)name.size(), name.data());
+    };
+    auto print_groups = [&](const char *title, const std::vector<GroupSizes> &groups) {
+        log::info("size_report_title", "%s:", title);
+        for (size_t i = 0; i < groups.size() && i < summary_rows; i++) {
+            print_row(groups[i].compressed_size, groups[i].output_size, groups[i].source_size, std::format("{} ({} files)", groups[i].name, groups[i].count));
+        }
+    };
+
+    log::info("size_report_written", "Size report of %zu files written to %s.", total.count, json_path.string().c_str());
+    #ifndef GHWIKI2CHM_ZLIB
+    log::warning("size_report_without_zlib", "Built without zlib, compressed sizes are the same as output sizes.");
+    #endif
+    log::info("size_report_header", "  %12s %12s %12s", "compressed", "output", "source");
+
+    log::info("size_report_title", "Biggest files:");
+    for (size_t i = 0; i < files.size() && i < summary_rows; i++) {
+        print_row(files[i].compressed_size, files[i].output_size, files[i].file->source_size, files[i].file->link);
+    }
+    print_groups("Biggest directories", directories);
+    print_groups("By origin", origins);
+    print_row(total.compressed_size, total.output_size, total.source_size, "total");
+
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <filesystem>
+
+#include "project.hpp"
+
+
+
+namespace chm {
+    // Writes sizes of every file compiled into the chm into a json file and prints the biggest files, directories and origins.
+    // Run after generate_project_files(), compressed size is estimated by deflating files, or samples of big files.
+    bool write_size_report(const ProjectConfig &config, const ProjectData &data, const std::filesystem::path &json_path);
+}
@@ -0,0 +1,239 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <unordered_map>
+
+#include <RUtils/ForEach.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "project.hpp"
+#include "helpers.hpp"
+#include "staging.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+
+
+#ifdef __linux__
+// Copy on write clone, only supported by some filesystems like btrfs or xfs.
+static bool try_reflink(const std::filesystem::path &from, const std::filesystem::path &to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = ioctl(out, FICLONE, in) == 0;
+
+    close(in);
+    close(out);
+
+    if (!ok) {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+
+// Copy inside the kernel, filesystems may still share extents or do a server side copy.
+static bool try_copy_file_range(const std::filesystem::path &from, const std::filesystem::path &to) {
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+
+    struct stat in_stat;
+    if (fstat(in, &in_stat) != 0) {
+        close(in);
+        return false;
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool ok = true;
+    off_t remaining = in_stat.st_size;
+
+    while (remaining > 0) {
+        ssize_t copied = copy_file_range(in, nullptr, out, nullptr, remaining, 0);
+        if (copied <= 0) {
+            ok = false;
+            break;
+        }
+        remaining -= copied;
+    }
+
+    close(in);
+    close(out);
+
+    if (!ok) {
+        unlink(to.c_str());
+    }
+    return ok;
+}
+#endif
+
+
+chm::StageMethod chm::stage_file(const std::filesystem::path &from, const std::filesystem::path &to, bool allow_hardlink) {
+    std::error_code ec;
+
+    // Never write into existing target, it may be a hardlink to the original file.
+    std::filesystem::remove(to, ec);
+
+    #ifdef __linux__
+    if (try_reflink(from, to)) {
+        return chm::StageMethod::reflink;
+    }
+    #endif
+
+    if (allow_hardlink) {
+        std::filesystem::create_hard_link(from, to, ec);
+        if (!ec) {
+            return chm::StageMethod::hardlink;
+        }
+    }
+
+    #ifdef __linux__
+    if (try_copy_file_range(from, to)) {
+        return chm::StageMethod::copy_file_range;
+    }
+    #endif
+
+    if (std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec)) {
+        return chm::StageMethod::copy;
+    }
+
+    return chm::StageMethod::failed;
+}
+
+
+
+// Manifest remembers size and modification time of every staged file.
+// If they didn't change since the previous run, file is not staged again.
+struct ManifestEntry {
+    std::uintmax_t size = 0;
+    std::int64_t mtime = 0;
+};
+
+static std::unordered_map<std::string, ManifestEntry> read_manifest(const std::filesystem::path &path) {
+    std::unordered_map<std::string, ManifestEntry> manifest;
+    std::ifstream file(path);
+
+    ManifestEntry entry;
+    std::string original;
+    while (file >> entry.size >> entry.mtime && file.get() == ' ' && std::getline(file, original)) {
+        manifest[original] = entry;
+    }
+
+    return manifest;
+}
+
+
+void chm::stage_project_files(const ProjectConfig &config, ProjectData &data) {
+    metrics::StageTimer timer(metrics::Stage::stage);
+
+    struct StageJob {
+        const ProjectFiles *files;
+        FileId file;
+        ManifestEntry source;
+        bool staged = false;
+    };
+
+    std::vector<StageJob> jobs;
+    for (FileId file : data.files.ids()) {
+        if (data.files.converter(file) == ConversionType::copy) {
+            jobs.push_back({&data.files, file});
+        }
+    }
+    for (FileId file : data.local_dependencies.ids()) {
+        jobs.push_back({&data.local_dependencies, file});
+    }
+
+    if (jobs.empty()) {
+        return;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    auto manifest_path = config.temp / ".staging_manifest";
+    auto manifest = read_manifest(manifest_path);
+
+    std::atomic<size_t> method_counts[(size_t)StageMethod::count] = {};
+    std::atomic<size_t> up_to_date_count = 0;
+
+    log::progress_begin("stage", jobs.size());
+    RUtils::for_each_threaded(jobs.begin(), jobs.end(), [&](StageJob &job) {
+        log::ProgressItem progress;
+        // Full paths are only needed here, they aren't kept.
+        auto original = job.files->original_path(config.root, job.file);
+        auto target = job.files->target_path(config.temp, job.file);
+
+        // Existing target is replaced, which must never happen to a file outside of temp path.
+        if (!is_path_inside(target, config.temp)) {
+            log::error("stage_outside_temp", "Not staging file outside of temp path: %s", target.string().c_str());
+            return;
+        }
+
+        std::error_code ec;
+        job.source.size = std::filesystem::file_size(original, ec);
+        job.source.mtime = std::filesystem::last_write_time(original, ec).time_since_epoch().count();
+        if (ec) {
+            log::error("stage_failed", "Failed to stage file: %s: %s", original.string().c_str(), ec.message().c_str());
+            return;
+        }
+
+        if (auto it = manifest.find(original.string()); it != manifest.end()) {
+            if (it->second.size == job.source.size && it->second.mtime == job.source.mtime && std::filesystem::exists(target, ec)) {
+                job.staged = true;
+                up_to_date_count++;
+                return;
+            }
+        }
+
+        std::filesystem::create_directories(std::filesystem::absolute(target).remove_filename(), ec);
+
+        StageMethod method = stage_file(original, target);
+        method_counts[(size_t)method]++;
+
+        if (method == StageMethod::failed) {
+            log::error("stage_failed", "Failed to stage file: %s", original.string().c_str());
+            return;
+        }
+
+        metrics::add_stage_bytes(metrics::Stage::stage, job.source.size, job.source.size);
+        job.staged = true;
+    }, config.max_jobs);
+
+    metrics::add_cache_lookups(metrics::Cache::staging, up_to_date_count, jobs.size() - up_to_date_count);
+
+
+    std::ofstream manifest_file(manifest_path);
+    for (auto &job : jobs) {
+        if (job.staged) {
+            manifest_file << job.source.size << " " << job.source.mtime << " " << job.files->original_path(config.root, job.file).string() << "\n";
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time);
+    log::info("files_staged", "Staged %zu files in %.1f ms: %zu up to date, %zu reflinked, %zu hardlinked, %zu copied in kernel, %zu copied, %zu failed.",
+        jobs.size(), elapsed.count(), up_to_date_count.load(),
+        method_counts[(size_t)StageMethod::reflink].load(),
+        method_counts[(size_t)StageMethod::hardlink].load(),
+        method_counts[(size_t)StageMethod::copy_file_range].load(),
+        method_counts[(size_t)StageMethod::copy].load(),
+        method_counts[(size_t)StageMethod::failed].load());
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <filesystem>
+
+
+
+namespace chm {
+    enum class StageMethod {
+        reflink,            // Copy on write clone
+        hardlink,
+        copy_file_range,    // Copy inside kernel
+        copy,
+        failed,
+        count,
+    };
+
+    // Makes `to` a copy of `from` as cheaply as filesystem allows, existing `to` is replaced.
+    // Hardlinked files share contents with the original, they must be replaced and never modified in place.
+    StageMethod stage_file(const std::filesystem::path &from, const std::filesystem::path &to, bool allow_hardlink = true);
+}
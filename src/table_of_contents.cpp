@@ -1,17 +1,71 @@
-#include <regex>
+#include <algorithm>
 
 #include "table_of_contents.hpp"
-#include "helpers.hpp"
 #include "project.hpp"
 
 
 
-// Converts to hhc format. Toc item is treated as root, all members except children are not needed.
-std::string chm::TableOfContentsItem::to_hhc(const std::filesystem::path& temp_path) const {
-    std::string ret = "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
+chm::TableOfContents::TableOfContents() {
+    items.emplace_back();
+}
+
+
+chm::TableOfContents::ItemId chm::TableOfContents::add(ItemId parent, std::string_view name, FileId file_link, std::string_view fragment) {
+    ItemId id = items.size();
+
+    Item item = {
+        .name_offset = (std::uint32_t)strings.size(),
+        .name_size = (std::uint32_t)name.size(),
+        .fragment_offset = (std::uint32_t)(strings.size() + name.size()),
+        .fragment_size = (std::uint32_t)fragment.size(),
+        .file_link = file_link,
+    };
+
+    strings += name;
+    strings += fragment;
+    items.push_back(item);
+
+    Item &parent_item = items[parent];
+    if (parent_item.last_child == none) {
+        parent_item.first_child = id;
+    } else {
+        items[parent_item.last_child].next_sibling = id;
+    }
+    parent_item.last_child = id;
+
+    return id;
+}
+
+
+void chm::TableOfContents::append(ItemId parent, const TableOfContents &other) {
+    // pairs of (item in other, parent in this)
+    std::vector<std::pair<ItemId, ItemId>> stack;
+
+    for (ItemId i = other[root].first_child; i != none; i = other[i].next_sibling) {
+        stack.push_back({i, parent});
+    }
+    std::reverse(stack.begin(), stack.end());
+
+    while (!stack.empty()) {
+        auto [other_id, new_parent] = stack.back();
+        stack.pop_back();
+
+        ItemId id = add(new_parent, other.name(other_id), other[other_id].file_link, other.fragment(other_id));
+
+        size_t children_begin = stack.size();
+        for (ItemId i = other[other_id].first_child; i != none; i = other[i].next_sibling) {
+            stack.push_back({i, id});
+        }
+        std::reverse(stack.begin() + children_begin, stack.end());
+    }
+}
+
+
+void chm::TableOfContents::write_hhc(std::ostream &out, const ProjectFiles &files) const {
+    out << "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML//EN\">\n"
     "<HTML>\n"
     "<HEAD>\n"
-        "<meta name=\"GENERATOR\"content=\"ghwiki2chm test\">\n"
+        "<meta name=\"GENERATOR\" content=\"ghwiki2chm test\">\n"
         "<!-- Sitemap 1.0 -->\n"
     "</HEAD>\n"
     "<BODY>\n"
@@ -20,43 +74,47 @@ std::string chm::TableOfContentsItem::to_hhc(const std::filesystem::path& temp_p
         "</OBJECT>\n"
     "<UL>\n";
 
-    for (auto &&i : children) {
-        ret += i.to_hhc_entry(temp_path);
-    }
-    ret += "</UL>\n"
+    // Next sibling of every item whose children are being written.
+    std::vector<ItemId> stack;
+    ItemId id = items[root].first_child;
 
-    "</BODY>\n"
-    "</HTML>\n";
+    while (true) {
+        if (id == none) {
+            if (stack.empty()) {
+                break;
+            }
+            out << "</UL>\n";
+            id = stack.back();
+            stack.pop_back();
+            continue;
+        }
 
-    return ret;
-}
+        auto &item = items[id];
 
-// Converts item to hhc format. Recursive.
-std::string chm::TableOfContentsItem::to_hhc_entry(const std::filesystem::path& temp_path) const {
-    std::string ret = "<LI> <OBJECT type=\"text/sitemap\">\n";
-    ret += "<param name=\"Name\" value=\"" + name + "\">\n";
+        out << "<LI> <OBJECT type=\"text/sitemap\">\n";
+        out << "<param name=\"Name\" value=\"" << name(id) << "\">\n";
 
-    if(file_link) {
-        std::string link = std::filesystem::relative(file_link->target, temp_path).string();
-        if(!fragment.empty()) {
-            link += "#" + fragment;
+        if (item.file_link != no_file) {
+            out << "<param name=\"Local\" value=\"" << files.link(item.file_link);
+            if (item.fragment_size) {
+                out << "#" << fragment(id);
+            }
+            out << "\">\n";
         }
-        ret += "<param name=\"Local\" value=\"" + link + "\">\n";
-    }
-
-    ret += "</OBJECT>\n";
 
-    if(children.empty()) {
-        return ret;
-    }
+        out << "</OBJECT>\n";
 
-    ret += "<UL>\n";
+        if (item.first_child == none) {
+            id = item.next_sibling;
+            continue;
+        }
 
-    for (auto &&i : children) {
-        ret += i.to_hhc_entry(temp_path);
+        out << "<UL>\n";
+        stack.push_back(item.next_sibling);
+        id = item.first_child;
     }
 
-    ret += "</UL>\n";
-
-    return ret;
-}
\ No newline at end of file
+    out << "</UL>\n"
+    "</BODY>\n"
+    "</HTML>\n";
+}
@@ -1,22 +1,48 @@
 #pragma once
 
-#include <filesystem>
-#include <list>
+#include <cstdint>
+#include <ostream>
 #include <string>
+#include <string_view>
+#include <vector>
 
+#include "project_file.hpp"
 
 
 namespace chm {
-    struct ProjectFile;
+    // TOC tree stored in flat arrays, items reference each other by index.
+    // Names and fragments of all items are stored in one string arena.
+    class TableOfContents {
+    public:
+        using ItemId = std::uint32_t;
+        static constexpr ItemId root = 0;
+        static constexpr ItemId none = UINT32_MAX;
 
-    struct TableOfContentsItem {
-        std::string name;                                   // Name displayed in TOC tree
-        std::string fragment;                               // HTML page fragment tag id
-        ProjectFile *file_link = nullptr;
-        std::list<TableOfContentsItem> children;
-        // TableOfContentsItem *parent = nullptr;
+        struct Item {
+            std::uint32_t name_offset = 0, name_size = 0;           // Name displayed in TOC tree
+            std::uint32_t fragment_offset = 0, fragment_size = 0;   // HTML page fragment tag id
+            FileId file_link = no_file;
+            ItemId first_child = none;
+            ItemId last_child = none;
+            ItemId next_sibling = none;
+        };
 
-        std::string to_hhc(const std::filesystem::path& temp_path) const;
-        std::string to_hhc_entry(const std::filesystem::path& temp_path) const;
+        TableOfContents();
+
+        ItemId add(ItemId parent, std::string_view name, FileId file_link = no_file, std::string_view fragment = {});
+        // Copies all children of other root under parent.
+        void append(ItemId parent, const TableOfContents &other);
+
+        const Item& operator[](ItemId id) const { return items[id]; }
+        std::string_view name(ItemId id) const { return std::string_view(strings).substr(items[id].name_offset, items[id].name_size); }
+        std::string_view fragment(ItemId id) const { return std::string_view(strings).substr(items[id].fragment_offset, items[id].fragment_size); }
+        size_t size() const { return items.size(); }
+
+        // Writes hhc format in one depth first pass. Root item is not written, only its children.
+        void write_hhc(std::ostream &out, const ProjectFiles &files) const;
+
+    private:
+        std::vector<Item> items;
+        std::string strings;
     };
-}
\ No newline at end of file
+}
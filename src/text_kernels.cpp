@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <atomic>
+#include <bit>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CHM_TEXT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#include "text_kernels.hpp"
+
+
+
+// MSVC allows intrinsics of any instruction set everywhere, gcc and clang need them enabled per function.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+
+
+// Matchers describe a set of bytes, every find function is instantiated for every matcher.
+// SIMD variants return all ones in lanes of matching bytes.
+
+#ifdef CHM_TEXT_X86
+// x - first <= count - 1, as unsigned bytes. SSE2 has no unsigned compare, but has unsigned min.
+TARGET_SSE2 static inline __m128i in_range(__m128i v, char first, char count) {
+    __m128i x = _mm_sub_epi8(v, _mm_set1_epi8(first));
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(count - 1)), x);
+}
+
+TARGET_AVX2 static inline __m256i in_range(__m256i v, char first, char count) {
+    __m256i x = _mm256_sub_epi8(v, _mm256_set1_epi8(first));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(count - 1)), x);
+}
+#endif
+
+
+struct AnyOf {
+    char chars[4];
+
+    explicit AnyOf(std::string_view set) {
+        for (size_t i = 0; i < 4; i++) {
+            chars[i] = set[std::min(i, set.size() - 1)];
+        }
+    }
+
+    bool scalar(char c) const {
+        return c == chars[0] || c == chars[1] || c == chars[2] || c == chars[3];
+    }
+
+    #ifdef CHM_TEXT_X86
+    TARGET_SSE2 __m128i sse2(__m128i v) const {
+        return _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(chars[0])), _mm_cmpeq_epi8(v, _mm_set1_epi8(chars[1]))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(chars[2])), _mm_cmpeq_epi8(v, _mm_set1_epi8(chars[3]))));
+    }
+
+    TARGET_AVX2 __m256i avx2(__m256i v) const {
+        return _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(chars[0])), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(chars[1]))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(chars[2])), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(chars[3]))));
+    }
+    #endif
+};
+
+// ' ' and '\t' to '\r'
+struct Space {
+    bool scalar(char c) const {
+        return chm::text::is_space(c);
+    }
+
+    #ifdef CHM_TEXT_X86
+    TARGET_SSE2 __m128i sse2(__m128i v) const {
+        return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), in_range(v, '\t', 5));
+    }
+
+    TARGET_AVX2 __m256i avx2(__m256i v) const {
+        return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), in_range(v, '\t', 5));
+    }
+    #endif
+};
+
+// 'a' to 'z' and '0' to '9'
+struct LowerAlnum {
+    bool scalar(char c) const {
+        return chm::text::is_lower_alnum(c);
+    }
+
+    #ifdef CHM_TEXT_X86
+    TARGET_SSE2 __m128i sse2(__m128i v) const {
+        return _mm_or_si128(in_range(v, 'a', 26), in_range(v, '0', 10));
+    }
+
+    TARGET_AVX2 __m256i avx2(__m256i v) const {
+        return _mm256_or_si256(in_range(v, 'a', 26), in_range(v, '0', 10));
+    }
+    #endif
+};
+
+// 'A' to 'Z' and whitespace
+struct UpperOrSpace {
+    bool scalar(char c) const {
+        return chm::text::is_upper(c) || chm::text::is_space(c);
+    }
+
+    #ifdef CHM_TEXT_X86
+    TARGET_SSE2 __m128i sse2(__m128i v) const {
+        return _mm_or_si128(in_range(v, 'A', 26), Space().sse2(v));
+    }
+
+    TARGET_AVX2 __m256i avx2(__m256i v) const {
+        return _mm256_or_si256(in_range(v, 'A', 26), Space().avx2(v));
+    }
+    #endif
+};
+
+
+
+// `match` false searches for first byte not matching.
+template<bool match, typename Matcher>
+static size_t find_scalar(const char *data, size_t size, size_t pos, const Matcher &matcher) {
+    for (; pos < size; pos++) {
+        if (matcher.scalar(data[pos]) == match) {
+            return pos;
+        }
+    }
+    return size;
+}
+
+template<typename Matcher>
+static size_t rfind_not_scalar(const char *data, size_t end, const Matcher &matcher) {
+    while (end > 0 && matcher.scalar(data[end - 1])) {
+        end--;
+    }
+    return end;
+}
+
+
+#ifdef CHM_TEXT_X86
+template<bool match, typename Matcher>
+TARGET_SSE2 static size_t find_sse2(const char *data, size_t size, size_t pos, const Matcher &matcher) {
+    for (; pos + 16 <= size; pos += 16) {
+        unsigned mask = _mm_movemask_epi8(matcher.sse2(_mm_loadu_si128((const __m128i*)(data + pos))));
+        if (!match) {
+            mask = ~mask & 0xffff;
+        }
+        if (mask) {
+            return pos + std::countr_zero(mask);
+        }
+    }
+    return find_scalar<match>(data, size, pos, matcher);
+}
+
+template<typename Matcher>
+TARGET_SSE2 static size_t rfind_not_sse2(const char *data, size_t end, const Matcher &matcher) {
+    for (; end >= 16; end -= 16) {
+        unsigned mask = ~_mm_movemask_epi8(matcher.sse2(_mm_loadu_si128((const __m128i*)(data + end - 16)))) & 0xffff;
+        if (mask) {
+            return end - 16 + std::bit_width(mask);
+        }
+    }
+    return rfind_not_scalar(data, end, matcher);
+}
+
+
+template<bool match, typename Matcher>
+TARGET_AVX2 static size_t find_avx2(const char *data, size_t size, size_t pos, const Matcher &matcher) {
+    for (; pos + 32 <= size; pos += 32) {
+        unsigned mask = _mm256_movemask_epi8(matcher.avx2(_mm256_loadu_si256((const __m256i*)(data + pos))));
+        if (!match) {
+            mask = ~mask;
+        }
+        if (mask) {
+            return pos + std::countr_zero(mask);
+        }
+    }
+    return find_sse2<match>(data, size, pos, matcher);
+}
+
+template<typename Matcher>
+TARGET_AVX2 static size_t rfind_not_avx2(const char *data, size_t end, const Matcher &matcher) {
+    for (; end >= 32; end -= 32) {
+        unsigned mask = ~_mm256_movemask_epi8(matcher.avx2(_mm256_loadu_si256((const __m256i*)(data + end - 32))));
+        if (mask) {
+            return end - 32 + std::bit_width(mask);
+        }
+    }
+    return rfind_not_sse2(data, end, matcher);
+}
+#endif
+
+
+
+chm::text::Level chm::text::supported_level() {
+    #ifdef CHM_TEXT_X86
+        #if defined(__GNUC__) || defined(__clang__)
+        // Called during static initialization, cpu info might not be filled in yet.
+        __builtin_cpu_init();
+
+        // Also checks if OS saves AVX registers.
+        if (__builtin_cpu_supports("avx2")) {
+            return Level::avx2;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            return Level::sse2;
+        }
+        #else
+        int info[4];
+        __cpuid(info, 1);
+        bool has_sse2 = info[3] & (1 << 26);
+        bool os_saves_avx = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+
+        __cpuidex(info, 7, 0);
+        bool has_avx2 = info[1] & (1 << 5);
+
+        if (has_avx2 && os_saves_avx) {
+            return Level::avx2;
+        }
+        if (has_sse2) {
+            return Level::sse2;
+        }
+        #endif
+    #endif
+
+    return Level::scalar;
+}
+
+
+static std::atomic<chm::text::Level> current_level = chm::text::supported_level();
+
+chm::text::Level chm::text::active_level() {
+    return current_level.load(std::memory_order_relaxed);
+}
+
+chm::text::Level chm::text::set_level(Level level) {
+    return current_level.exchange(std::min(level, supported_level()));
+}
+
+
+template<bool match, typename Matcher>
+static size_t find(std::string_view text, size_t pos, const Matcher &matcher) {
+    if (pos >= text.size()) {
+        return text.size();
+    }
+
+    switch (current_level.load(std::memory_order_relaxed)) {
+    #ifdef CHM_TEXT_X86
+    case chm::text::Level::avx2:
+        return find_avx2<match>(text.data(), text.size(), pos, matcher);
+    case chm::text::Level::sse2:
+        return find_sse2<match>(text.data(), text.size(), pos, matcher);
+    #endif
+    default:
+        return find_scalar<match>(text.data(), text.size(), pos, matcher);
+    }
+}
+
+
+size_t chm::text::find_first_of(std::string_view text, size_t pos, std::string_view chars) {
+    if (chars.empty()) {
+        return text.size();
+    }
+    return find<true>(text, pos, AnyOf(chars.substr(0, 4)));
+}
+
+size_t chm::text::find_not_space(std::string_view text, size_t pos) {
+    return find<false>(text, pos, Space());
+}
+
+size_t chm::text::rfind_not_space_end(std::string_view text) {
+    switch (current_level.load(std::memory_order_relaxed)) {
+    #ifdef CHM_TEXT_X86
+    case Level::avx2:
+        return rfind_not_avx2(text.data(), text.size(), Space());
+    case Level::sse2:
+        return rfind_not_sse2(text.data(), text.size(), Space());
+    #endif
+    default:
+        return rfind_not_scalar(text.data(), text.size(), Space());
+    }
+}
+
+size_t chm::text::find_not_lower_alnum(std::string_view text, size_t pos) {
+    return find<false>(text, pos, LowerAlnum());
+}
+
+size_t chm::text::find_upper_or_space(std::string_view text, size_t pos) {
+    return find<true>(text, pos, UpperOrSpace());
+}
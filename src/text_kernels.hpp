@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+
+// Byte search primitives used by html and text helpers.
+// On x86 they check 16 (SSE2) or 32 (AVX2) bytes at once, picked at runtime. Other platforms use scalar loops.
+// Callers find the next interesting byte and copy everything before it in one go, instead of looking at every char.
+namespace chm::text {
+    // Same as std::isspace in "C" locale, but doesn't depend on locale and is safe for negative chars.
+    constexpr bool is_space(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    constexpr bool is_upper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    constexpr bool is_lower_alnum(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+    }
+
+    constexpr char to_lower(char c) {
+        return is_upper(c) ? c + ('a' - 'A') : c;
+    }
+
+
+    // Find functions return text.size() if nothing was found.
+
+    // Position of first of up to 4 `chars` at or after pos.
+    size_t find_first_of(std::string_view text, size_t pos, std::string_view chars);
+    // Position of first non whitespace char at or after pos.
+    size_t find_not_space(std::string_view text, size_t pos = 0);
+    // Position after the last non whitespace char, 0 if text is all whitespace.
+    size_t rfind_not_space_end(std::string_view text);
+    // Position of first char that is not a lower case letter or digit.
+    size_t find_not_lower_alnum(std::string_view text, size_t pos = 0);
+    // Position of first upper case letter or whitespace.
+    size_t find_upper_or_space(std::string_view text, size_t pos = 0);
+
+
+    enum class Level : std::uint8_t {
+        scalar,
+        sse2,
+        avx2,
+    };
+
+    // Best level supported by this cpu.
+    Level supported_level();
+    // Level used by all functions, defaults to supported_level().
+    Level active_level();
+    // Forces a lower level for all threads, used by benchmarks to compare implementations. Returns the previous level.
+    Level set_level(Level level);
+}
@@ -1,90 +1,225 @@
-#include <regex>
+#include <fstream>
+#include <iterator>
 
 #include "project.hpp"
+#include "alloc_profile.hpp"
 #include "helpers.hpp"
+#include "text_kernels.hpp"
 
 
 
-// TODO: This is ugly
-chm::TableOfContentsItem chm::create_toc_entries_from_sidebar(const ProjectConfig &config, ProjectData &data, std::filesystem::path sidebar_path) {
-    std::string html_out = convert_markdown_file_to_html(sidebar_path);
+// Length of list item marker "* ", "- ", "+ ", "1. " or "1) " and spaces after it, 0 if line doesn't start with one.
+static size_t list_marker_size(std::string_view line) {
+    size_t pos = 0;
+    if (!line.empty() && (line[0] == '*' || line[0] == '-' || line[0] == '+')) {
+        pos = 1;
+    } else {
+        while (pos < line.size() && line[pos] >= '0' && line[pos] <= '9') {
+            pos++;
+        }
+        if (pos == 0 || pos > 9 || pos == line.size() || (line[pos] != '.' && line[pos] != ')')) {
+            return 0;
+        }
+        pos++;
+    }
 
-    std::string_view tag_name_and_attribs;
-    std::string_view tag_contents;
+    // Marker must be followed by whitespace, otherwise it's *emphasis*, --- rule or a number.
+    if (pos < line.size() && line[pos] != ' ' && line[pos] != '\t') {
+        return 0;
+    }
+    return chm::text::find_not_space(line, pos);
+}
 
-    std::string::iterator tag_open_index = html_out.begin();
-    std::string::iterator tag_contents_begin_index = html_out.begin();
 
-    // tokenizer state
-    bool inside_tag = false;
+// Appends text without emphasis and code markers.
+static void append_without_markers(std::string &name, std::string_view text) {
+    for (size_t pos = 0; pos < text.size();) {
+        size_t marker = chm::text::find_first_of(text, pos, "*`~");
+        name += text.substr(pos, marker - pos);
+        pos = marker + 1;
+    }
+}
+
+// Item name without markdown and html, and target of the last link in it, like a browser would show the rendered item.
+// Knows [text](target), [[Page]], [[text|Page]], <a href="target">, images, emphasis, code and escapes.
+static void parse_item_text(std::string_view text, std::string &name, std::string &link) {
+    for (size_t pos = 0; pos < text.size(); pos++) {
+        // Plain text up to the next escape, link or tag is copied at once.
+        size_t special = chm::text::find_first_of(text, pos, "\\[!<");
+        append_without_markers(name, text.substr(pos, special - pos));
+        if (special == text.size()) {
+            break;
+        }
+        pos = special;
+        char c = text[pos];
 
-    // toc item creation state
-    bool inside_item_name = false;
-    bool was_added = false;
+        if (c == '\\' && pos + 1 < text.size()) {
+            name += text[++pos];
+        }
+        else if (c == '[' && text.substr(pos).starts_with("[[")) {
+            size_t end = text.find("]]", pos + 2);
+            if (end == std::string_view::npos) {
+                name += c;
+                continue;
+            }
 
-    std::regex link_tag_test("\\s*a\\s+href=\"(.*?)\"\\s*");
-    std::match_results<std::string_view::const_iterator> match;
+            std::string_view wiki_link = text.substr(pos + 2, end - pos - 2);
+            size_t separator = wiki_link.find('|');
+            name += wiki_link.substr(0, separator);
+            link = trim_whitespace(separator == std::string_view::npos ? wiki_link : wiki_link.substr(separator + 1));
+            pos = end + 1;
+        }
+        else if (c == '[' || (c == '!' && text.substr(pos).starts_with("!["))) {
+            size_t text_begin = pos + (c == '!' ? 2 : 1);
+            size_t text_end = text.find("](", text_begin);
+            size_t target_end = text_end == std::string_view::npos ? std::string_view::npos : text.find(')', text_end + 2);
+            if (target_end == std::string_view::npos) {
+                name += c;
+                continue;
+            }
 
+            // Images show nothing in the TOC, same as their <img> tags.
+            if (c == '[') {
+                parse_item_text(text.substr(text_begin, text_end - text_begin), name, link);
 
-    TableOfContentsItem temp_toc_root;
-    TableOfContentsItem temp_toc_item;
+                // Target may be in <> and have a "title" after it.
+                std::string_view target = trim_whitespace(text.substr(text_end + 2, target_end - text_end - 2));
+                if (target.starts_with('<')) {
+                    target = target.substr(1, target.find('>') - 1);
+                } else {
+                    target = target.substr(0, target.find_first_of(" \t"));
+                }
+                link = target;
+            }
+            pos = target_end;
+        }
+        else if (c == '<') {
+            size_t end = text.find('>', pos);
+            if (end == std::string_view::npos) {
+                name += c;
+                continue;
+            }
 
-    std::vector<TableOfContentsItem*> toc_tree_ptrs;
-    toc_tree_ptrs.push_back(&temp_toc_root);
+            std::string_view tag = text.substr(pos + 1, end - pos - 1);
+            if (tag.starts_with("a ")) {
+                if (size_t href = tag.find("href=\""); href != std::string_view::npos) {
+                    tag.remove_prefix(href + 6);
+                    link = tag.substr(0, tag.find('"'));
+                }
+            }
+            pos = end;
+        }
+        else {
+            name += c;
+        }
+    }
+}
 
-    for (std::string::iterator it = html_out.begin(); it != html_out.end(); it++) {
-        char &c = *it;
 
-        if (c == '<' && !inside_tag) {
-            inside_tag = true;
-            tag_open_index = it + 1;
 
-            tag_contents = std::string_view(tag_contents_begin_index, it);
-        }
-        else if (c == '>' && inside_tag) {
-            inside_tag = false;
-            tag_name_and_attribs = std::string_view(tag_open_index, it);
+chm::TableOfContents chm::create_toc_entries_from_sidebar(const ProjectConfig &config, const ProjectData &data, const std::filesystem::path &sidebar_path) {
+    // Runs on its own thread while pages convert.
+    alloc_profile::Site site("sidebar toc");
+    std::ifstream file(sidebar_path, std::ios::binary);
+    std::string markdown((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
 
-            tag_contents_begin_index = it + 1;
+    TableOfContents toc;
 
+    // Items that contain the current line, innermost last.
+    struct Level {
+        size_t indent;
+        TableOfContents::ItemId id;
+    };
+    std::vector<Level> levels;
 
-            if(inside_item_name) {
-                temp_toc_item.name += tag_contents;
-            }
+    // Item isn't added until the next item or the end of the list, its text may continue on next lines.
+    bool has_item = false;
+    size_t item_indent = 0;
+    std::string item_text;
 
-            if (tag_name_and_attribs == "li") {
-                inside_item_name = true;
-                temp_toc_item = {};
-                was_added = false;
-            }
-            else if (tag_name_and_attribs == "/li") {
-                inside_item_name = false;
-                if (!was_added) {
-                    temp_toc_item.name = trim_whitespace(remove_hashes(temp_toc_item.name));
-                    toc_tree_ptrs.back()->children.push_back(temp_toc_item);
-                    was_added = true;
-                }
-            }
-            else if (tag_name_and_attribs == "ul") {
-                inside_item_name = false;
-                if (!was_added && !temp_toc_item.name.empty() && toc_tree_ptrs.size() > 0) {
-                    temp_toc_item.name = trim_whitespace(remove_hashes(temp_toc_item.name));
-                    toc_tree_ptrs.back()->children.push_back(temp_toc_item);
-                    toc_tree_ptrs.push_back(&toc_tree_ptrs.back()->children.back());
-                    was_added = true;
+    auto add_item = [&](bool has_children) {
+        if (!has_item) {
+            return;
+        }
+        has_item = false;
+
+        std::string text, link;
+        parse_item_text(item_text, text, link);
+
+        // Whitespace is collapsed like in rendered html.
+        std::string without_hashes = remove_hashes(text);
+        std::string_view trimmed = trim_whitespace(without_hashes);
+        std::string name;
+        for (size_t pos = 0; pos < trimmed.size(); pos = text::find_not_space(trimmed, pos)) {
+            size_t end = text::find_first_of(trimmed, pos, " \n\t");
+            // \r, \v and \f are rare, handle them here instead of in the search.
+            for (size_t i = pos; i < end; i++) {
+                if (text::is_space(trimmed[i])) {
+                    end = i;
+                    break;
                 }
             }
-            else if (tag_name_and_attribs == "/ul") {
-                if (toc_tree_ptrs.size() > 0) {
-                    toc_tree_ptrs.pop_back();
-                }
+            name += trimmed.substr(pos, end - pos);
+            if (end == trimmed.size()) {
+                break;
             }
-            else if (inside_item_name && std::regex_match(tag_name_and_attribs.begin(), tag_name_and_attribs.end(), match, link_tag_test)) {
-                temp_toc_item.file_link = find_local_file_pointed_by_url(config, data, match[1]);
+            name += ' ';
+            pos = end;
+        }
+
+        auto parent = levels.empty() ? TableOfContents::root : levels.back().id;
+
+        // Item without a name only groups its children, they are added to its parent instead.
+        if (name.empty() && has_children) {
+            levels.push_back({item_indent, parent});
+            return;
+        }
+
+        FileId file_link = link.empty() ? no_file : find_local_file_pointed_by_url(config, data, link);
+        levels.push_back({item_indent, toc.add(parent, name, file_link)});
+    };
+
+    std::string_view text(markdown);
+    while (!text.empty()) {
+        std::string_view line = text.substr(0, text.find('\n'));
+        text.remove_prefix(std::min(line.size() + 1, text.size()));
+        if (line.ends_with('\r')) {
+            line.remove_suffix(1);
+        }
+
+        // Tabs are 4 columns wide, same as markdown counts them.
+        size_t indent = 0, pos = 0;
+        for (; pos < line.size() && (line[pos] == ' ' || line[pos] == '\t'); pos++) {
+            indent = line[pos] == '\t' ? indent / 4 * 4 + 4 : indent + 1;
+        }
+        line.remove_prefix(pos);
+
+        // Blank lines don't end a list.
+        if (line.empty()) {
+            continue;
+        }
+
+        if (size_t marker = list_marker_size(line)) {
+            add_item(has_item && indent > item_indent);
+            while (!levels.empty() && levels.back().indent >= indent) {
+                levels.pop_back();
             }
+
+            has_item = true;
+            item_indent = indent;
+            item_text = line.substr(marker);
+        }
+        else if (has_item && indent > 0) {
+            item_text += ' ';
+            item_text += line;
+        }
+        else if (indent == 0) {
+            // Heading or paragraph after the list
+            add_item(false);
+            levels.clear();
         }
     }
+    add_item(false);
 
-
-    return temp_toc_root;
-}
\ No newline at end of file
+    return toc;
+}
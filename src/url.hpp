@@ -0,0 +1,172 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+
+
+// Allocation free url splitting (https://www.rfc-editor.org/rfc/rfc3986#appendix-B), all parts are views of the original string.
+namespace chm::url {
+    enum class Kind : std::uint8_t {
+        empty,      // ""
+        external,   // Has a scheme or authority, like https://example.com or mailto:someone
+        anchor,     // Only a fragment, like #section
+        page,       // Relative path to a page, like Some-Page, ./Some-Page.md or page.html#section
+        asset,      // Relative path to other file, like images/logo.png
+    };
+
+    struct Parts {
+        std::string_view scheme;
+        std::string_view host;      // Without user info and port
+        std::string_view path;
+        std::string_view query;
+        std::string_view fragment;
+        Kind kind = Kind::empty;
+    };
+
+
+    namespace detail {
+        constexpr std::array<bool, 256> make_table(std::string_view chars) {
+            std::array<bool, 256> table = {};
+            for (auto c : chars) {
+                table[(std::uint8_t)c] = true;
+            }
+            return table;
+        }
+
+        constexpr auto scheme_first_chars = make_table("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ");
+        constexpr auto scheme_chars = make_table("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+        constexpr auto authority_end_chars = make_table("/?#");
+        constexpr auto path_end_chars = make_table("?#");
+
+        constexpr size_t find(std::string_view str, const std::array<bool, 256> &table, size_t pos = 0) {
+            for (; pos < str.size(); pos++) {
+                if (table[(std::uint8_t)str[pos]]) {
+                    return pos;
+                }
+            }
+            return str.size();
+        }
+
+        // Extensions of files that are converted to pages.
+        constexpr bool is_page_extension(std::string_view ext) {
+            auto equals_ignore_case = [](std::string_view a, std::string_view b) {
+                if (a.size() != b.size()) {
+                    return false;
+                }
+                for (size_t i = 0; i < a.size(); i++) {
+                    char c = a[i];
+                    if (c >= 'A' && c <= 'Z') {
+                        c += 'a' - 'A';
+                    }
+                    if (c != b[i]) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            return equals_ignore_case(ext, ".md") || equals_ignore_case(ext, ".html") || equals_ignore_case(ext, ".htm");
+        }
+    }
+
+
+    constexpr Parts split(std::string_view url) {
+        Parts parts;
+        size_t pos = 0;
+
+        // scheme ":"
+        if (!url.empty() && detail::scheme_first_chars[(std::uint8_t)url[0]]) {
+            size_t end = 1;
+            while (end < url.size() && detail::scheme_chars[(std::uint8_t)url[end]]) {
+                end++;
+            }
+            if (end < url.size() && url[end] == ':') {
+                parts.scheme = url.substr(0, end);
+                pos = end + 1;
+            }
+        }
+
+        // "//" authority
+        bool has_authority = false;
+        if (url.substr(pos).starts_with("//")) {
+            has_authority = true;
+            size_t end = detail::find(url, detail::authority_end_chars, pos + 2);
+            std::string_view authority = url.substr(pos + 2, end - pos - 2);
+            pos = end;
+
+            if (size_t at = authority.rfind('@'); at != std::string_view::npos) {
+                authority.remove_prefix(at + 1);
+            }
+
+            if (authority.starts_with('[')) {
+                // IPv6 address
+                size_t close = authority.find(']');
+                authority = authority.substr(0, close == std::string_view::npos ? authority.size() : close + 1);
+            } else if (size_t colon = authority.rfind(':'); colon != std::string_view::npos) {
+                authority = authority.substr(0, colon);
+            }
+
+            parts.host = authority;
+        }
+
+        size_t path_end = detail::find(url, detail::path_end_chars, pos);
+        parts.path = url.substr(pos, path_end - pos);
+        pos = path_end;
+
+        if (pos < url.size() && url[pos] == '?') {
+            size_t end = url.find('#', pos);
+            end = end == std::string_view::npos ? url.size() : end;
+            parts.query = url.substr(pos + 1, end - pos - 1);
+            pos = end;
+        }
+
+        if (pos < url.size() && url[pos] == '#') {
+            parts.fragment = url.substr(pos + 1);
+        }
+
+
+        if (url.empty()) {
+            parts.kind = Kind::empty;
+        }
+        else if (!parts.scheme.empty() || has_authority) {
+            parts.kind = Kind::external;
+        }
+        else if (parts.path.empty()) {
+            parts.kind = Kind::anchor;
+        }
+        else {
+            std::string_view file_name = parts.path.substr(parts.path.rfind('/') + 1);
+            size_t dot = file_name.rfind('.');
+            bool is_page = dot == std::string_view::npos || dot == 0 || detail::is_page_extension(file_name.substr(dot));
+            parts.kind = is_page ? Kind::page : Kind::asset;
+        }
+
+        return parts;
+    }
+
+
+    // Path of relative link without leading "./" and "/", links are relative to wiki root.
+    constexpr std::string_view local_path(const Parts &parts) {
+        std::string_view path = parts.path;
+        while (true) {
+            if (path.starts_with("./")) {
+                path.remove_prefix(2);
+            } else if (path.starts_with('/')) {
+                path.remove_prefix(1);
+            } else {
+                return path;
+            }
+        }
+    }
+
+
+    static_assert(split("https://user@example.com:8080/a/b.png?x=1#top").host == "example.com");
+    static_assert(split("https://example.com/a/b.png?x=1#top").path == "/a/b.png");
+    static_assert(split("Some-Page#section").kind == Kind::page);
+    static_assert(split("./images/logo.png").kind == Kind::asset);
+    static_assert(split("#section").kind == Kind::anchor);
+    static_assert(split("mailto:someone@example.com").kind == Kind::external);
+    static_assert(local_path(split("./dir/Page.md")) == "dir/Page.md");
+}
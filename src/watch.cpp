@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <RUtils/ForEach.hpp>
+
+#include "watch.hpp"
+#include "compiler.hpp"
+#include "helpers.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+
+
+#ifdef __linux__
+// Files that changed during one burst of edits, paths are relative to root.
+struct Changes {
+    std::set<std::string> written;      // Existing files that were saved
+    std::set<std::string> moved;        // Files that were created, deleted or renamed
+    bool directories = false;           // Directory was created, deleted or renamed, files in it aren't listed
+    bool overflow = false;              // Kernel dropped some events, anything could have changed
+    Clock::time_point first_change;
+};
+
+
+// Watches root path and every directory in it except temp path.
+class DirectoryWatcher {
+public:
+    DirectoryWatcher(const chm::ProjectConfig &config) : config(config) {
+        fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd >= 0) {
+            add(config.root);
+        }
+    }
+
+    ~DirectoryWatcher() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool valid() const { return fd >= 0; }
+
+    // Blocks until something changes, then collects changes until there were none for debounce time.
+    Changes wait(std::chrono::milliseconds debounce) {
+        Changes changes;
+
+        pollfd poll_fd = {.fd = fd, .events = POLLIN};
+        poll(&poll_fd, 1, -1);
+        changes.first_change = Clock::now();
+
+        do {
+            read_events(changes);
+        } while (poll(&poll_fd, 1, (int)debounce.count()) > 0);
+
+        return changes;
+    }
+
+private:
+    void add(const std::filesystem::path &dir) {
+        // Hidden directories like .git change all the time and have no pages.
+        std::error_code ec;
+        if (std::filesystem::equivalent(dir, config.temp, ec) || (dir != config.root && dir.filename().string().starts_with('.'))) {
+            return;
+        }
+
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+        if (wd < 0) {
+            chm::log::warning("watch_dir_failed", "Failed to watch directory: %s", dir.c_str());
+            return;
+        }
+        dirs[wd] = dir;
+
+        for (auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+            if (entry.is_directory(ec)) {
+                add(entry.path());
+            }
+        }
+    }
+
+    // Watches stay with a directory when it is moved, drop them with its old path. A move inside the project adds them
+    // again under the new path, like a created directory.
+    void remove(const std::filesystem::path &dir) {
+        for (auto it = dirs.begin(); it != dirs.end();) {
+            auto [end, _] = std::mismatch(dir.begin(), dir.end(), it->second.begin(), it->second.end());
+            if (end == dir.end()) {
+                inotify_rm_watch(fd, it->first);
+                it = dirs.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    void read_events(Changes &changes) {
+        alignas(inotify_event) char buffer[64 * 1024];
+
+        ssize_t size;
+        while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char *ptr = buffer; ptr < buffer + size; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len) {
+                auto *event = (inotify_event*)ptr;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    changes.overflow = true;
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    dirs.erase(event->wd);
+                    continue;
+                }
+
+                auto it = dirs.find(event->wd);
+                if (it == dirs.end() || !event->len) {
+                    continue;
+                }
+
+                auto path = it->second / event->name;
+                if (path == config.out_file) {
+                    continue;
+                }
+
+                if (event->mask & IN_ISDIR) {
+                    // Watch new directories, files in them will be found when the project is searched again.
+                    if (event->mask & IN_MOVED_FROM) {
+                        remove(path);
+                    }
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        add(path);
+                    }
+                    changes.directories = true;
+                    continue;
+                }
+
+                auto relative = path.lexically_relative(config.root).generic_string();
+                if (event->mask & IN_CLOSE_WRITE) {
+                    changes.written.insert(relative);
+                } else {
+                    changes.moved.insert(relative);
+                }
+            }
+        }
+    }
+
+    const chm::ProjectConfig &config;
+    int fd = -1;
+    std::unordered_map<int, std::filesystem::path> dirs;
+};
+#endif
+
+
+
+// Every way a link in page source can be written to resolve to the same file, see find_page().
+static void add_link_keys(std::vector<std::string> &keys, std::string_view path, std::string_view name) {
+    keys.push_back(std::string(path));
+    keys.push_back(normalize_page_link(name));
+}
+
+static std::vector<std::string> file_keys(std::string_view original) {
+    std::vector<std::string> keys;
+    add_link_keys(keys, original, original.substr(0, original.rfind('.')));
+    return keys;
+}
+
+// Keys of all local links in page source.
+static std::vector<std::string> scan_page_links(const std::filesystem::path &source) {
+    std::ifstream file(source, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::vector<std::string> keys;
+    for (auto link : chm::scan_text_for_page_links(text)) {
+        auto generic = std::filesystem::path(link).generic_string();
+        add_link_keys(keys, generic, generic);
+    }
+
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return keys;
+}
+
+static bool links_to_any(const std::vector<std::string> &page_links, const std::vector<std::string> &keys) {
+    for (auto &key : keys) {
+        if (std::binary_search(page_links.begin(), page_links.end(), key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_page(std::string_view path) {
+    return path.ends_with(".md") || path.ends_with(".html");
+}
+
+
+
+int chm::watch_project(const ProjectConfig &config, const std::filesystem::path &default_file, ProjectData &data) {
+    #ifndef __linux__
+    log::error("watch_unsupported", "Watch mode is only supported on Linux.");
+    return 1;
+    #else
+    DirectoryWatcher watcher(config);
+    if (!watcher.valid()) {
+        log::error("watch_failed", "Failed to watch root path for changes.");
+        return 1;
+    }
+
+    // Rebuilds change the index in place, so it's kept in memory from now on even with a memory limit.
+    if (!data.index_file.empty()) {
+        data.index = KeywordIndex::read_file(data.index_file);
+        data.index_file.clear();
+    }
+    data.keywords.keep_in_memory();
+
+    // Links found in sources of every page, used to find pages that have to be relinked when pages are added or removed.
+    std::vector<std::vector<std::string>> page_links(data.files.size());
+    auto scan_links = [&](std::span<const FileId> pages) {
+        RUtils::for_each_threaded(pages.begin(), pages.end(), [&](FileId page) {
+            page_links[page] = scan_page_links(data.files.original_path(config.root, page));
+        }, config.max_jobs);
+    };
+    {
+        auto ids = data.files.ids();
+        scan_links(std::vector<FileId>(ids.begin(), ids.end()));
+    }
+
+    auto linked_by_any_page = [&](const std::vector<std::string> &keys) {
+        return std::any_of(page_links.begin(), page_links.end(), [&](auto &links) { return links_to_any(links, keys); });
+    };
+
+    log::info("watching", "Watching %s for changes...", config.root.c_str());
+    while (true) {
+        Changes changes = watcher.wait(std::chrono::milliseconds(config.watch_debounce));
+
+        // Compiler output and other files that don't end up in the chm can be ignored.
+        auto relevant = [&](const std::string &path) {
+            return is_page(path) || data.local_dependencies.find_original(path) != no_file || linked_by_any_page(file_keys(path));
+        };
+
+        bool rescan = changes.overflow || changes.directories;
+        std::vector<std::string> moved;
+        for (auto &path : changes.moved) {
+            if (relevant(path)) {
+                moved.push_back(path);
+                rescan = true;
+            }
+        }
+        std::vector<std::string> written;
+        for (auto &path : changes.written) {
+            if (relevant(path)) {
+                written.push_back(path);
+                // Sidebar isn't a page, but TOC is created from it.
+                rescan |= std::filesystem::path(path).filename() == "_Sidebar.md";
+            }
+        }
+
+        if (!rescan && written.empty()) {
+            continue;
+        }
+        // Any edit can change which pages are reachable.
+        rescan |= config.prune_unreachable;
+
+        std::vector<FileId> pages;
+
+        if (!rescan) {
+            for (auto &path : written) {
+                if (auto it = data.page_lookup.paths.find(path); it != data.page_lookup.paths.end()) {
+                    pages.push_back(it->second);
+                }
+            }
+        } else {
+            auto fresh_or_error = create_project_data_from_ghwiki(config, default_file);
+            if (fresh_or_error.is_error()) {
+                fresh_or_error.error().print();
+                continue;
+            }
+            ProjectData &fresh = fresh_or_error;
+
+            // Files that were added or removed, all pages linking to them have to be converted again.
+            std::vector<std::string> structure_keys;
+            for (auto &path : moved) {
+                auto keys = file_keys(path);
+                structure_keys.insert(structure_keys.end(), keys.begin(), keys.end());
+            }
+
+            std::vector<FileId> new_ids(data.files.size(), no_file);
+            for (FileId id : data.files.ids()) {
+                if (auto it = fresh.page_lookup.paths.find(std::string(data.files.original(id))); it != fresh.page_lookup.paths.end()) {
+                    new_ids[id] = it->second;
+                    continue;
+                }
+
+                auto keys = file_keys(data.files.original(id));
+                structure_keys.insert(structure_keys.end(), keys.begin(), keys.end());
+
+                std::error_code ec;
+                std::filesystem::remove(data.files.target_path(config.temp, id), ec);
+                log::detail("page_removed", "Removed %.*s", (int)data.files.original(id).size(), data.files.original(id).data());
+            }
+
+            std::vector<bool> known(fresh.files.size());
+            std::vector<std::vector<std::string>> fresh_links(fresh.files.size());
+            for (FileId id : data.files.ids()) {
+                if (new_ids[id] != no_file) {
+                    known[new_ids[id]] = true;
+                    fresh_links[new_ids[id]] = std::move(page_links[id]);
+                }
+            }
+            for (FileId id : fresh.files.ids()) {
+                if (!known[id]) {
+                    auto keys = file_keys(fresh.files.original(id));
+                    structure_keys.insert(structure_keys.end(), keys.begin(), keys.end());
+                }
+            }
+            std::sort(structure_keys.begin(), structure_keys.end());
+
+            for (FileId id : fresh.files.ids()) {
+                bool was_written = std::binary_search(written.begin(), written.end(), std::string(fresh.files.original(id)));
+                if (changes.overflow || !known[id] || was_written || links_to_any(structure_keys, fresh_links[id])) {
+                    pages.push_back(id);
+                }
+            }
+
+            // Keep what conversion found in pages that aren't converted again, with new ids.
+            for (auto &entry : data.index) {
+                entry.file_link = new_ids[entry.file_link];
+            }
+            for (auto &dep : data.remote_dependencies) {
+                for (auto &page : dep.referenced_by) {
+                    page = new_ids[page];
+                }
+                std::erase(dep.referenced_by, no_file);
+            }
+
+            fresh.local_dependencies = std::move(data.local_dependencies);
+            fresh.remote_dependencies = std::move(data.remote_dependencies);
+            fresh.index = std::move(data.index);
+            if (!fresh.toc_sidebar.empty()) {
+                fresh.toc.append(fresh.toc_parent, create_toc_entries_from_sidebar(config, fresh, fresh.toc_sidebar));
+            }
+            if (config.toc_generate_automagically) {
+                for (FileId id : fresh.files.ids()) {
+                    fresh.toc.add(fresh.toc_parent, page_name_from_file(fresh.files.link(id)), id);
+                }
+            }
+
+            data = std::move(fresh);
+            page_links = std::move(fresh_links);
+        }
+
+        std::sort(pages.begin(), pages.end());
+        std::vector<bool> converted(data.files.size());
+        for (auto page : pages) {
+            converted[page] = true;
+        }
+
+        // Converted pages find their keywords and dependencies again.
+        std::erase_if(data.index, [&](const KeywordEntry &entry) { return entry.file_link == no_file || converted[entry.file_link]; });
+        for (auto &dep : data.remote_dependencies) {
+            std::erase_if(dep.referenced_by, [&](FileId page) { return converted[page]; });
+        }
+        data.local_dependencies.filter([&](FileId dep) { return std::filesystem::exists(data.local_dependencies.original_path(config.root, dep)); });
+
+        if (config.index_generate) {
+            auto &shard = data.keywords.thread_shard();
+            shard.insert(shard.end(), std::make_move_iterator(data.index.begin()), std::make_move_iterator(data.index.end()));
+        }
+
+        convert_pages(config, data, pages);
+        scan_links(pages);
+
+        // Images no page uses any more.
+        std::erase_if(data.remote_dependencies, [](const RemoteDependency &dep) { return dep.referenced_by.empty(); });
+
+        if (config.index_generate) {
+            data.index = data.keywords.merge(config.max_jobs);
+        }
+
+        // Images that failed before are retried if a page using them changed.
+        for (auto &dep : data.remote_dependencies) {
+            if (dep.state != DownloadState::Finished && std::any_of(dep.referenced_by.begin(), dep.referenced_by.end(), [&](FileId page) { return converted[page]; })) {
+                dep.state = DownloadState::NotStarted;
+                dep.attempts = 0;
+                dep.error.clear();
+            }
+        }
+
+        stage_project_files(config, data);
+        download_dependencies(config, data);
+        if (config.optimize_images) {
+            optimize_images(config, data);
+        }
+        generate_project_files(config, data);
+
+        bool compiled = compile_project(config);
+        if (!config.metrics_file.empty()) {
+            metrics::write_file(config.metrics_file);
+        }
+
+        auto elapsed = std::chrono::duration<double, std::milli>(Clock::now() - changes.first_change);
+        log::info("rebuilt", "%s %zu of %zu pages converted, %.1f ms from first change to chm.",
+            compiled ? "Rebuilt," : "Rebuild failed,", pages.size(), data.files.size(), elapsed.count());
+        log::info("watching", "Watching %s for changes...", config.root.c_str());
+    }
+    #endif
+}
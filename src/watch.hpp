@@ -0,0 +1,14 @@
+#pragma once
+
+#include <filesystem>
+
+#include "project.hpp"
+
+
+
+namespace chm {
+    // Rebuilds the project every time files in root path change, until the program is interrupted.
+    // data has to be already built, it's kept and only changed pages and pages linking to added or removed pages are converted again.
+    // Uses inotify, returns 1 without watching on other platforms.
+    int watch_project(const ProjectConfig &config, const std::filesystem::path &default_file, ProjectData &data);
+}
@@ -0,0 +1,165 @@
+#include <cctype>
+#include <cstdio>
+#include <random>
+
+#include "helpers.hpp"
+#include "text_kernels.hpp"
+
+
+
+// Char at a time versions of helpers, as they were before text kernels. Results of every kernel level must match them.
+namespace reference {
+    static std::string remove_html_tags(std::string_view in) {
+        int tags_inside = 0;
+        bool tag = false;
+        bool is_close_tag = false;
+
+        std::string out;
+
+        for (auto& c : in) {
+            if (c == '<') {
+                tag = true;
+                continue;
+            }
+            if (!tag) {
+                if (tags_inside == 0) {
+                    out += c;
+                }
+                continue;
+            }
+            if (c == '/') {
+                is_close_tag = true;
+            }
+            if (c == '>') {
+                tag = false;
+                if (!is_close_tag) {
+                    tags_inside++;
+                } else {
+                    tags_inside--;
+                    if (tags_inside < 0) {
+                        tags_inside = 0;
+                    }
+                }
+                is_close_tag = false;
+            }
+        }
+
+        return out;
+    }
+
+    static std::string_view trim_whitespace(std::string_view in) {
+        size_t start = 0, end = in.size();
+
+        for (size_t i = 0; i < in.size(); i++) {
+            if (!std::isspace((unsigned char)in[i])) {
+                start = i;
+                break;
+            }
+        }
+
+        for (size_t i = in.size(); i > 0; i--) {
+            if (!std::isspace((unsigned char)in[i - 1])) {
+                end = i;
+                break;
+            }
+        }
+
+        return in.substr(start, end - start);
+    }
+
+    static std::string remove_hashes(std::string_view in) {
+        std::string out;
+        for (auto c : in) {
+            if (c != '#') {
+                out += c;
+            }
+        }
+        return out;
+    }
+
+    static std::string normalize_page_link(std::string_view link) {
+        std::string out(link);
+        for (auto &c : out) {
+            if (std::isspace((unsigned char)c)) {
+                c = '-';
+            }
+            else if (std::isalnum((unsigned char)c)) {
+                c = std::tolower((unsigned char)c);
+            }
+        }
+        return out;
+    }
+
+    static std::string heading_id(std::string_view heading) {
+        std::string out;
+        for (auto c : heading) {
+            if (std::isspace((unsigned char)c)) {
+                out += '-';
+            }
+            if (std::isalnum((unsigned char)c)) {
+                out += std::tolower((unsigned char)c);
+            }
+        }
+        return out;
+    }
+}
+
+
+// Random strings made mostly of bytes kernels look for, with lengths around SIMD block sizes.
+static std::string random_text(std::mt19937 &rng) {
+    static constexpr std::string_view alphabet = "<>/#<>  \t\n\r\v\faAzZ09-_\"\xc3\xa9\x80\xff";
+
+    std::uniform_int_distribution<size_t> length(0, 200);
+    std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+    std::uniform_int_distribution<int> plain_run(0, 3);
+
+    std::string text;
+    size_t size = length(rng);
+    while (text.size() < size) {
+        // Sometimes a longer run of whitespace or text, so whole blocks without hits are tested too.
+        switch (plain_run(rng)) {
+        case 0:
+            text.append(pick(rng) % 40, ' ');
+            break;
+        case 1:
+            text.append(pick(rng) % 40, 'x');
+            break;
+        default:
+            text += alphabet[pick(rng)];
+        }
+    }
+    return text;
+}
+
+
+// Compares every kernel level supported by this cpu with reference code on random inputs.
+int main() {
+    constexpr size_t inputs_per_level = 200000;
+
+    for (int level = 0; level <= (int)chm::text::supported_level(); level++) {
+        chm::text::set_level((chm::text::Level)level);
+
+        std::mt19937 rng(level + 1);
+        for (size_t i = 0; i < inputs_per_level; i++) {
+            std::string text = random_text(rng);
+
+            std::string heading_id;
+            append_heading_id(heading_id, text);
+
+            bool ok = remove_html_tags(text) == reference::remove_html_tags(text)
+                && trim_whitespace(text) == reference::trim_whitespace(text)
+                && trim_whitespace(text).data() == reference::trim_whitespace(text).data()
+                && remove_hashes(text) == reference::remove_hashes(text)
+                && normalize_page_link(text) == reference::normalize_page_link(text)
+                && heading_id == reference::heading_id(text);
+
+            if (!ok) {
+                std::printf("Kernel level %i differs from reference for input: \"%s\"\n", level, text.c_str());
+                return 1;
+            }
+        }
+        std::printf("Kernel level %i matches reference on %zu inputs.\n", level, inputs_per_level);
+    }
+
+    return 0;
+}